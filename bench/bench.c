@@ -0,0 +1,545 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "corpus.h"
+#include "../include/chunkstore.h"
+#include "../include/compress.h"
+#include "../include/contextmodel.h"
+#include "../include/encrypt.h"
+#include "../include/io.h"
+#include "../include/search.h"
+#include "../include/sha256.h"
+#include "../include/sort.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Benchmark harness: runs each kernel on each generated corpus, after
+ * warm-up runs, and prints one JSON object per line with the median and
+ * best time, MB/s, ns/byte and heap allocations per run.
+ */
+
+#define MAX_SIZES 8
+#define MAX_REPS 1000
+#define BENCH_SEED 0x9e3779b97f4a7c15ULL
+#define BENCH_KEY "bench-key-0123456789"
+
+// --- Allocation counting ---
+
+// With BENCH_COUNT_ALLOCATIONS the Makefile links with --wrap for the
+// allocation functions, so every call from the benchmarked code lands here
+#ifdef BENCH_COUNT_ALLOCATIONS
+static size_t allocation_count;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+static size_t allocations(void) {
+    return __atomic_load_n(&allocation_count, __ATOMIC_RELAXED);
+}
+#else
+static size_t allocations(void) {
+    return 0;
+}
+#endif
+
+// --- Kernels ---
+
+// Inputs a kernel needs besides the corpus, prepared outside the timed runs
+typedef struct {
+    const Corpus* corpus;
+    char** blocks;            // Corpus cut into compression blocks
+    size_t* block_sizes;
+    size_t block_count;
+    uint64_t (*frequencies)[256]; // Per block
+    char** compressed;        // huffman_compress output per block
+    size_t* compressed_sizes;
+    char** context_compressed; // context_compress output per block
+    size_t* context_compressed_sizes;
+    char* work;               // Writable copy of every block, for the cipher
+    char* dir;                // Directory holding one file per piece
+    char* path;               // Scratch for file names
+    size_t path_len;
+} BenchState;
+
+typedef int (*KernelFn)(BenchState* state);
+
+typedef struct {
+    const char* name;
+    KernelFn run;
+} Kernel;
+
+static int run_histogram(BenchState* state) {
+    uint64_t frequencies[256];
+    for (size_t i = 0; i < state->block_count; i++) {
+        count_frequencies(state->blocks[i], state->block_sizes[i], frequencies);
+    }
+    return 1;
+}
+
+static int run_tree(BenchState* state) {
+    Arena* arena = thread_arena();
+    if (!arena) {
+        return 0;
+    }
+    for (size_t i = 0; i < state->block_count; i++) {
+        ArenaMark mark = arena_mark(arena);
+        HuffmanNode* root = build_huffman_tree_from_frequencies(state->frequencies[i], arena);
+        arena_rewind(arena, mark);
+        if (!root) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int run_encode(BenchState* state) {
+    for (size_t i = 0; i < state->block_count; i++) {
+        size_t len;
+        char* frame = huffman_compress(state->blocks[i], state->block_sizes[i], &len);
+        if (!frame) {
+            return 0;
+        }
+        free(frame);
+    }
+    return 1;
+}
+
+static int run_decode(BenchState* state) {
+    for (size_t i = 0; i < state->block_count; i++) {
+        size_t len;
+        char* block = huffman_decompress(state->compressed[i], state->compressed_sizes[i], &len);
+        if (!block) {
+            return 0;
+        }
+        free(block);
+    }
+    return 1;
+}
+
+static int run_context_encode(BenchState* state) {
+    for (size_t i = 0; i < state->block_count; i++) {
+        size_t len;
+        char* frame = context_compress(state->blocks[i], state->block_sizes[i], &len);
+        if (!frame) {
+            return 0;
+        }
+        free(frame);
+    }
+    return 1;
+}
+
+static int run_context_decode(BenchState* state) {
+    for (size_t i = 0; i < state->block_count; i++) {
+        size_t len;
+        char* block = context_decompress(state->context_compressed[i], state->context_compressed_sizes[i], &len);
+        if (!block) {
+            return 0;
+        }
+        free(block);
+    }
+    return 1;
+}
+
+static int run_xor(BenchState* state) {
+    char* p = state->work;
+    for (size_t i = 0; i < state->block_count; i++) {
+        xor_apply(p, state->block_sizes[i], BENCH_KEY, strlen(BENCH_KEY), 0);
+        p += state->block_sizes[i];
+    }
+    return 1;
+}
+
+static int run_search(BenchState* state) {
+    SearchOptions options;
+    memset(&options, 0, sizeof(options));
+    for (size_t i = 0; i < state->corpus->count; i++) {
+        OutputBuffer* out = create_memory_output_buffer(OUTPUT_BUFFER_SIZE);
+        SearchContext* ctx = out ? create_search_context("status=500", &options, NULL, out) : NULL;
+        if (!ctx) {
+            free_output_buffer(out);
+            return 0;
+        }
+        search_feed(ctx, state->corpus->pieces[i], state->corpus->sizes[i]);
+        search_finish(ctx);
+        free_search_context(ctx);
+        free_output_buffer(out);
+    }
+    return 1;
+}
+
+static int run_sort(BenchState* state) {
+    SortOptions options;
+    memset(&options, 0, sizeof(options));
+    for (size_t i = 0; i < state->corpus->count; i++) {
+        LineArray* lines = split_into_lines(state->corpus->pieces[i], state->corpus->sizes[i], 1);
+        if (!lines) {
+            return 0;
+        }
+        if (!sort_lines_with_options(lines, &options, 1)) {
+            free_line_array(lines);
+            return 0;
+        }
+        size_t len;
+        char* joined = join_lines(lines, &len);
+        free(joined);
+        free_line_array(lines);
+    }
+    return 1;
+}
+
+static int run_chunk(BenchState* state) {
+    for (size_t i = 0; i < state->corpus->count; i++) {
+        const unsigned char* p = (const unsigned char*)state->corpus->pieces[i];
+        size_t remaining = state->corpus->sizes[i];
+        while (remaining > 0) {
+            size_t len = find_chunk_boundary(p, remaining);
+            p += len;
+            remaining -= len;
+        }
+    }
+    return 1;
+}
+
+static int run_fingerprint(BenchState* state) {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    for (size_t i = 0; i < state->block_count; i++) {
+        sha256(state->blocks[i], state->block_sizes[i], digest);
+    }
+    return 1;
+}
+
+static const char* piece_path(BenchState* state, size_t i) {
+    snprintf(state->path, state->path_len, "%s/%zu.dat", state->dir, i);
+    return state->path;
+}
+
+static int run_write(BenchState* state) {
+    for (size_t i = 0; i < state->corpus->count; i++) {
+        if (!write_file(piece_path(state, i), state->corpus->pieces[i], state->corpus->sizes[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int run_read(BenchState* state) {
+    for (size_t i = 0; i < state->corpus->count; i++) {
+        size_t size;
+        char* data = read_file(piece_path(state, i), &size);
+        if (!data) {
+            return 0;
+        }
+        free(data);
+    }
+    return 1;
+}
+
+static const Kernel kernels[] = {
+    { "histogram", run_histogram },
+    { "tree", run_tree },
+    { "encode", run_encode },
+    { "decode", run_decode },
+    { "context-encode", run_context_encode },
+    { "context-decode", run_context_decode },
+    { "xor", run_xor },
+    { "search", run_search },
+    { "sort", run_sort },
+    { "chunk", run_chunk },
+    { "fingerprint", run_fingerprint },
+    { "write", run_write },
+    { "read", run_read },
+};
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+// --- State ---
+
+static void free_state(BenchState* state) {
+    if (state->compressed) {
+        for (size_t i = 0; i < state->block_count; i++) {
+            free(state->compressed[i]);
+        }
+    }
+    if (state->context_compressed) {
+        for (size_t i = 0; i < state->block_count; i++) {
+            free(state->context_compressed[i]);
+        }
+    }
+    if (state->dir && state->dir[0]) {
+        for (size_t i = 0; i < state->corpus->count; i++) {
+            unlink(piece_path(state, i));
+        }
+        rmdir(state->dir);
+    }
+    free(state->blocks);
+    free(state->block_sizes);
+    free(state->frequencies);
+    free(state->compressed);
+    free(state->compressed_sizes);
+    free(state->context_compressed);
+    free(state->context_compressed_sizes);
+    free(state->work);
+    free(state->dir);
+    free(state->path);
+}
+
+// Cuts the corpus into blocks the way the framed stream does
+static int prepare_state(BenchState* state, const Corpus* corpus) {
+    memset(state, 0, sizeof(*state));
+    state->corpus = corpus;
+
+    for (size_t i = 0; i < corpus->count; i++) {
+        state->block_count += (corpus->sizes[i] + HUFFMAN_BLOCK_SIZE - 1) / HUFFMAN_BLOCK_SIZE;
+    }
+    state->blocks = calloc(state->block_count, sizeof(char*));
+    state->block_sizes = calloc(state->block_count, sizeof(size_t));
+    state->frequencies = calloc(state->block_count, sizeof(*state->frequencies));
+    state->compressed = calloc(state->block_count, sizeof(char*));
+    state->compressed_sizes = calloc(state->block_count, sizeof(size_t));
+    state->context_compressed = calloc(state->block_count, sizeof(char*));
+    state->context_compressed_sizes = calloc(state->block_count, sizeof(size_t));
+    state->work = malloc(corpus->total ? corpus->total : 1);
+    const char* tmp = getenv("TMPDIR");
+    state->path_len = strlen(tmp ? tmp : "/tmp") + 64;
+    state->dir = malloc(state->path_len);
+    state->path = malloc(state->path_len);
+    if (!state->blocks || !state->block_sizes || !state->frequencies || !state->compressed ||
+        !state->compressed_sizes || !state->context_compressed || !state->context_compressed_sizes ||
+        !state->work || !state->dir || !state->path) {
+        handle_memory_error();
+        free(state->dir);
+        state->dir = NULL;
+        return 0;
+    }
+    state->dir[0] = '\0';
+
+    size_t b = 0;
+    char* work = state->work;
+    for (size_t i = 0; i < corpus->count; i++) {
+        for (size_t offset = 0; offset < corpus->sizes[i]; offset += HUFFMAN_BLOCK_SIZE, b++) {
+            size_t len = corpus->sizes[i] - offset;
+            if (len > HUFFMAN_BLOCK_SIZE) {
+                len = HUFFMAN_BLOCK_SIZE;
+            }
+            state->blocks[b] = corpus->pieces[i] + offset;
+            state->block_sizes[b] = len;
+            memcpy(work, state->blocks[b], len);
+            work += len;
+            count_frequencies(state->blocks[b], len, state->frequencies[b]);
+            state->compressed[b] = huffman_compress(state->blocks[b], len, &state->compressed_sizes[b]);
+            state->context_compressed[b] = context_compress(state->blocks[b], len,
+                                                            &state->context_compressed_sizes[b]);
+            if (!state->compressed[b] || !state->context_compressed[b]) {
+                return 0;
+            }
+        }
+    }
+
+    snprintf(state->dir, state->path_len, "%s/fp_bench.XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(state->dir)) {
+        handle_error("Failed to create a temporary directory");
+        free(state->dir);
+        state->dir = NULL;
+        return 0;
+    }
+    return run_write(state); // The read kernel needs the files to exist
+}
+
+// --- Measurement ---
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int measure(const Kernel* kernel, BenchState* state, size_t warmup, size_t reps) {
+    for (size_t i = 0; i < warmup; i++) {
+        if (!kernel->run(state)) {
+            return 0;
+        }
+    }
+
+    uint64_t times[MAX_REPS];
+    size_t allocs_before = allocations();
+    for (size_t i = 0; i < reps; i++) {
+        uint64_t start = now_ns();
+        if (!kernel->run(state)) {
+            return 0;
+        }
+        times[i] = now_ns() - start;
+    }
+    size_t allocs = allocations() - allocs_before;
+    qsort(times, reps, sizeof(uint64_t), compare_u64);
+
+    const Corpus* corpus = state->corpus;
+    uint64_t median = times[reps / 2];
+    double bytes = corpus->total ? (double)corpus->total : 1.0;
+    double seconds = median ? median / 1e9 : 1e-9;
+    printf("{\"kernel\":\"%s\",\"corpus\":\"%s\",\"bytes\":%zu,\"pieces\":%zu,"
+           "\"reps\":%zu,\"median_ns\":%llu,\"best_ns\":%llu,\"mb_per_s\":%.2f,"
+           "\"ns_per_byte\":%.3f,\"allocs_per_run\":",
+           kernel->name, corpus_name(corpus->kind), corpus->total, corpus->count, reps,
+           (unsigned long long)median, (unsigned long long)times[0],
+           bytes / (1024.0 * 1024.0) / seconds, median / bytes);
+#ifdef BENCH_COUNT_ALLOCATIONS
+    printf("%.1f}\n", (double)allocs / reps);
+#else
+    (void)allocs;
+    printf("null}\n");
+#endif
+    fflush(stdout);
+    return 1;
+}
+
+// --- Command line ---
+
+static int parse_size(const char* text, size_t* value) {
+    char* end;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'K': case 'k': parsed <<= 10; end++; break;
+        case 'M': case 'm': parsed <<= 20; end++; break;
+        case 'G': case 'g': parsed <<= 30; end++; break;
+        default: break;
+    }
+    if (*text == '-' || *end != '\0' || parsed == 0) {
+        return 0;
+    }
+    *value = (size_t)parsed;
+    return 1;
+}
+
+static void print_usage(void) {
+    printf("Usage: fp_bench [options]\n\n");
+    printf("  --size <bytes>    Corpus size, repeatable (default 64K and 1M)\n");
+    printf("  --reps <n>        Timed runs per measurement (default 5)\n");
+    printf("  --warmup <n>      Untimed runs first (default 1)\n");
+    printf("  --kernel <name>   Run only this kernel, repeatable\n");
+    printf("  --corpus <name>   Use only this corpus, repeatable\n");
+    printf("  --generate <dir>  Write the corpora to dir instead of measuring\n\n");
+    printf("Kernels:");
+    for (size_t i = 0; i < KERNEL_COUNT; i++) {
+        printf(" %s", kernels[i].name);
+    }
+    printf("\nCorpora:");
+    for (int i = 0; i < CORPUS_KIND_COUNT; i++) {
+        printf(" %s", corpus_name((CorpusKind)i));
+    }
+    printf("\n\nOutput: one JSON object per line and measurement.\n");
+}
+
+int main(int argc, char** argv) {
+    size_t sizes[MAX_SIZES];
+    size_t size_count = 0;
+    size_t reps = 5;
+    size_t warmup = 1;
+    int kernel_selected[KERNEL_COUNT] = { 0 };
+    int any_kernel = 0;
+    int corpus_selected[CORPUS_KIND_COUNT] = { 0 };
+    int any_corpus = 0;
+    const char* generate_dir = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        int has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--size") == 0 && has_value && size_count < MAX_SIZES) {
+            if (!parse_size(argv[++i], &sizes[size_count++])) {
+                handle_error("Invalid value for --size");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--reps") == 0 && has_value) {
+            reps = strtoul(argv[++i], NULL, 10);
+            if (reps < 1 || reps > MAX_REPS) {
+                handle_error("--reps must be between 1 and 1000");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--warmup") == 0 && has_value) {
+            warmup = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--kernel") == 0 && has_value) {
+            const char* name = argv[++i];
+            size_t k = 0;
+            while (k < KERNEL_COUNT && strcmp(kernels[k].name, name) != 0) {
+                k++;
+            }
+            if (k == KERNEL_COUNT) {
+                handle_error("Unknown kernel");
+                return 1;
+            }
+            kernel_selected[k] = any_kernel = 1;
+        } else if (strcmp(argv[i], "--corpus") == 0 && has_value) {
+            int kind = find_corpus_kind(argv[++i]);
+            if (kind < 0) {
+                handle_error("Unknown corpus");
+                return 1;
+            }
+            corpus_selected[kind] = any_corpus = 1;
+        } else if (strcmp(argv[i], "--generate") == 0 && has_value) {
+            generate_dir = argv[++i];
+        } else if (strcmp(argv[i], "--help") == 0) {
+            print_usage();
+            return 0;
+        } else {
+            handle_error("Unknown or incomplete option");
+            print_usage();
+            return 1;
+        }
+    }
+    if (size_count == 0) {
+        sizes[size_count++] = 64 * 1024;
+        sizes[size_count++] = 1024 * 1024;
+    }
+
+    int ok = 1;
+    for (size_t s = 0; ok && s < size_count; s++) {
+        for (int c = 0; ok && c < CORPUS_KIND_COUNT; c++) {
+            if (any_corpus && !corpus_selected[c]) {
+                continue;
+            }
+            Corpus* corpus = generate_corpus((CorpusKind)c, sizes[s], BENCH_SEED);
+            if (!corpus) {
+                return 1;
+            }
+            if (generate_dir) {
+                ok = write_corpus(corpus, generate_dir);
+                free_corpus(corpus);
+                continue;
+            }
+
+            BenchState state;
+            ok = prepare_state(&state, corpus);
+            for (size_t k = 0; ok && k < KERNEL_COUNT; k++) {
+                if (!any_kernel || kernel_selected[k]) {
+                    ok = measure(&kernels[k], &state, warmup, reps);
+                }
+            }
+            free_state(&state);
+            free_corpus(corpus);
+        }
+    }
+    return ok ? 0 : 1;
+}
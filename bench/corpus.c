@@ -0,0 +1,148 @@
+#include "corpus.h"
+#include "../include/io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TINY_FILE_AVERAGE 2048 // Tiny files are 64 bytes to 4 KiB
+
+static const char* const corpus_names[CORPUS_KIND_COUNT] = {
+    "text-logs", "random", "single-symbol", "tiny-files"
+};
+
+const char* corpus_name(CorpusKind kind) {
+    return corpus_names[kind];
+}
+
+int find_corpus_kind(const char* name) {
+    for (int i = 0; i < CORPUS_KIND_COUNT; i++) {
+        if (strcmp(name, corpus_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// xorshift64*: fast, and the same on every platform
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static const char* const log_levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+static const char* const log_paths[] = {
+    "/api/v1/items", "/api/v1/users", "/api/v1/orders", "/healthz", "/static/app.js"
+};
+static const int log_statuses[] = { 200, 200, 200, 201, 304, 404, 500 };
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+// Fills data with whole log lines, padding the tail with a partial one
+static void fill_logs(char* data, size_t size, uint64_t* state) {
+    size_t pos = 0;
+    char line[192];
+    while (pos < size) {
+        uint64_t r = next_random(state);
+        uint64_t seconds = r % 86400;
+        int len = snprintf(line, sizeof(line),
+                           "2026-10-19T%02u:%02u:%02u.%03uZ %-5s [worker-%u] id=%08x path=%s/%u status=%d latency_ms=%u\n",
+                           (unsigned)(seconds / 3600), (unsigned)(seconds / 60 % 60),
+                           (unsigned)(seconds % 60), (unsigned)(r >> 20) % 1000,
+                           log_levels[(r >> 30) % ARRAY_LEN(log_levels)],
+                           (unsigned)(r >> 34) % 16, (unsigned)(r >> 32),
+                           log_paths[(r >> 38) % ARRAY_LEN(log_paths)],
+                           (unsigned)(r >> 41) % 10000,
+                           log_statuses[(r >> 54) % ARRAY_LEN(log_statuses)],
+                           (unsigned)(r >> 57) * 7 + 1);
+        size_t take = (size_t)len < size - pos ? (size_t)len : size - pos;
+        memcpy(data + pos, line, take);
+        pos += take;
+    }
+}
+
+static void fill_piece(CorpusKind kind, char* data, size_t size, uint64_t* state) {
+    switch (kind) {
+        case CORPUS_RANDOM:
+            for (size_t i = 0; i < size; i++) {
+                data[i] = (char)(next_random(state) >> 56);
+            }
+            break;
+        case CORPUS_SINGLE_SYMBOL:
+            memset(data, 'a', size);
+            break;
+        default:
+            fill_logs(data, size, state);
+            break;
+    }
+}
+
+Corpus* generate_corpus(CorpusKind kind, size_t size, uint64_t seed) {
+    Corpus* corpus = calloc(1, sizeof(Corpus));
+    if (!corpus) {
+        handle_memory_error();
+        return NULL;
+    }
+    corpus->kind = kind;
+    corpus->count = kind == CORPUS_TINY_FILES ? (size + TINY_FILE_AVERAGE - 1) / TINY_FILE_AVERAGE : 1;
+    if (corpus->count == 0) {
+        corpus->count = 1;
+    }
+    corpus->pieces = calloc(corpus->count, sizeof(char*));
+    corpus->sizes = calloc(corpus->count, sizeof(size_t));
+    if (!corpus->pieces || !corpus->sizes) {
+        handle_memory_error();
+        free_corpus(corpus);
+        return NULL;
+    }
+
+    uint64_t state = seed ? seed : 1;
+    for (size_t i = 0; i < corpus->count; i++) {
+        size_t piece_size = size;
+        if (kind == CORPUS_TINY_FILES) {
+            piece_size = 64 + next_random(&state) % (2 * TINY_FILE_AVERAGE - 127);
+        }
+        corpus->pieces[i] = malloc(piece_size ? piece_size : 1);
+        if (!corpus->pieces[i]) {
+            handle_memory_error();
+            free_corpus(corpus);
+            return NULL;
+        }
+        fill_piece(kind, corpus->pieces[i], piece_size, &state);
+        corpus->sizes[i] = piece_size;
+        corpus->total += piece_size;
+    }
+    return corpus;
+}
+
+void free_corpus(Corpus* corpus) {
+    if (corpus) {
+        if (corpus->pieces) {
+            for (size_t i = 0; i < corpus->count; i++) {
+                free(corpus->pieces[i]);
+            }
+        }
+        free(corpus->pieces);
+        free(corpus->sizes);
+        free(corpus);
+    }
+}
+
+int write_corpus(const Corpus* corpus, const char* dir) {
+    size_t path_len = strlen(dir) + 64;
+    char* path = malloc(path_len);
+    if (!path) {
+        handle_memory_error();
+        return 0;
+    }
+    int ok = 1;
+    for (size_t i = 0; ok && i < corpus->count; i++) {
+        snprintf(path, path_len, "%s/%s-%zu-%zu.dat", dir, corpus_name(corpus->kind), corpus->total, i);
+        ok = write_file(path, corpus->pieces[i], corpus->sizes[i]);
+    }
+    free(path);
+    return ok;
+}
@@ -0,0 +1,42 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Kinds of generated input, chosen to span the entropy range
+typedef enum {
+    CORPUS_TEXT_LOGS,     // Timestamped log lines: low entropy, many lines
+    CORPUS_RANDOM,        // Uniform random bytes: incompressible
+    CORPUS_SINGLE_SYMBOL, // One repeated byte: the degenerate Huffman tree
+    CORPUS_TINY_FILES,    // Many small log files: per-call overhead dominates
+    CORPUS_KIND_COUNT
+} CorpusKind;
+
+// A corpus is one or more pieces; all but the tiny-files kind have one
+typedef struct {
+    CorpusKind kind;
+    char** pieces;
+    size_t* sizes;
+    size_t count;
+    size_t total;         // Sum of sizes
+} Corpus;
+
+const char* corpus_name(CorpusKind kind);
+int find_corpus_kind(const char* name); // -1 if unknown
+
+/*
+ * Function: generate_corpus
+ * Description: Generates about size bytes of the given kind. The same seed
+ *              always gives the same bytes, so runs can be compared.
+ * Returns: The corpus, or NULL on error.
+ */
+Corpus* generate_corpus(CorpusKind kind, size_t size, uint64_t seed);
+void free_corpus(Corpus* corpus);
+
+// Writes each piece to dir as <name>-<total>-<index>.dat, for use with the CLI
+int write_corpus(const Corpus* corpus, const char* dir);
+
+#endif // CORPUS_H
@@ -0,0 +1,61 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Bump allocator for the many small objects of one operation, such as the
+ * nodes of a Huffman tree. Allocation takes the next aligned bytes of the
+ * current block; nothing is freed on its own. An operation takes a mark
+ * when it starts and rewinds to it when it ends, which releases everything
+ * it allocated in one step, or the whole arena is freed at once.
+ */
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock* blocks;    // Newest first; allocation happens in the newest
+    size_t block_size;     // Size of new blocks, unless one allocation needs more
+} Arena;
+
+// Position to rewind to; marks taken later must be rewound first
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+/*
+ * Function: create_arena
+ * Description: Creates an empty arena. No block is allocated until the
+ *              first allocation.
+ * Parameters:
+ *   - block_size: Bytes per block, or 0 for ARENA_DEFAULT_BLOCK_SIZE.
+ * Returns: Pointer to the arena or NULL on error.
+ */
+Arena* create_arena(size_t block_size);
+void free_arena(Arena* arena);
+
+// Returns size bytes aligned for any object, or NULL on error
+void* arena_alloc(Arena* arena, size_t size);
+
+ArenaMark arena_mark(const Arena* arena);
+// Releases everything allocated since mark. The oldest block is kept for
+// reuse, so an operation that rewinds to an empty arena allocates nothing
+// the next time round.
+void arena_rewind(Arena* arena, ArenaMark mark);
+
+/*
+ * Function: thread_arena
+ * Description: Arena of the calling thread, created on first use and freed
+ *              when the thread exits. Parallel workers each get their own,
+ *              so allocating never takes a lock. Users take a mark and
+ *              rewind to it before returning.
+ * Returns: Pointer to the arena or NULL on error.
+ */
+Arena* thread_arena(void);
+
+#endif // ARENA_H
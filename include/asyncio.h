@@ -0,0 +1,73 @@
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "io.h"
+
+// Buffers per stream: one being read or written by the I/O thread, one
+// being processed, and one spare so neither side waits on the other
+#define ASYNC_DEPTH 3
+
+typedef struct AsyncReader AsyncReader;
+typedef struct AsyncWriter AsyncWriter;
+
+/*
+ * Function: create_async_reader
+ * Description: Starts reading a stream ahead of its consumer on a background
+ *              thread, in chunks of chunk_size bytes. If the thread cannot be
+ *              started, chunks are read synchronously instead.
+ * Parameters:
+ *   - file: Stream to read. It must not be used by anyone else until the
+ *           reader is freed. The thread reads its descriptor directly, so
+ *           nothing may have been read from it through stdio yet. A stream
+ *           without a descriptor is read synchronously.
+ *   - chunk_size: Size of each chunk; only the last one may be shorter.
+ *   - workspace: A worker thread's scratch buffers, or NULL. With a
+ *                workspace no thread is started and chunks are read
+ *                synchronously into its input buffer; worker pools already
+ *                overlap I/O across files.
+ * Returns: The reader, or NULL on error.
+ */
+AsyncReader* create_async_reader(FILE* file, size_t chunk_size, Workspace* workspace);
+
+/*
+ * Function: async_reader_next
+ * Description: Returns the next chunk. The chunk stays valid, and may be
+ *              modified in place, until the next call or until the reader
+ *              is freed.
+ * Returns: 1 with a chunk, 0 at end of file, -1 on a read error.
+ */
+int async_reader_next(AsyncReader* reader, char** data, size_t* len);
+
+// Stops reading ahead, even in the middle of a blocking read, and frees the reader
+void free_async_reader(AsyncReader* reader);
+
+/*
+ * Function: create_async_writer
+ * Description: Writes chunks to a stream on a background thread, so the
+ *              caller can fill the next chunk while earlier ones are written.
+ *              If the thread cannot be started, chunks are written
+ *              synchronously instead.
+ * Parameters:
+ *   - file: Stream to write. It must not be used by anyone else until the
+ *           writer is finished.
+ *   - chunk_size: Capacity of each chunk buffer.
+ * Returns: The writer, or NULL on error.
+ */
+AsyncWriter* create_async_writer(FILE* file, size_t chunk_size);
+
+// Returns an empty buffer of chunk_size bytes, waiting for one if all are queued
+char* async_writer_acquire(AsyncWriter* writer);
+
+// Queues the first len bytes of the acquired buffer; returns 0 once a write has failed
+int async_writer_submit(AsyncWriter* writer, size_t len);
+
+// Waits until every queued chunk is written; returns 0 if any write failed
+int async_writer_wait(AsyncWriter* writer);
+
+// Writes what is queued, stops the thread and frees the writer; returns 0 if any write failed
+int finish_async_writer(AsyncWriter* writer);
+
+#endif // ASYNCIO_H
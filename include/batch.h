@@ -0,0 +1,39 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cli.h"
+
+#define BATCH_QUEUE_PER_WORKER 4 // Queued jobs per worker before the producer waits
+#define MAX_BATCH_WORKERS 256
+
+/*
+ * Function: run_batch
+ * Description: Runs the selected mode on many files in one process. Inputs
+ *              come from opts->batch_source: a directory, walked recursively,
+ *              or a file listing one path per line ("-" for standard input).
+ *              Output names are built from opts->output_template, and
+ *              missing directories above them are created; if two inputs
+ *              would get the same name, nothing is processed. A fixed pool
+ *              of opts->threads workers takes jobs from a bounded queue, and
+ *              each worker reuses its scratch buffers from file to file.
+ *              A file that fails is reported and the batch carries on.
+ * Parameters:
+ *   - opts: Parsed options with batch_source set.
+ * Returns: The exit status: 0 if every file succeeded, 1 otherwise.
+ */
+int run_batch(const Options* opts);
+
+/*
+ * Function: expand_output_template
+ * Description: Builds an output name for an input path. {path} is the whole
+ *              input path, {dir} its directory, {name} its file name, {stem}
+ *              the name without its last extension and {ext} that extension
+ *              without the dot. Anything else is copied literally.
+ * Returns: A newly allocated string, or NULL on error.
+ */
+char* expand_output_template(const char* output_template, const char* input_file);
+
+#endif // BATCH_H
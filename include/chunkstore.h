@@ -0,0 +1,82 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+#include "io.h"
+
+/*
+ * Deduplicating chunk store. Input is cut into chunks at content-defined
+ * boundaries (FastCDC over a Gear rolling hash), so an edit only changes
+ * the chunks around it. Each chunk is named by its SHA-256 digest and kept
+ * once, compressed, under
+ *
+ *     <store>/chunks/<first 2 hex digits>/<remaining 62 hex digits>
+ *
+ * A chunk file is a tag byte followed by the chunk: CHUNK_TAG_HUFFMAN for
+ * huffman_compress output, CHUNK_TAG_CONTEXT for context_compress output,
+ * or CHUNK_TAG_RAW when compression would not make it smaller. Files are
+ * written and synced under a temporary name, then renamed into place, so
+ * concurrent writers of the same chunk are harmless and a crash never
+ * leaves a partial chunk under its final name.
+ *
+ * The manifest that rebuilds a file is the magic bytes, then for each chunk
+ * its length as a varint and its 32-byte digest, then a zero length.
+ */
+#define CHUNK_MIN_SIZE (4 * 1024)
+#define CHUNK_AVG_SIZE (16 * 1024)
+#define CHUNK_MAX_SIZE (64 * 1024)
+
+#define CHUNK_MANIFEST_MAGIC "FPM1"
+#define CHUNK_MANIFEST_MAGIC_LEN 4
+
+#define CHUNK_TAG_RAW 'R'
+#define CHUNK_TAG_HUFFMAN 'H'
+#define CHUNK_TAG_CONTEXT 'C'
+
+/*
+ * Function: find_chunk_boundary
+ * Description: Finds where the first chunk of data ends. Cuts are never
+ *              made before CHUNK_MIN_SIZE or after CHUNK_MAX_SIZE bytes, and
+ *              depend only on the bytes of the chunk.
+ * Parameters:
+ *   - data: Bytes to cut. Pass at least CHUNK_MAX_SIZE of them unless the
+ *           input ends sooner, or the cut depends on the read size.
+ *   - len: Number of bytes at data.
+ * Returns: Length of the first chunk.
+ */
+size_t find_chunk_boundary(const unsigned char* data, size_t len);
+
+/*
+ * Function: chunk_store_compress
+ * Description: Cuts a stream into chunks, adds the chunks the store does
+ *              not have yet and writes the manifest.
+ * Parameters:
+ *   - input_file: Input path, or "-" for standard input.
+ *   - output_file: Manifest path, or "-" for standard output.
+ *   - store_dir: Store directory, created if needed.
+ *   - model: How new chunks are compressed.
+ *   - report: Stream for a summary of new and reused chunks, or NULL.
+ *   - workspace: Scratch buffers of the calling worker thread, or NULL.
+ * Returns: 1 on success, 0 on error.
+ */
+int chunk_store_compress(const char* input_file, const char* output_file, const char* store_dir,
+                         HuffmanModel model, FILE* report, Workspace* workspace);
+
+/*
+ * Function: chunk_store_restore
+ * Description: Rebuilds a file from its manifest. Each chunk is checked
+ *              against its length and digest before it is written.
+ * Parameters:
+ *   - input_file: Manifest path, or "-" for standard input.
+ *   - output_file: Output path, or "-" for standard output.
+ *   - store_dir: Store the manifest's chunks were added to.
+ *   - workspace: Scratch buffers of the calling worker thread, or NULL.
+ * Returns: 1 on success, 0 on error.
+ */
+int chunk_store_restore(const char* input_file, const char* output_file, const char* store_dir,
+                        Workspace* workspace);
+
+#endif // CHUNKSTORE_H
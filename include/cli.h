@@ -13,10 +13,14 @@ typedef enum {
     MODE_DECRYPT,
     MODE_SEARCH,
     MODE_SORT,
+    MODE_DEDUP,
     MODE_HELP,
     MODE_INVALID
 } Mode;
 
+// Smallest --max-memory: the chunked modes need a few fixed-size buffers
+#define MIN_MAX_MEMORY (16 * 1024 * 1024)
+
 // Command line options structure
 typedef struct {
     Mode mode;
@@ -24,6 +28,37 @@ typedef struct {
     char* output_file;
     char* key;
     char* search_term;
+    int count_only;          // --count
+    size_t max_count;        // --max-count N (0 = unlimited)
+    int files_with_matches;  // --files-with-matches
+    int quiet;               // --quiet
+    int fuzzy;               // --fuzzy K given
+    size_t max_errors;       // Edit distance for --fuzzy
+    size_t memory_limit;     // --memory-limit for external sorting (0 = in memory)
+    size_t max_memory;       // --max-memory budget for every mode (0 = unlimited)
+    char* temp_dir;          // --temp-dir for external sort runs
+    size_t threads;          // -j worker threads
+    size_t key_field;        // --key N for sorting (0 = whole line)
+    char separator;          // --sep C field separator
+    int numeric;             // --numeric
+    int human;               // --human
+    int reverse;             // --reverse
+    int stable;              // --stable
+    int unique;              // --unique
+    int dedup;               // --dedup
+    int count_lines;         // --count-lines
+    int sorted_output;       // Dedup combined with --sort
+    int top_k;               // --head or --tail given
+    int top_tail;            // Keep the last lines (--tail)
+    size_t top_count;        // Number of lines for --head or --tail
+    char* batch_source;      // --batch: directory or list of input files
+    char* output_template;   // --output-template for batch output names
+    char* serve_socket;      // --serve: answer requests on this socket
+    char* client_socket;     // --client: send the request to this socket
+    size_t max_payload;      // --max-payload: largest request input --serve holds (0 = default)
+    int stats;               // --stats: 1 for a table, 2 for JSON (0 = off)
+    char* store_dir;         // --store: chunk store for --compress and --decompress
+    int context;             // --context: order-1 context-modelled --compress
 } Options;
 
 // Function declarations
@@ -4,11 +4,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include "arena.h"
+#include "io.h"
 
 // Node for Huffman Tree
 typedef struct HuffmanNode {
     char character;
-    unsigned frequency;
+    uint64_t frequency;
     struct HuffmanNode *left, *right;
 } HuffmanNode;
 
@@ -20,11 +23,21 @@ typedef struct HuffmanCode {
 } HuffmanCode;
 
 
+// Huffman building blocks, also exposed for the benchmarks. Compression and
+// decompression build the same tree from the same frequencies. The tree and
+// codes are allocated from arena and released by rewinding it.
+void count_frequencies(const char* data, size_t size, uint64_t* frequencies); // 256 counters
+HuffmanNode* build_huffman_tree_from_frequencies(const uint64_t* frequencies, Arena* arena);
+HuffmanCode* get_huffman_codes(HuffmanNode* root, Arena* arena);
+
 /*
  * Function: huffman_compress
  * Description: Compresses data using Huffman coding.
- *              The output format will include a header with frequency information
- *              to rebuild the Huffman tree for decompression.
+ *              The output starts with a portable header that holds the
+ *              frequency information to rebuild the Huffman tree: the input
+ *              length as a varint, the number of distinct bytes as a
+ *              varint, then each distinct byte followed by its frequency
+ *              as a varint. The bitstream follows.
  * Parameters:
  *   - input: Pointer to the input data.
  *   - input_len: Length of the input data.
@@ -46,4 +59,77 @@ char* huffman_compress(const char* input, size_t input_len, size_t* output_len);
  */
 char* huffman_decompress(const char* input, size_t input_len, size_t* output_len);
 
+// Decompresses a block in the original layout: 256 native unsigned
+// frequencies and a native size_t length, as written by the host that
+// created it. Still read from FPH1 frames and unframed files.
+char* huffman_decompress_legacy(const char* input, size_t input_len, size_t* output_len);
+
+/*
+ * Framed format used for streams: the magic bytes, then one frame per block
+ * of up to HUFFMAN_BLOCK_SIZE input bytes. Each frame is its length as a
+ * varint followed by that many bytes of huffman_compress output. A zero
+ * length ends the stream, so truncation is detected.
+ *
+ * Varints are little-endian base 128: seven bits per byte, low bits first,
+ * the high bit set on every byte but the last. Every length and frequency
+ * is 64 bits wide and the layout is the same on every host.
+ *
+ * FPC1 streams are framed the same way, but each frame holds
+ * context_compress output (see contextmodel.h) instead.
+ *
+ * FPH1 streams, with 4-byte little-endian frame lengths and blocks in the
+ * legacy layout, are still decompressed.
+ */
+#define HUFFMAN_FRAME_MAGIC "FPH2"
+#define HUFFMAN_CONTEXT_FRAME_MAGIC "FPC1"
+#define HUFFMAN_FRAME_MAGIC_V1 "FPH1"
+#define HUFFMAN_FRAME_MAGIC_LEN 4
+#define HUFFMAN_BLOCK_SIZE (1 << 20)
+// Codes for one block are well under 32 bits, so a frame can never exceed this
+#define HUFFMAN_MAX_FRAME_SIZE (HUFFMAN_BLOCK_SIZE * 4 + 4096)
+#define HUFFMAN_MAX_VARINT_LEN 10 // Bytes for a 64-bit value
+
+// Writes value as a varint and returns its length
+size_t put_varint(unsigned char* out, uint64_t value);
+// Reads a varint from the len bytes at in and returns its length, or 0 when
+// it is incomplete or does not fit in 64 bits
+size_t get_varint(const unsigned char* in, size_t len, uint64_t* value);
+// Frame lengths of FPH1 streams
+size_t get_frame_length(const unsigned char* header);
+
+// How the blocks of a stream are coded
+typedef enum {
+    HUFFMAN_ORDER0, // One code table per block, in FPH2 streams
+    HUFFMAN_ORDER1  // Tables chosen by the previous byte, in FPC1 streams
+} HuffmanModel;
+
+/*
+ * Function: huffman_compress_stream
+ * Description: Compresses a stream block by block into the framed format.
+ *              Only one block is held in memory at a time.
+ * Parameters:
+ *   - input: Stream to compress.
+ *   - output: Stream that receives the framed data.
+ *   - model: How each block is coded.
+ *   - workspace: Scratch buffers of the calling worker thread, or NULL.
+ * Returns: 1 on success, 0 on error.
+ */
+int huffman_compress_stream(FILE* input, FILE* output, HuffmanModel model, Workspace* workspace);
+
+/*
+ * Function: huffman_decompress_stream
+ * Description: Decompresses a stream. Framed input is decoded one frame at
+ *              a time; input without the magic bytes is read whole and
+ *              decoded as the original single-block format.
+ * Parameters:
+ *   - input: Stream to decompress.
+ *   - output: Stream that receives the original data.
+ *   - workspace: Scratch buffers of the calling worker thread, or NULL.
+ *   - memory_limit: Bytes the single-block format may hold for its input
+ *                   and output together, or 0 for no limit. Framed input
+ *                   always fits, one frame at a time.
+ * Returns: 1 on success, 0 on error.
+ */
+int huffman_decompress_stream(FILE* input, FILE* output, Workspace* workspace, size_t memory_limit);
+
 #endif // COMPRESS_H 
\ No newline at end of file
@@ -0,0 +1,56 @@
+#ifndef CONTEXTMODEL_H
+#define CONTEXTMODEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Order-1 context-modelled Huffman coding. Each byte is coded with a table
+ * chosen by the byte before it (0 before the first byte of a block), which
+ * captures how strongly one byte predicts the next in text. Previous bytes
+ * with similar followers share a table, and rare ones are folded into the
+ * common tables, so a block carries at most CONTEXT_MAX_TABLES of them.
+ *
+ * A block is the input length as a varint, then:
+ *   - the table count, one byte from 1 to CONTEXT_MAX_TABLES;
+ *   - when there is more than one table, the table of each previous byte,
+ *     4 bits each, two to a byte with the lower byte value in the low bits;
+ *   - for each table, the code length of each byte in the same 4-bit
+ *     packing: 0 for a byte the table never codes, else the length plus
+ *     one. A table that codes a single byte gives it length 0;
+ *   - the bitstream, most significant bit first, zero-padded to a byte.
+ *
+ * Codes are canonical and at most CONTEXT_MAX_CODE_LENGTH bits long, so
+ * the decoder looks every code up with one table index.
+ */
+#define CONTEXT_MAX_TABLES 16
+#define CONTEXT_MAX_CODE_LENGTH 12
+
+/*
+ * Function: context_compress
+ * Description: Compresses one block of at most HUFFMAN_BLOCK_SIZE bytes
+ *              with order-1 context-modelled Huffman codes.
+ * Parameters:
+ *   - input: Pointer to the input data.
+ *   - input_len: Length of the input data.
+ *   - output_len: Pointer to store the length of the compressed data.
+ * Returns: Pointer to the compressed data or NULL on error.
+ */
+char* context_compress(const char* input, size_t input_len, size_t* output_len);
+
+/*
+ * Function: context_decompress
+ * Description: Decompresses data written by context_compress. A block that
+ *              declares more than HUFFMAN_BLOCK_SIZE bytes, or more than its
+ *              payload could code, is rejected as corrupt.
+ * Parameters:
+ *   - input: Pointer to the compressed data.
+ *   - input_len: Length of the compressed data.
+ *   - output_len: Pointer to store the length of the decompressed data.
+ * Returns: Pointer to the decompressed data or NULL on error.
+ */
+char* context_decompress(const char* input, size_t input_len, size_t* output_len);
+
+#endif // CONTEXTMODEL_H
@@ -0,0 +1,44 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Runtime CPU dispatch for the hot kernels. The instruction set level is
+ * read once when the program or library is loaded, and every kernel is
+ * bound to the widest variant the processor supports. One binary built
+ * without -march flags therefore uses AVX2 or AVX-512 where available.
+ *
+ * FP_CPU=generic|sse2|avx2|avx512 in the environment caps the level, to
+ * compare variants or to work around a misbehaving host.
+ */
+
+typedef enum {
+    CPU_GENERIC,   // Portable C, 8 bytes at a time
+    CPU_SSE2,
+    CPU_AVX2,
+    CPU_AVX512,    // AVX-512F and AVX-512BW
+    CPU_LEVEL_COUNT
+} CpuLevel;
+
+typedef struct {
+    // data[i] ^= pattern[k + i], where pattern repeats a key of period
+    // bytes and holds at least period + 63 bytes
+    void (*xor_pattern)(char* data, size_t len, const char* pattern, size_t period, size_t k);
+    // Counts each byte value of data into frequencies (not cleared first)
+    void (*byte_histogram)(const unsigned char* data, size_t size, uint64_t* frequencies);
+    // Bit i is set when block[i] == byte, for the 64 bytes at block
+    uint64_t (*byte_mask)(const char* block, char byte);
+    // Bit i is set when block[i] == first and block[i + gap] == last; reads
+    // the 64 + gap bytes at block
+    uint64_t (*pair_mask)(const char* block, char first, char last, size_t gap);
+} CpuKernels;
+
+CpuLevel cpu_level(void);
+const char* cpu_level_name(CpuLevel level);
+const CpuKernels* cpu_kernels(void);
+
+#endif // CPU_H
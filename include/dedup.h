@@ -0,0 +1,62 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sort.h"
+
+// A distinct line and the number of times it occurs
+typedef struct {
+    LineSlice line;
+    size_t count;
+} DistinctLine;
+
+// Open-addressing hash table of the distinct lines of a text
+typedef struct {
+    const char* text;
+    DistinctLine* lines;   // Distinct lines in first-seen order
+    size_t count;
+    size_t capacity;
+    size_t* slots;         // Index into lines plus one, 0 for an empty slot
+    uint64_t* slot_hashes;
+    size_t slot_count;     // Power of two
+    int crlf;              // Input lines end in "\r\n"
+    size_t memory_limit;   // Bytes the table may grow to (0 = no limit)
+} LineTable;
+
+/*
+ * Function: count_distinct_lines
+ * Description: Collects the distinct lines of a text and how often each one
+ *              occurs, using linear probing over a fast 64-bit hash of each
+ *              line. Lines are slices of text, which must outlive the table.
+ * Parameters:
+ *   - text: Pointer to the input text.
+ *   - text_len: Length of the input text.
+ *   - threads: Threads used to index the lines.
+ *   - memory_limit: Bytes the table may grow to, or 0 for no limit. Growing
+ *                   past it fails with an error.
+ * Returns: Pointer to the table or NULL on error.
+ */
+LineTable* count_distinct_lines(const char* text, size_t text_len, size_t threads,
+                                size_t memory_limit);
+
+/*
+ * Function: format_distinct_lines
+ * Description: Writes the distinct lines, each prefixed with its count when
+ *              with_counts is set. Lines keep their first-seen order unless
+ *              sort_options is given, in which case only the distinct lines
+ *              are sorted.
+ * Returns: Pointer to the output or NULL on error or empty input.
+ */
+char* format_distinct_lines(const LineTable* table, int with_counts,
+                            const SortOptions* sort_options, size_t threads, size_t* output_len);
+
+const DistinctLine* find_distinct_line(const LineTable* table, const char* line, size_t length);
+void free_line_table(LineTable* table);
+
+// Bytes deduplication holds besides the text and the table
+size_t dedup_memory_estimate(size_t text_len, size_t line_count, int with_counts);
+
+#endif // DEDUP_H 
@@ -4,9 +4,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "io.h"
 
 // XOR cipher functions
 char* xor_encrypt(const char* input, size_t input_len, const char* key, size_t* output_len);
 char* xor_decrypt(const char* input, size_t input_len, const char* key, size_t* output_len);
 
-#endif // ENCRYPT_H 
\ No newline at end of file
+/*
+ * Applies the XOR keystream in place to a window of a larger stream.
+ * position is the offset of data[0] within the stream, so consecutive
+ * windows produce the same bytes as a single xor_encrypt call.
+ */
+void xor_apply(char* data, size_t len, const char* key, size_t key_len, size_t position);
+
+/*
+ * Encrypts or decrypts a stream one chunk at a time, so input of any
+ * length (including a pipe) is processed in constant memory. A worker
+ * thread passes its workspace to reuse buffers; otherwise pass NULL.
+ * Returns 1 on success, 0 on error.
+ */
+int xor_stream(FILE* input, FILE* output, const char* key, Workspace* workspace);
+
+#endif // ENCRYPT_H 
@@ -0,0 +1,47 @@
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sort.h"
+
+#define DEFAULT_TEMP_DIR "/tmp"
+
+/*
+ * Function: external_sort
+ * Description: Sorts the lines of a file that may be larger than memory.
+ *              The input is read in runs that fit the memory limit, each run
+ *              is sorted in memory and spilled to a temporary file, and the
+ *              runs are combined with a k-way merge driven by a loser tree.
+ *              Temporary files are unlinked as soon as they are created, so
+ *              they disappear even if the process fails.
+ * Parameters:
+ *   - input_file: Path of the file to sort.
+ *   - output_file: Path of the sorted output.
+ *   - memory_limit: Approximate number of bytes the sort may hold in memory.
+ *   - temp_dir: Directory for the temporary run files (NULL for the default).
+ *   - options: Sort order options.
+ * Returns: 1 on success, 0 on error.
+ */
+int external_sort(const char* input_file, const char* output_file,
+                  size_t memory_limit, const char* temp_dir, const SortOptions* options);
+
+/*
+ * Function: top_k_sort
+ * Description: Writes the first (or, with tail, the last) count lines of the
+ *              sorted order without sorting everything. The input is streamed
+ *              through a bounded heap of count lines, so it runs in
+ *              O(n log count) time and O(count) memory on inputs of any size.
+ * Parameters:
+ *   - input_file: Path of the file to read.
+ *   - output_file: Path of the output, written in sorted order.
+ *   - count: Number of lines to keep.
+ *   - tail: Keep the last lines of the sorted order instead of the first.
+ *   - options: Sort order options (unique is not supported).
+ * Returns: 1 on success, 0 on error.
+ */
+int top_k_sort(const char* input_file, const char* output_file, size_t count, int tail,
+               const SortOptions* options);
+
+#endif // EXTSORT_H 
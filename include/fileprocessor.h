@@ -0,0 +1,150 @@
+#ifndef FILEPROCESSOR_H
+#define FILEPROCESSOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "search.h"
+#include "sort.h"
+
+/*
+ * Embeddable API, built as lib/libfileprocessor.a and lib/libfileprocessor.so.
+ *
+ * Nothing here exits the process: every failure comes back as an FpStatus.
+ * Diagnostics are also written to the calling thread's standard error, which
+ * redirect_thread_stdio can point elsewhere.
+ *
+ * Streams and searches follow the same cycle: create a context, feed it input
+ * in chunks of any size, drain its output into your own buffers as it becomes
+ * available, finish it when the input ends and drain what is left. Output
+ * waits inside the context only until it is drained; feeding stops short of
+ * the whole chunk once FP_PENDING_LIMIT bytes are waiting, so memory stays
+ * bounded when the caller drains between feeds. Contexts are not shared
+ * between threads, but any number of them can run at once.
+ */
+
+#define FP_PENDING_LIMIT (2 * 1024 * 1024)
+
+typedef enum {
+    FP_OK = 0,
+    FP_ERROR_ARGUMENT,        // Invalid parameter, or a call out of order
+    FP_ERROR_MEMORY,          // An allocation failed
+    FP_ERROR_CORRUPT,         // Compressed input is damaged or truncated
+    FP_ERROR_BUFFER_TOO_SMALL // The caller's buffer cannot hold the result
+} FpStatus;
+
+const char* fp_status_string(FpStatus status);
+
+// --- Byte streams: compression and the XOR cipher ---
+
+typedef enum {
+    FP_COMPRESS,   // Produces the framed format of huffman_compress_stream
+    FP_DECOMPRESS, // Accepts the framed formats and the original single block
+    FP_ENCRYPT,
+    FP_DECRYPT,
+    FP_COMPRESS_CONTEXT // As FP_COMPRESS, with order-1 context modelling (FPC1)
+} FpOperation;
+
+typedef struct FpStream FpStream;
+
+/*
+ * Function: fp_create_stream
+ * Description: Creates a stream for one operation.
+ * Parameters:
+ *   - operation: What the stream does to its input.
+ *   - key: Cipher key for FP_ENCRYPT and FP_DECRYPT, copied; NULL otherwise.
+ *   - status: Receives the reason when NULL is returned. May be NULL.
+ * Returns: The stream, or NULL on error.
+ */
+FpStream* fp_create_stream(FpOperation operation, const char* key, FpStatus* status);
+
+/*
+ * Function: fp_stream_feed
+ * Description: Hands the stream the next chunk of input. Compression works on
+ *              whole blocks, so output may appear only after later feeds or
+ *              after fp_stream_finish.
+ * Parameters:
+ *   - data, len: The input chunk.
+ *   - consumed: Receives how much of the chunk was taken. Less than len means
+ *               output must be drained before the rest is fed again.
+ * Returns: FP_OK, or the error that stopped the stream. Errors are sticky.
+ */
+FpStatus fp_stream_feed(FpStream* stream, const char* data, size_t len, size_t* consumed);
+
+/*
+ * Function: fp_stream_apply
+ * Description: Encrypts or decrypts a chunk in place, continuing the key
+ *              where the previous chunk stopped. Nothing is buffered, so
+ *              there is nothing to drain. Cipher streams only.
+ * Returns: FP_OK, or FP_ERROR_ARGUMENT for other streams.
+ */
+FpStatus fp_stream_apply(FpStream* stream, char* data, size_t len);
+
+/*
+ * Function: fp_stream_drain
+ * Description: Moves waiting output into the caller's buffer.
+ * Parameters:
+ *   - output, capacity: Where to put it and how much fits.
+ *   - produced: Receives the number of bytes written; 0 when nothing waits.
+ * Returns: FP_OK, or the error that stopped the stream.
+ */
+FpStatus fp_stream_drain(FpStream* stream, char* output, size_t capacity, size_t* produced);
+
+/*
+ * Function: fp_stream_finish
+ * Description: Marks the end of the input. Compression emits its last block
+ *              and the end marker; decompression checks that the input was
+ *              complete. Drain until nothing is left afterwards.
+ * Returns: FP_OK, or the error that stopped the stream.
+ */
+FpStatus fp_stream_finish(FpStream* stream);
+
+size_t fp_stream_pending(const FpStream* stream); // Bytes waiting to be drained
+void fp_free_stream(FpStream* stream);
+
+// --- Search ---
+
+typedef struct FpSearch FpSearch;
+
+/*
+ * Function: fp_create_search
+ * Description: Creates a streaming search. The output is the same text the
+ *              command line prints for these options.
+ * Parameters:
+ *   - keyword: Text to look for, copied.
+ *   - options: Output modes; see SearchOptions.
+ *   - label: Name printed by files_with_matches, copied. May be NULL.
+ *   - status: Receives the reason when NULL is returned. May be NULL.
+ * Returns: The search, or NULL on error.
+ */
+FpSearch* fp_create_search(const char* keyword, const SearchOptions* options,
+                           const char* label, FpStatus* status);
+
+// Same contract as fp_stream_feed. Once fp_search_done returns 1, further
+// input is consumed without being scanned.
+FpStatus fp_search_feed(FpSearch* search, const char* data, size_t len, size_t* consumed);
+int fp_search_done(const FpSearch* search); // The answer is known; stop reading
+FpStatus fp_search_drain(FpSearch* search, char* output, size_t capacity, size_t* produced);
+// Completes a final line without a newline and adds any summary line
+FpStatus fp_search_finish(FpSearch* search, size_t* match_count);
+void fp_free_search(FpSearch* search);
+
+// --- Sort ---
+
+/*
+ * Function: fp_sort
+ * Description: Sorts the lines of text into the caller's buffer. A last line
+ *              without a newline gets one, so len + 2 bytes are always enough.
+ * Parameters:
+ *   - text, len: The input; it is not modified.
+ *   - options: Sort order, or NULL for plain byte order.
+ *   - threads: Worker threads for large inputs; 0 or 1 sorts on this thread.
+ *   - output, capacity: The caller's buffer.
+ *   - produced: Receives the output length, or the size needed when the
+ *               buffer is too small.
+ * Returns: FP_OK, FP_ERROR_BUFFER_TOO_SMALL or FP_ERROR_MEMORY.
+ */
+FpStatus fp_sort(const char* text, size_t len, const SortOptions* options, size_t threads,
+                 char* output, size_t capacity, size_t* produced);
+
+#endif // FILEPROCESSOR_H
@@ -9,9 +9,83 @@
 char* read_file(const char* filename, size_t* file_size);
 int write_file(const char* filename, const char* data, size_t data_size);
 
+// Standard streams: "-" names standard input or standard output
+int is_stdio_name(const char* filename);
+
+// Per-thread standard streams, so a server thread can answer its own client.
+// NULL restores the process's stream; errors from handle_error follow too.
+void redirect_thread_stdio(FILE* input, FILE* output, FILE* error);
+FILE* thread_stdin(void);
+FILE* thread_stdout(void);
+FILE* thread_stderr(void);
+
+FILE* open_input_stream(const char* filename);
+FILE* open_output_stream(const char* filename);
+int close_stream(FILE* file); // Leaves stdin/stdout open; returns 0 or EOF like fclose
+
+// Chunk size for modes that process their input as it arrives, sized to stay in L2
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+// Read-only view of an input file: memory-mapped when possible, otherwise
+// read into a buffer (pipes, character devices and other special files)
+typedef struct {
+    const char* data;
+    size_t size;
+    int mapped;
+    void* mapping;      // Writable alias of data for munmap
+    size_t mapping_size;
+} InputFile;
+
+InputFile* open_input_file(const char* filename);
+void close_input_file(InputFile* input);
+
+// Scratch buffers one worker thread reuses from file to file, so a batch
+// does not pay for large allocations and their page faults on every file
+typedef struct {
+    char* input;       // Input chunks or blocks
+    size_t input_capacity;
+    char* output;      // Output buffer storage
+    size_t output_capacity;
+    char* frame;       // Compressed frames
+    size_t frame_capacity;
+} Workspace;
+
+Workspace* create_workspace(void);
+void free_workspace(Workspace* workspace);
+char* reserve_scratch(char** buffer, size_t* capacity, size_t size); // Grows, never shrinks
+
+// Buffered output writer
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+struct AsyncWriter;
+
+typedef struct {
+    FILE* file;
+    char* data;
+    size_t size;
+    size_t start;               // Bytes already taken by output_buffer_drain
+    size_t capacity;
+    struct AsyncWriter* writer; // Set when full buffers are written on a background thread
+    int failed;                 // A write failed and was reported; later writes are dropped
+    int borrowed;               // data belongs to a Workspace
+} OutputBuffer;
+
+OutputBuffer* create_output_buffer(FILE* file, size_t capacity);
+// Collects output in memory for output_buffer_drain, growing as needed (file is NULL)
+OutputBuffer* create_memory_output_buffer(size_t capacity);
+// Writes on a background thread, or synchronously into the workspace's buffer when one is given
+OutputBuffer* create_async_output_buffer(FILE* file, size_t capacity, Workspace* workspace);
+int output_buffer_write(OutputBuffer* out, const char* data, size_t len);
+size_t output_buffer_drain(OutputBuffer* out, char* dest, size_t capacity); // Memory buffers only
+int flush_output_buffer(OutputBuffer* out);
+void free_output_buffer(OutputBuffer* out);
+
 // Error handling
 void handle_error(const char* message);
 void handle_memory_error(void);
+// Whether handle_memory_error exits the process. The command line turns it
+// on; the library leaves it off so callers get an error code back.
+void set_memory_error_exit(int enabled);
 
 // String utilities
 char* my_strdup(const char* s);
@@ -0,0 +1,75 @@
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Positions of every newline in a text. Offsets are stored as 32-bit values
+ * when the text is under 4 GiB and as 64-bit values otherwise.
+ *
+ * Line i runs from just after newline i - 1 up to newline i; a last line
+ * without a trailing newline is still a line. crlf is set when the first
+ * line ends in "\r\n"; the text is then taken to use CRLF endings, a
+ * carriage return directly before a newline belongs to the terminator
+ * rather than the line, and output should keep that style.
+ */
+typedef struct {
+    const char* text;
+    size_t text_len;
+    void* offsets;       // uint32_t or uint64_t newline positions
+    int wide;            // offsets holds uint64_t values
+    size_t newlines;     // Number of newlines
+    size_t count;        // Number of lines
+    size_t capacity;     // Offsets the array can hold
+    int crlf;
+} LineIndex;
+
+/*
+ * Function: build_line_index
+ * Description: Finds all newlines of a text in one vectorized pass. Texts
+ *              of several megabytes are split into chunks scanned by up to
+ *              threads worker threads.
+ * Returns: Pointer to the index or NULL on error.
+ */
+LineIndex* build_line_index(const char* text, size_t text_len, size_t threads);
+
+/*
+ * Function: rebuild_line_index
+ * Description: Indexes another text with an existing index, reusing its
+ *              offset array. Used for streams indexed one block at a time.
+ * Returns: 1 on success, 0 on error.
+ */
+int rebuild_line_index(LineIndex* index, const char* text, size_t text_len);
+
+void free_line_index(LineIndex* index);
+
+// Offset of newline i
+static inline size_t line_index_newline(const LineIndex* index, size_t i) {
+    return index->wide ? (size_t)((const uint64_t*)index->offsets)[i]
+                       : ((const uint32_t*)index->offsets)[i];
+}
+
+static inline size_t line_index_start(const LineIndex* index, size_t i) {
+    return i == 0 ? 0 : line_index_newline(index, i - 1) + 1;
+}
+
+// Length of line i, not including its terminator
+static inline size_t line_index_length(const LineIndex* index, size_t i) {
+    size_t start = line_index_start(index, i);
+    if (i >= index->newlines) {
+        return index->text_len - start;
+    }
+    size_t end = line_index_newline(index, i);
+    if (index->crlf && end > start && index->text[end - 1] == '\r') {
+        end--;
+    }
+    return end - start;
+}
+
+// Line containing the given offset
+size_t line_index_find(const LineIndex* index, size_t offset);
+
+#endif // LINEINDEX_H
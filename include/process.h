@@ -0,0 +1,28 @@
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cli.h"
+#include "io.h"
+
+/*
+ * Function: process_file
+ * Description: Runs the mode selected in opts on one input. This is the
+ *              whole job of a single-file invocation and of each file in a
+ *              batch; it only reads opts, so worker threads can share them.
+ * Parameters:
+ *   - opts: Parsed options; input_file and output_file are not used.
+ *   - input_file: Input path, or "-" for standard input.
+ *   - output_file: Output path, "-" for standard output, or NULL for search.
+ *   - results: Stream that receives search results.
+ *   - workspace: Scratch buffers of the calling worker thread, or NULL for
+ *                a standalone run, which overlaps I/O on background threads.
+ * Returns: The exit status: 0 on success, 1 on error or when a --quiet
+ *          search finds nothing.
+ */
+int process_file(const Options* opts, const char* input_file, const char* output_file,
+                 FILE* results, Workspace* workspace);
+
+#endif // PROCESS_H
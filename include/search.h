@@ -4,17 +4,55 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include "io.h"
+#include "lineindex.h"
 
-// Search result structure
-typedef struct SearchResult {
-    int line_number;
-    char* line;
-    struct SearchResult* next;
-} SearchResult;
+// Search output modes
+typedef struct {
+    int count_only;          // Print only the number of matching lines
+    size_t max_count;        // Stop after this many matching lines (0 = no limit)
+    int files_with_matches;  // Print only the label of a matching input
+    int quiet;               // Print nothing, report through the match count
+    int fuzzy;               // Match the keyword within an edit distance
+    size_t max_errors;       // Edit distance allowed by fuzzy matching
+    size_t max_line_length;  // Longest line held across chunks (0 = no limit)
+} SearchOptions;
 
-// Search functions
-SearchResult* search_text(const char* text, const char* keyword);
-void free_search_results(SearchResult* results);
-void print_search_results(SearchResult* results);
+// Line limit for decrypted input, so its plaintext is never held whole
+#define SEARCH_MAX_LINE_LENGTH (1024 * 1024)
 
-#endif // SEARCH_H 
\ No newline at end of file
+// Streaming search state
+typedef struct SearchContext {
+    const char* keyword;
+    size_t keyword_len;
+    SearchOptions options;
+    const char* label;       // Name printed by files_with_matches
+    OutputBuffer* out;
+    size_t line_number;      // Number of the next line to complete
+    size_t match_count;
+    int done;                // Set once the answer is known
+    char* carry;             // Incomplete last line of the previous chunk, wiped
+                             // before it is freed
+    size_t carry_len;
+    size_t carry_capacity;
+    uint64_t* fuzzy_masks;   // Bitap masks, fuzzy_words words per byte value
+    uint64_t* fuzzy_state;   // Bitap state, (max_errors + 1) * fuzzy_words words
+    size_t fuzzy_words;
+    LineIndex* index;        // Scratch index of the block being scanned
+} SearchContext;
+
+/*
+ * Streaming search. Feed the input in chunks of any size; matching lines are
+ * written to the output buffer as they are found. search_feed returns 0 once
+ * the answer is known (quiet, files_with_matches or max_count reached) so the
+ * caller can stop reading. search_finish handles a final line without a
+ * trailing newline, writes any summary and returns the number of matches.
+ */
+SearchContext* create_search_context(const char* keyword, const SearchOptions* options,
+                                      const char* label, OutputBuffer* out);
+int search_feed(SearchContext* ctx, const char* data, size_t len);
+size_t search_finish(SearchContext* ctx);
+void free_search_context(SearchContext* ctx);
+
+#endif // SEARCH_H 
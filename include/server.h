@@ -0,0 +1,57 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cli.h"
+
+/*
+ * Protocol over the Unix domain socket, one request per connection. All
+ * integers are 4-byte little-endian.
+ *
+ * Request:  the magic "FPQ1", the argument count, then each argument as a
+ *           length and its bytes. The arguments are a normal command line
+ *           without the program name. When the input is "-", the payload
+ *           follows as chunks, each a length and its bytes, ended by a
+ *           zero length.
+ * Response: frames of a type byte, a length and that many bytes, sent as
+ *           the request runs. 'O' is standard output, 'E' is standard error
+ *           and 'X' carries the 4-byte exit status and ends the response.
+ *           A payload over the server's limit is not read further; the
+ *           response is an error and exit status 1.
+ */
+#define SERVER_REQUEST_MAGIC "FPQ1"
+#define SERVER_MAX_ARGS 256
+#define SERVER_MAX_ARG_LEN (64 * 1024)
+#define SERVER_MAX_CHUNK (16 * 1024 * 1024)
+#define SERVER_DEFAULT_MAX_PAYLOAD ((size_t)256 * 1024 * 1024) // Unless --max-payload is given
+
+/*
+ * Function: run_server
+ * Description: Listens on opts->serve_socket and answers requests on a pool
+ *              of opts->threads workers. Each worker keeps its scratch
+ *              buffers from request to request. A request's input is held
+ *              in memory up to opts->max_payload bytes; its output is not
+ *              held, but streamed back. Runs until SIGINT or SIGTERM, then
+ *              removes the socket.
+ * Returns: The exit status.
+ */
+int run_server(const Options* opts);
+
+/*
+ * Function: run_client
+ * Description: Sends the command line to a server instead of running it
+ *              here, and replays the server's output, errors and exit
+ *              status. Relative -i, -o, --temp-dir and --store paths are
+ *              made absolute first, since the server has its own working
+ *              directory. Standard input is forwarded when the input is "-".
+ * Parameters:
+ *   - opts: The parsed command line, already validated.
+ *   - argc, argv: The original command line; --client and its value are
+ *                 not forwarded.
+ * Returns: The exit status of the request.
+ */
+int run_client(const Options* opts, int argc, char** argv);
+
+#endif // SERVER_H
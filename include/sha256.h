@@ -0,0 +1,28 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// SHA-256 (FIPS 180-4), used to fingerprint chunks in the chunk store
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;                          // Bytes hashed so far
+    unsigned char block[SHA256_BLOCK_SIZE];   // Bytes of an incomplete block
+    size_t block_len;
+} Sha256;
+
+void sha256_init(Sha256* ctx);
+void sha256_update(Sha256* ctx, const void* data, size_t len);
+void sha256_final(Sha256* ctx, unsigned char* digest);
+
+// Hashes one buffer
+void sha256(const void* data, size_t len, unsigned char* digest);
+
+#endif // SHA256_H
@@ -4,17 +4,67 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
-// Line array structure
+// A line stored as a slice of the text it was split from
 typedef struct {
-    char** lines;
+    uint64_t prefix;   // First 8 bytes, big-endian and zero-padded
+    size_t offset;     // Start of the line in the text
+    size_t length;     // Length without the newline
+} LineSlice;
+
+// Line array structure. The slices point into text, which is not owned.
+typedef struct {
+    const char* text;
+    LineSlice* lines;
     size_t count;
+    int crlf;          // Join lines with "\r\n" instead of "\n"
 } LineArray;
 
+// Sort order options
+typedef struct {
+    size_t key_field;  // 1-based field to sort on (0 = whole line)
+    char separator;    // Field separator (0 = runs of blanks)
+    int numeric;       // Compare keys as decimal numbers
+    int human;         // Compare keys as sizes with K, M, G, ... suffixes
+    int reverse;       // Reverse the order
+    int stable;        // Keep the input order of lines with equal keys
+    int unique;        // Keep only the first line of each run of equal keys
+} SortOptions;
+
+// A line decorated with its sort key, extracted and parsed once
+typedef struct {
+    LineSlice line;
+    LineSlice key;     // Key bytes, relative to the same text as line
+    double number;     // Parsed key for numeric and human orders
+    size_t index;      // Input position
+} KeyedLine;
+
 // Sort functions
-LineArray* split_into_lines(const char* text);
+LineArray* split_into_lines(const char* text, size_t text_len, size_t threads);
 void sort_lines(LineArray* lines);
-char* join_lines(LineArray* lines);
+// The parallel and keyed sorts need scratch memory; they return 0 when it
+// cannot be allocated, leaving the lines unsorted, and 1 otherwise
+int sort_lines_parallel(LineArray* lines, size_t threads);
+int sort_lines_with_options(LineArray* lines, const SortOptions* options, size_t threads);
+// Bytes splitting and sorting line_count lines hold beyond the text itself
+size_t sort_memory_estimate(size_t line_count, const SortOptions* options, size_t threads);
+char* join_lines(LineArray* lines, size_t* output_len);
+size_t joined_lines_size(const LineArray* lines);
+size_t join_lines_into(const LineArray* lines, char* output); // Needs joined_lines_size bytes
 void free_line_array(LineArray* lines);
 
-#endif // SORT_H 
\ No newline at end of file
+// Line slice helpers
+LineSlice make_line_slice(const char* text, size_t offset, size_t length);
+int compare_line_slices(const char* text, const LineSlice* a, const LineSlice* b);
+
+// Sort key helpers. Lines may come from different texts, as in a merge.
+int sort_options_use_keys(const SortOptions* options);
+KeyedLine make_keyed_line(const char* text, const LineSlice* line,
+                          const SortOptions* options, size_t index);
+int compare_sort_keys(const SortOptions* options, const char* text_a, const KeyedLine* a,
+                      const char* text_b, const KeyedLine* b);
+int compare_keyed_lines(const SortOptions* options, const char* text_a, const KeyedLine* a,
+                        const char* text_b, const KeyedLine* b);
+
+#endif // SORT_H 
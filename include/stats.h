@@ -0,0 +1,84 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Per-phase timing for --stats. Code brackets a phase with STATS_BEGIN and
+ * STATS_END; each pair adds its wall time, the CPU time of the thread that
+ * ran it and a byte count to that phase's totals, from any thread.
+ *
+ * Until stats_enable is called a pair costs one predictable branch. Built
+ * with -DFP_NO_STATS (make STATS=0) the macros expand to nothing and their
+ * arguments are not evaluated.
+ */
+
+typedef enum {
+    STATS_READ,
+    STATS_HISTOGRAM,
+    STATS_TREE,
+    STATS_CODES,
+    STATS_ENCODE,
+    STATS_DECODE,
+    STATS_CIPHER,
+    STATS_SEARCH,
+    STATS_SPLIT,
+    STATS_SORT,
+    STATS_DEDUP,
+    STATS_JOIN,
+    STATS_CHUNK,
+    STATS_FINGERPRINT,
+    STATS_WRITE,
+    STATS_PHASE_COUNT
+} StatsPhase;
+
+typedef struct {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+} StatsMark;
+
+extern int stats_enabled;
+
+void stats_enable(void);
+void stats_read_clocks(StatsMark* mark);
+void stats_record(const StatsMark* start, StatsPhase phase, uint64_t bytes);
+void stats_note_allocation(void);
+
+// CPU time of the calling thread so far, for a worker thread to hand back
+uint64_t stats_thread_cpu_ns(void);
+// Counts a finished worker's CPU time as the calling thread's own, so the
+// phase that started the workers includes it
+void stats_add_helper_cpu(uint64_t cpu_ns);
+
+// Prints the totals, bytes in and out, allocations and peak RSS as a table
+// or, with json set, as one JSON object
+void stats_report(FILE* out, int json);
+
+static inline void stats_begin(StatsMark* mark) {
+    if (stats_enabled) {
+        stats_read_clocks(mark);
+    }
+}
+
+static inline void stats_end(const StatsMark* mark, StatsPhase phase, uint64_t bytes) {
+    if (stats_enabled) {
+        stats_record(mark, phase, bytes);
+    }
+}
+
+#ifdef FP_NO_STATS
+#define STATS_BEGIN(mark)
+#define STATS_END(mark, phase, bytes)
+#define STATS_THREAD_CPU() 0
+#define STATS_ADD_HELPER_CPU(cpu_ns)
+#else
+#define STATS_BEGIN(mark) StatsMark mark = { 0, 0 }; stats_begin(&mark)
+#define STATS_END(mark, phase, bytes) stats_end(&mark, phase, (uint64_t)(bytes))
+#define STATS_THREAD_CPU() stats_thread_cpu_ns()
+#define STATS_ADD_HELPER_CPU(cpu_ns) stats_add_helper_cpu(cpu_ns)
+#endif
+
+#endif // STATS_H
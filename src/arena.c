@@ -0,0 +1,132 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/arena.h"
+#include "../include/io.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 16 // Enough for any scalar type and SSE vectors
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t capacity;
+    size_t used;
+};
+
+// Block data starts after the header, rounded up to the alignment
+#define BLOCK_HEADER_SIZE ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static char* block_data(ArenaBlock* block) {
+    return (char*)block + BLOCK_HEADER_SIZE;
+}
+
+Arena* create_arena(size_t block_size) {
+    Arena* arena = malloc(sizeof(Arena));
+    if (!arena) {
+        handle_memory_error();
+        return NULL;
+    }
+    arena->blocks = NULL;
+    arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    return arena;
+}
+
+void free_arena(Arena* arena) {
+    if (arena) {
+        ArenaBlock* block = arena->blocks;
+        while (block) {
+            ArenaBlock* next = block->next;
+            free(block);
+            block = next;
+        }
+        free(arena);
+    }
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size_t rounded = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (rounded < size || rounded > SIZE_MAX - BLOCK_HEADER_SIZE) {
+        handle_memory_error();
+        return NULL;
+    }
+
+    ArenaBlock* block = arena->blocks;
+    if (!block || block->capacity - block->used < rounded) {
+        // What is left of the current block stays unused
+        size_t capacity = rounded > arena->block_size ? rounded : arena->block_size;
+        block = malloc(BLOCK_HEADER_SIZE + capacity);
+        if (!block) {
+            handle_memory_error();
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->capacity = capacity;
+        block->used = 0;
+        arena->blocks = block;
+    }
+
+    void* p = block_data(block) + block->used;
+    block->used += rounded;
+    return p;
+}
+
+ArenaMark arena_mark(const Arena* arena) {
+    ArenaMark mark;
+    mark.block = arena->blocks;
+    mark.used = arena->blocks ? arena->blocks->used : 0;
+    return mark;
+}
+
+void arena_rewind(Arena* arena, ArenaMark mark) {
+    ArenaBlock* block = arena->blocks;
+    while (block != mark.block) {
+        ArenaBlock* next = block->next;
+        if (!mark.block && !next) {
+            block->used = 0; // Rewinding to empty keeps the oldest block
+            arena->blocks = block;
+            return;
+        }
+        free(block);
+        block = next;
+    }
+    arena->blocks = block;
+    if (block) {
+        block->used = mark.used;
+    }
+}
+
+// --- Thread arenas ---
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+static int arena_key_created;
+
+static void free_thread_arena(void* arena) {
+    free_arena(arena);
+}
+
+static void create_arena_key(void) {
+    arena_key_created = pthread_key_create(&arena_key, free_thread_arena) == 0;
+}
+
+Arena* thread_arena(void) {
+    pthread_once(&arena_key_once, create_arena_key);
+    if (!arena_key_created) {
+        handle_error("Failed to create the thread arena");
+        return NULL;
+    }
+
+    Arena* arena = pthread_getspecific(arena_key);
+    if (!arena) {
+        arena = create_arena(0);
+        if (!arena) {
+            return NULL;
+        }
+        if (pthread_setspecific(arena_key, arena) != 0) {
+            handle_error("Failed to create the thread arena");
+            free_arena(arena);
+            return NULL;
+        }
+    }
+    return arena;
+}
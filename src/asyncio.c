@@ -0,0 +1,381 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/asyncio.h"
+#include "../include/io.h"
+#include "../include/stats.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * A ring of ASYNC_DEPTH chunk buffers shared by the caller and one I/O
+ * thread. Slots head .. head+count-1 hold data waiting for the consumer:
+ * the caller when reading, the I/O thread when writing. A slot stays
+ * counted while its consumer works on it, so the producer never touches it.
+ */
+typedef struct {
+    FILE* file;
+    char* buffers[ASYNC_DEPTH];
+    size_t lengths[ASYNC_DEPTH];
+    size_t chunk_size;
+    size_t head;
+    size_t count;
+    int done;     // Reader: end of file reached; writer: no more chunks coming
+    int failed;
+    int threaded;
+    int borrowed; // buffers[0] belongs to a Workspace and is the only buffer
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ChunkRing;
+
+struct AsyncReader {
+    ChunkRing ring;
+    int holding; // The caller holds the chunk at head
+    int stop;
+    int fd;      // Descriptor of the stream, read directly by the thread
+    int wake[2]; // Pipe written to interrupt a read that would block
+};
+
+struct AsyncWriter {
+    ChunkRing ring;
+    size_t slot; // Slot handed out by the last acquire
+};
+
+static int init_ring(ChunkRing* ring, FILE* file, size_t chunk_size) {
+    ring->file = file;
+    ring->chunk_size = chunk_size;
+    ring->head = 0;
+    ring->count = 0;
+    ring->done = 0;
+    ring->failed = 0;
+    ring->threaded = 0;
+    ring->borrowed = 0;
+    for (int i = 0; i < ASYNC_DEPTH; i++) {
+        ring->buffers[i] = malloc(chunk_size);
+        if (!ring->buffers[i]) {
+            handle_memory_error();
+            while (i-- > 0) {
+                free(ring->buffers[i]);
+            }
+            return 0;
+        }
+        ring->lengths[i] = 0;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+    return 1;
+}
+
+static void destroy_ring(ChunkRing* ring) {
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->changed);
+    if (ring->borrowed) {
+        return;
+    }
+    for (int i = 0; i < ASYNC_DEPTH; i++) {
+        free(ring->buffers[i]);
+    }
+}
+
+// --- Read-ahead ---
+
+/*
+ * Fills buffer from the descriptor, waiting for input with poll so a stop
+ * request wakes the thread instead of leaving it blocked on a pipe. Returns
+ * the bytes read; a short count means end of file, an error or a stop.
+ */
+static size_t read_chunk(AsyncReader* reader, char* buffer, size_t size, int* failed) {
+    size_t used = 0;
+    while (used < size) {
+        struct pollfd fds[2] = { { reader->fd, POLLIN, 0 }, { reader->wake[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *failed = 1;
+            break;
+        }
+        if (fds[1].revents) {
+            break; // Stop requested
+        }
+        ssize_t bytes_read = read(reader->fd, buffer + used, size - used);
+        if (bytes_read < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            *failed = bytes_read < 0;
+            break;
+        }
+        used += (size_t)bytes_read;
+    }
+    return used;
+}
+
+static void* read_ahead(void* arg) {
+    AsyncReader* reader = arg;
+    ChunkRing* ring = &reader->ring;
+
+    pthread_mutex_lock(&ring->lock);
+    while (!ring->done) {
+        while (ring->count == ASYNC_DEPTH && !reader->stop) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        if (reader->stop) {
+            break;
+        }
+        size_t slot = (ring->head + ring->count) % ASYNC_DEPTH;
+        pthread_mutex_unlock(&ring->lock);
+
+        STATS_BEGIN(read_mark);
+        int failed = 0;
+        size_t bytes_read = read_chunk(reader, ring->buffers[slot], ring->chunk_size, &failed);
+        STATS_END(read_mark, STATS_READ, bytes_read);
+
+        pthread_mutex_lock(&ring->lock);
+        if (bytes_read > 0) {
+            ring->lengths[slot] = bytes_read;
+            ring->count++;
+        }
+        if (bytes_read < ring->chunk_size) {
+            ring->done = 1;
+            ring->failed = failed;
+        }
+        pthread_cond_broadcast(&ring->changed);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+AsyncReader* create_async_reader(FILE* file, size_t chunk_size, Workspace* workspace) {
+    AsyncReader* reader = malloc(sizeof(AsyncReader));
+    if (!reader) {
+        handle_memory_error();
+        return NULL;
+    }
+    reader->holding = 0;
+    reader->stop = 0;
+    reader->fd = fileno(file);
+    reader->wake[0] = reader->wake[1] = -1;
+
+    if (workspace) {
+        ChunkRing* ring = &reader->ring;
+        memset(ring, 0, sizeof(ChunkRing));
+        ring->file = file;
+        ring->chunk_size = chunk_size;
+        ring->borrowed = 1;
+        ring->buffers[0] = reserve_scratch(&workspace->input, &workspace->input_capacity, chunk_size);
+        if (!ring->buffers[0]) {
+            free(reader);
+            return NULL;
+        }
+        pthread_mutex_init(&ring->lock, NULL);
+        pthread_cond_init(&ring->changed, NULL);
+        return reader;
+    }
+
+    if (!init_ring(&reader->ring, file, chunk_size)) {
+        free(reader);
+        return NULL;
+    }
+    // A stream with no descriptor, such as a memory stream, is read synchronously
+    if (reader->fd >= 0 && pipe(reader->wake) == 0) {
+        reader->ring.threaded = pthread_create(&reader->ring.thread, NULL, read_ahead, reader) == 0;
+        if (!reader->ring.threaded) {
+            close(reader->wake[0]);
+            close(reader->wake[1]);
+        }
+    }
+    return reader;
+}
+
+int async_reader_next(AsyncReader* reader, char** data, size_t* len) {
+    ChunkRing* ring = &reader->ring;
+
+    if (!ring->threaded) {
+        if (ring->done) {
+            return ring->failed ? -1 : 0;
+        }
+        STATS_BEGIN(read_mark);
+        size_t bytes_read = fread(ring->buffers[0], 1, ring->chunk_size, ring->file);
+        STATS_END(read_mark, STATS_READ, bytes_read);
+        if (bytes_read < ring->chunk_size) {
+            ring->done = 1;
+            ring->failed = ferror(ring->file) != 0;
+        }
+        if (bytes_read == 0) {
+            return ring->failed ? -1 : 0;
+        }
+        *data = ring->buffers[0];
+        *len = bytes_read;
+        return 1;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    if (reader->holding) {
+        // Hand the previous chunk back to the read-ahead thread
+        ring->head = (ring->head + 1) % ASYNC_DEPTH;
+        ring->count--;
+        reader->holding = 0;
+        pthread_cond_broadcast(&ring->changed);
+    }
+    while (ring->count == 0 && !ring->done) {
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+
+    int status;
+    if (ring->count > 0) {
+        *data = ring->buffers[ring->head];
+        *len = ring->lengths[ring->head];
+        reader->holding = 1;
+        status = 1;
+    } else {
+        status = ring->failed ? -1 : 0;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return status;
+}
+
+void free_async_reader(AsyncReader* reader) {
+    if (!reader) {
+        return;
+    }
+    ChunkRing* ring = &reader->ring;
+    if (ring->threaded) {
+        pthread_mutex_lock(&ring->lock);
+        reader->stop = 1;
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+        // A read from a pipe may block indefinitely once the caller stops
+        // early, so the thread waits on the wake pipe as well
+        ssize_t woken;
+        do {
+            woken = write(reader->wake[1], "", 1);
+        } while (woken < 0 && errno == EINTR);
+        pthread_join(ring->thread, NULL);
+        close(reader->wake[0]);
+        close(reader->wake[1]);
+    }
+    destroy_ring(ring);
+    free(reader);
+}
+
+// --- Write-behind ---
+
+static void* write_behind(void* arg) {
+    AsyncWriter* writer = arg;
+    ChunkRing* ring = &writer->ring;
+
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        while (ring->count == 0 && !ring->done) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        if (ring->count == 0) {
+            break;
+        }
+        size_t slot = ring->head;
+        int skip = ring->failed;
+        pthread_mutex_unlock(&ring->lock);
+
+        // After a failure the remaining chunks are dropped so the caller never blocks
+        STATS_BEGIN(write_mark);
+        int ok = skip || fwrite(ring->buffers[slot], 1, ring->lengths[slot], ring->file) == ring->lengths[slot];
+        STATS_END(write_mark, STATS_WRITE, skip ? 0 : ring->lengths[slot]);
+
+        pthread_mutex_lock(&ring->lock);
+        if (!ok) {
+            ring->failed = 1;
+        }
+        ring->head = (ring->head + 1) % ASYNC_DEPTH;
+        ring->count--;
+        pthread_cond_broadcast(&ring->changed);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+AsyncWriter* create_async_writer(FILE* file, size_t chunk_size) {
+    AsyncWriter* writer = malloc(sizeof(AsyncWriter));
+    if (!writer) {
+        handle_memory_error();
+        return NULL;
+    }
+    if (!init_ring(&writer->ring, file, chunk_size)) {
+        free(writer);
+        return NULL;
+    }
+    writer->slot = 0;
+    writer->ring.threaded = pthread_create(&writer->ring.thread, NULL, write_behind, writer) == 0;
+    return writer;
+}
+
+char* async_writer_acquire(AsyncWriter* writer) {
+    ChunkRing* ring = &writer->ring;
+    if (!ring->threaded) {
+        writer->slot = 0;
+        return ring->buffers[0];
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count == ASYNC_DEPTH) {
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    writer->slot = (ring->head + ring->count) % ASYNC_DEPTH;
+    pthread_mutex_unlock(&ring->lock);
+    return ring->buffers[writer->slot];
+}
+
+int async_writer_submit(AsyncWriter* writer, size_t len) {
+    ChunkRing* ring = &writer->ring;
+    if (!ring->threaded) {
+        STATS_BEGIN(write_mark);
+        if (!ring->failed && fwrite(ring->buffers[0], 1, len, ring->file) != len) {
+            ring->failed = 1;
+        }
+        STATS_END(write_mark, STATS_WRITE, len);
+        return !ring->failed;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    ring->lengths[writer->slot] = len;
+    ring->count++;
+    int ok = !ring->failed;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    return ok;
+}
+
+int async_writer_wait(AsyncWriter* writer) {
+    ChunkRing* ring = &writer->ring;
+    if (!ring->threaded) {
+        return !ring->failed;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->count > 0) {
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    int ok = !ring->failed;
+    pthread_mutex_unlock(&ring->lock);
+    return ok;
+}
+
+int finish_async_writer(AsyncWriter* writer) {
+    if (!writer) {
+        return 1;
+    }
+    ChunkRing* ring = &writer->ring;
+    if (ring->threaded) {
+        pthread_mutex_lock(&ring->lock);
+        ring->done = 1;
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_join(ring->thread, NULL);
+    }
+    int ok = !ring->failed;
+    destroy_ring(ring);
+    free(writer);
+    return ok;
+}
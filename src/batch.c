@@ -0,0 +1,568 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/batch.h"
+#include "../include/io.h"
+#include "../include/process.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    char* input;
+    char* output;
+} BatchJob;
+
+typedef struct {
+    char** paths;
+    size_t count;
+    size_t capacity;
+} PathList;
+
+// Bounded job queue shared by the producer and the worker pool
+typedef struct {
+    const Options* opts;
+    BatchJob* jobs;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    int closed;        // No more jobs will be queued
+    size_t queued;
+    size_t finished;
+    size_t failed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_mutex_t report_lock; // Keeps progress lines and search results whole
+} BatchQueue;
+
+// --- Output names ---
+
+static int append_text(char** buffer, size_t* len, size_t* capacity, const char* text, size_t text_len) {
+    if (*len + text_len + 1 > *capacity) {
+        size_t new_capacity = (*len + text_len + 1) * 2;
+        char* grown = realloc(*buffer, new_capacity);
+        if (!grown) {
+            handle_memory_error();
+            return 0;
+        }
+        *buffer = grown;
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *len, text, text_len);
+    *len += text_len;
+    (*buffer)[*len] = '\0';
+    return 1;
+}
+
+char* expand_output_template(const char* output_template, const char* input_file) {
+    const char* slash = strrchr(input_file, '/');
+    const char* name = slash ? slash + 1 : input_file;
+    const char* dot = strrchr(name, '.');
+    if (dot == name) {
+        dot = NULL; // A leading dot marks a hidden file, not an extension
+    }
+    size_t name_len = strlen(name);
+    size_t stem_len = dot ? (size_t)(dot - name) : name_len;
+
+    const char* dir = ".";
+    size_t dir_len = 1;
+    if (slash) {
+        dir = input_file;
+        dir_len = slash == input_file ? 1 : (size_t)(slash - input_file);
+    }
+
+    size_t len = 0;
+    size_t capacity = 0;
+    char* output = NULL;
+    if (!append_text(&output, &len, &capacity, "", 0)) {
+        return NULL;
+    }
+
+    const char* p = output_template;
+    while (*p) {
+        int ok;
+        if (strncmp(p, "{path}", 6) == 0) {
+            ok = append_text(&output, &len, &capacity, input_file, strlen(input_file));
+            p += 6;
+        } else if (strncmp(p, "{dir}", 5) == 0) {
+            ok = append_text(&output, &len, &capacity, dir, dir_len);
+            p += 5;
+        } else if (strncmp(p, "{name}", 6) == 0) {
+            ok = append_text(&output, &len, &capacity, name, name_len);
+            p += 6;
+        } else if (strncmp(p, "{stem}", 6) == 0) {
+            ok = append_text(&output, &len, &capacity, name, stem_len);
+            p += 6;
+        } else if (strncmp(p, "{ext}", 5) == 0) {
+            ok = dot ? append_text(&output, &len, &capacity, dot + 1, strlen(dot + 1)) : 1;
+            p += 5;
+        } else {
+            ok = append_text(&output, &len, &capacity, p, 1);
+            p++;
+        }
+        if (!ok) {
+            free(output);
+            return NULL;
+        }
+    }
+    return output;
+}
+
+// --- Inputs ---
+
+static int add_path(PathList* list, const char* path) {
+    if (list->count == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+        char** grown = realloc(list->paths, new_capacity * sizeof(char*));
+        if (!grown) {
+            handle_memory_error();
+            return 0;
+        }
+        list->paths = grown;
+        list->capacity = new_capacity;
+    }
+    list->paths[list->count] = my_strdup(path);
+    if (!list->paths[list->count]) {
+        return 0;
+    }
+    list->count++;
+    return 1;
+}
+
+// Prints an error naming paths, which are too long for a fixed message buffer
+static void path_error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    char* message = len >= 0 ? malloc((size_t)len + 1) : NULL;
+    if (!message) {
+        handle_memory_error();
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(message, (size_t)len + 1, format, args);
+    va_end(args);
+    handle_error(message);
+    free(message);
+}
+
+static void free_path_list(PathList* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Collects regular files below dir. Symbolic links to directories are not
+// followed, so a link cycle cannot make the walk loop.
+static int collect_directory(const char* dir, PathList* list) {
+    DIR* handle = opendir(dir);
+    if (!handle) {
+        path_error("Failed to open directory %s", dir);
+        return 0;
+    }
+
+    int ok = 1;
+    size_t dir_len = strlen(dir);
+    struct dirent* entry;
+    while (ok && (entry = readdir(handle)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        size_t path_len = dir_len + strlen(entry->d_name) + 2;
+        char* path = malloc(path_len);
+        if (!path) {
+            handle_memory_error();
+            ok = 0;
+            break;
+        }
+        if (dir_len > 0 && dir[dir_len - 1] == '/') {
+            snprintf(path, path_len, "%s%s", dir, entry->d_name);
+        } else {
+            snprintf(path, path_len, "%s/%s", dir, entry->d_name);
+        }
+
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            ok = collect_directory(path, list);
+        } else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            ok = add_path(list, path);
+        }
+        free(path);
+    }
+
+    closedir(handle);
+    return ok;
+}
+
+// --- Queue ---
+
+// Queues a job; the queue takes ownership of its strings
+static void push_job(BatchQueue* queue, BatchJob job) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static int pop_job(BatchQueue* queue, BatchJob* job) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+    *job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+static void close_queue(BatchQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// --- Workers ---
+
+static int same_file(const char* a, const char* b) {
+    struct stat sa, sb;
+    if (strcmp(a, b) == 0) {
+        return 1;
+    }
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 &&
+           sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// Search results without an output template are collected per file and
+// printed in one piece, so results of different files never interleave
+static int process_job(BatchQueue* queue, const BatchJob* job, Workspace* workspace) {
+    const Options* opts = queue->opts;
+    if (opts->mode != MODE_SEARCH) {
+        return process_file(opts, job->input, job->output, stdout, workspace);
+    }
+
+    if (job->output) {
+        FILE* results = open_output_stream(job->output);
+        if (!results) {
+            return 1;
+        }
+        int result = process_file(opts, job->input, NULL, results, workspace);
+        if (close_stream(results) != 0) {
+            handle_error("Failed to write file");
+            result = 1;
+        }
+        return result;
+    }
+
+    char* text = NULL;
+    size_t text_len = 0;
+    FILE* results = open_memstream(&text, &text_len);
+    if (!results) {
+        handle_error("Failed to buffer search results");
+        return 1;
+    }
+    int result = process_file(opts, job->input, NULL, results, workspace);
+    fclose(results);
+
+    if (text_len > 0) {
+        pthread_mutex_lock(&queue->report_lock);
+        if (!opts->files_with_matches) {
+            printf("==> %s <==\n", job->input);
+        }
+        fwrite(text, 1, text_len, stdout);
+        pthread_mutex_unlock(&queue->report_lock);
+    }
+    free(text);
+    return result;
+}
+
+// Creates the directories above path that do not exist yet. Workers may
+// race to create the same one, so one that appears meanwhile is fine.
+static int create_parent_directories(const char* path) {
+    char* dirs = my_strdup(path);
+    if (!dirs) {
+        handle_memory_error();
+        return 0;
+    }
+    int ok = 1;
+    for (char* slash = strchr(dirs + 1, '/'); ok && slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        struct stat st;
+        if (mkdir(dirs, 0777) != 0 && (errno != EEXIST || stat(dirs, &st) != 0 || !S_ISDIR(st.st_mode))) {
+            path_error("Failed to create output directory %s", dirs);
+            ok = 0;
+        }
+        *slash = '/';
+    }
+    free(dirs);
+    return ok;
+}
+
+static int run_job(BatchQueue* queue, const BatchJob* job, Workspace* workspace) {
+    if (job->output && same_file(job->input, job->output)) {
+        handle_error("Output would overwrite the input");
+        return 1;
+    }
+
+    // A file that fails leaves no partial output behind, which a later
+    // batch over the same directory would take for an input
+    int is_file = job->output && !is_stdio_name(job->output);
+    if (is_file && !create_parent_directories(job->output)) {
+        return 1;
+    }
+    int existed = is_file && access(job->output, F_OK) == 0;
+    int result = process_job(queue, job, workspace);
+    if (result != 0 && is_file && !existed) {
+        remove(job->output);
+    }
+    return result;
+}
+
+static void report_job(BatchQueue* queue, const BatchJob* job, int failed) {
+    pthread_mutex_lock(&queue->lock);
+    queue->finished++;
+    if (failed) {
+        queue->failed++;
+    }
+    size_t finished = queue->finished;
+    size_t queued = queue->queued;
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_mutex_lock(&queue->report_lock);
+    if (failed) {
+        fprintf(stderr, "[%zu/%zu] FAILED %s\n", finished, queued, job->input);
+    } else if (job->output) {
+        fprintf(stderr, "[%zu/%zu] %s -> %s\n", finished, queued, job->input, job->output);
+    } else {
+        fprintf(stderr, "[%zu/%zu] %s\n", finished, queued, job->input);
+    }
+    pthread_mutex_unlock(&queue->report_lock);
+}
+
+static void* batch_worker(void* arg) {
+    BatchQueue* queue = arg;
+    Workspace* workspace = create_workspace();
+
+    BatchJob job;
+    while (pop_job(queue, &job)) {
+        int result = workspace ? run_job(queue, &job, workspace) : 1;
+        report_job(queue, &job, result != 0);
+        free(job.input);
+        free(job.output);
+    }
+
+    free_workspace(workspace);
+    return NULL;
+}
+
+// --- Producer ---
+
+static int compare_job_outputs(const void* a, const void* b) {
+    return strcmp(((const BatchJob*)a)->output, ((const BatchJob*)b)->output);
+}
+
+// Fails if two inputs expand to the same output, where workers would
+// silently overwrite each other's results
+static int check_distinct_outputs(const BatchJob* jobs, size_t count) {
+    BatchJob* sorted = malloc(count * sizeof(BatchJob));
+    if (!sorted) {
+        handle_memory_error();
+        return 0;
+    }
+    memcpy(sorted, jobs, count * sizeof(BatchJob));
+    qsort(sorted, count, sizeof(BatchJob), compare_job_outputs);
+
+    int ok = 1;
+    for (size_t i = 1; ok && i < count; i++) {
+        if (strcmp(sorted[i - 1].output, sorted[i].output) == 0) {
+            path_error("%s and %s would both be written to %s",
+                       sorted[i - 1].input, sorted[i].input, sorted[i].output);
+            ok = 0;
+        }
+    }
+    free(sorted);
+    return ok;
+}
+
+// Expands every output name before the first job is queued, so a clash
+// fails the batch before anything is written. The paths move into the jobs.
+static int queue_paths(BatchQueue* queue, PathList* list) {
+    if (list->count == 0) {
+        return 1;
+    }
+    BatchJob* jobs = calloc(list->count, sizeof(BatchJob));
+    if (!jobs) {
+        handle_memory_error();
+        return 0;
+    }
+
+    const char* output_template = queue->opts->output_template;
+    int ok = 1;
+    for (size_t i = 0; ok && i < list->count; i++) {
+        jobs[i].input = list->paths[i];
+        ok = !output_template ||
+             (jobs[i].output = expand_output_template(output_template, jobs[i].input)) != NULL;
+    }
+    ok = ok && (!output_template || check_distinct_outputs(jobs, list->count));
+
+    if (ok) {
+        // Progress shows the full total from the first report on
+        pthread_mutex_lock(&queue->lock);
+        queue->queued += list->count;
+        pthread_mutex_unlock(&queue->lock);
+    }
+    for (size_t i = 0; i < list->count; i++) {
+        if (ok) {
+            push_job(queue, jobs[i]);
+            list->paths[i] = NULL;
+        } else {
+            free(jobs[i].output);
+        }
+    }
+    free(jobs);
+    return ok;
+}
+
+static int collect_list(const char* list_file, PathList* paths) {
+    FILE* list = open_input_stream(list_file);
+    if (!list) {
+        return 0;
+    }
+
+    int ok = 1;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_len;
+    while (ok && (line_len = getline(&line, &line_capacity, list)) != -1) {
+        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+            line[--line_len] = '\0';
+        }
+        if (line_len > 0) {
+            ok = add_path(paths, line);
+        }
+    }
+    if (ferror(list)) {
+        handle_error("Failed to read file list");
+        ok = 0;
+    }
+
+    free(line);
+    close_stream(list);
+    return ok;
+}
+
+static int queue_list(BatchQueue* queue, const char* list_file) {
+    PathList list = { NULL, 0, 0 };
+    int ok = collect_list(list_file, &list) && queue_paths(queue, &list);
+    free_path_list(&list);
+    return ok;
+}
+
+static int queue_directory(BatchQueue* queue, const char* dir) {
+    // The whole tree is listed before any job starts, so outputs written
+    // inside it are never picked up as inputs
+    PathList list = { NULL, 0, 0 };
+    int ok = collect_directory(dir, &list);
+    if (ok) {
+        qsort(list.paths, list.count, sizeof(char*), compare_paths);
+    }
+    ok = ok && queue_paths(queue, &list);
+    free_path_list(&list);
+    return ok;
+}
+
+int run_batch(const Options* opts) {
+    // Parallelism comes from the pool, so each file is processed on one thread
+    Options worker_opts = *opts;
+    worker_opts.threads = 1;
+
+    size_t workers = opts->threads;
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (workers > MAX_BATCH_WORKERS) {
+        workers = MAX_BATCH_WORKERS;
+    }
+
+    // Workers run at the same time, so each gets its share of the budget
+    if (opts->max_memory > 0) {
+        worker_opts.max_memory = opts->max_memory / workers;
+        if (worker_opts.max_memory < MIN_MAX_MEMORY) {
+            handle_error("--max-memory leaves less than 16M per worker; lower -j");
+            return 1;
+        }
+    }
+
+    BatchQueue queue;
+    queue.opts = &worker_opts;
+    queue.capacity = workers * BATCH_QUEUE_PER_WORKER;
+    queue.jobs = malloc(queue.capacity * sizeof(BatchJob));
+    if (!queue.jobs) {
+        handle_memory_error();
+        return 1;
+    }
+    queue.head = 0;
+    queue.count = 0;
+    queue.closed = 0;
+    queue.queued = 0;
+    queue.finished = 0;
+    queue.failed = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+    pthread_mutex_init(&queue.report_lock, NULL);
+
+    pthread_t threads[MAX_BATCH_WORKERS];
+    size_t started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, batch_worker, &queue) == 0) {
+        started++;
+    }
+
+    int ok = started > 0;
+    if (!ok) {
+        handle_error("Failed to start batch workers");
+    } else {
+        struct stat st;
+        if (!is_stdio_name(opts->batch_source) && stat(opts->batch_source, &st) == 0 &&
+            S_ISDIR(st.st_mode)) {
+            ok = queue_directory(&queue, opts->batch_source);
+        } else {
+            ok = queue_list(&queue, opts->batch_source);
+        }
+    }
+
+    close_queue(&queue);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    fflush(stdout);
+
+    fprintf(stderr, "Processed %zu files, %zu failed\n", queue.finished, queue.failed);
+
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.not_empty);
+    pthread_cond_destroy(&queue.not_full);
+    pthread_mutex_destroy(&queue.report_lock);
+    free(queue.jobs);
+    return ok && queue.failed == 0 ? 0 : 1;
+}
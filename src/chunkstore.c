@@ -0,0 +1,558 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/chunkstore.h"
+#include "../include/asyncio.h"
+#include "../include/compress.h"
+#include "../include/contextmodel.h"
+#include "../include/sha256.h"
+#include "../include/stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Input is read this much at a time and cut in a window that also holds
+// the uncut tail of the previous read
+#define CHUNK_READ_SIZE (1024 * 1024)
+#define CHUNK_WINDOW_SIZE (CHUNK_READ_SIZE + CHUNK_MAX_SIZE)
+
+// A stored chunk is its tag and at most CHUNK_MAX_SIZE bytes, since it is
+// kept raw when compression does not help
+#define CHUNK_FILE_MAX (1 + CHUNK_MAX_SIZE)
+
+// Normalized chunking: before the average size a cut needs 16 zero bits,
+// after it only 12, which keeps most chunks close to the average. The top
+// bits of the Gear hash depend on the last 64 bytes.
+#define CHUNK_MASK_SMALL (~0ULL << (64 - 16))
+#define CHUNK_MASK_LARGE (~0ULL << (64 - 12))
+
+static uint64_t gear_table[256];
+
+// The table decides where chunks end, so it must be the same on every host
+// and in every version: splitmix64 from a fixed seed
+__attribute__((constructor))
+static void init_gear_table(void) {
+    uint64_t seed = 0;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+size_t find_chunk_boundary(const unsigned char* data, size_t len) {
+    if (len <= CHUNK_MIN_SIZE) {
+        return len;
+    }
+    size_t end = len < CHUNK_MAX_SIZE ? len : CHUNK_MAX_SIZE;
+    size_t normal = end < CHUNK_AVG_SIZE ? end : CHUNK_AVG_SIZE;
+
+    // Bytes before the minimum size are skipped rather than hashed
+    uint64_t hash = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear_table[data[i]];
+        if (!(hash & CHUNK_MASK_SMALL)) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear_table[data[i]];
+        if (!(hash & CHUNK_MASK_LARGE)) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+// --- Store layout ---
+
+// Returns 1 if the directory was created, 2 if it already existed and 0 on error
+static int make_directory(const char* path) {
+    if (mkdir(path, 0777) == 0) {
+        return 1;
+    }
+    if (errno != EEXIST) {
+        handle_error("Failed to create chunk store directory");
+        return 0;
+    }
+    return 2;
+}
+
+// Makes the entries of a directory durable, such as a file just renamed into it
+static int sync_directory(const char* path) {
+    int fd = open(path, O_RDONLY);
+    int ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+// Joins the store directory and a name into a new string
+static char* store_path(const char* store_dir, const char* name) {
+    size_t dir_len = strlen(store_dir);
+    char* path = malloc(dir_len + strlen(name) + 2);
+    if (!path) {
+        handle_memory_error();
+        return NULL;
+    }
+    sprintf(path, "%s/%s", store_dir, name);
+    return path;
+}
+
+static int create_store_directories(const char* store_dir) {
+    char* chunks_dir = store_path(store_dir, "chunks");
+    int created = chunks_dir && make_directory(store_dir) ? make_directory(chunks_dir) : 0;
+    int ok = created != 0;
+    if (created == 1 && !sync_directory(store_dir)) {
+        handle_error("Failed to create chunk store directory");
+        ok = 0;
+    }
+    free(chunks_dir);
+    return ok;
+}
+
+// Path of the chunk with the given digest
+static char* chunk_path(const char* store_dir, const unsigned char* digest) {
+    char name[sizeof("chunks/") + 2 * SHA256_DIGEST_SIZE + 1];
+    char* p = name + sprintf(name, "chunks/%02x/", digest[0]);
+    for (int i = 1; i < SHA256_DIGEST_SIZE; i++) {
+        p += sprintf(p, "%02x", digest[i]);
+    }
+    return store_path(store_dir, name);
+}
+
+/*
+ * Writes a chunk file under a temporary name, syncs it, then renames it
+ * into place and syncs the directory. A crash therefore leaves either the
+ * whole chunk or no chunk under its name, never a short one that later
+ * runs would dedup against.
+ */
+static int write_chunk_file(char* path, char tag, const char* body, size_t body_len) {
+    // The subdirectory is created with the first chunk that goes into it,
+    // and its own entry synced in the chunks directory
+    char* slash = strrchr(path, '/');
+    *slash = '\0';
+    int created = make_directory(path);
+    int ok = created != 0;
+    if (created == 1) {
+        char* parent_slash = strrchr(path, '/');
+        *parent_slash = '\0';
+        ok = sync_directory(path);
+        *parent_slash = '/';
+        if (!ok) {
+            handle_error("Failed to write chunk to the store");
+        }
+    }
+    *slash = '/';
+    if (!ok) {
+        return 0;
+    }
+
+    size_t path_len = strlen(path);
+    char* temp_path = malloc(path_len + sizeof(".XXXXXX"));
+    if (!temp_path) {
+        handle_memory_error();
+        return 0;
+    }
+    memcpy(temp_path, path, path_len);
+    memcpy(temp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int fd = mkstemp(temp_path);
+    FILE* file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!file) {
+        handle_error("Failed to write chunk to the store");
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp_path);
+        }
+        free(temp_path);
+        return 0;
+    }
+    fchmod(fd, 0644); // mkstemp leaves the file private
+
+    STATS_BEGIN(write_mark);
+    ok = fputc(tag, file) != EOF && fwrite(body, 1, body_len, file) == body_len &&
+         fflush(file) == 0 && fsync(fd) == 0;
+    ok = fclose(file) == 0 && ok;
+    STATS_END(write_mark, STATS_WRITE, 1 + body_len);
+    if (!ok || rename(temp_path, path) != 0) {
+        handle_error("Failed to write chunk to the store");
+        unlink(temp_path);
+        ok = 0;
+    }
+    free(temp_path);
+
+    if (ok) {
+        *slash = '\0';
+        ok = sync_directory(path);
+        *slash = '/';
+        if (!ok) {
+            handle_error("Failed to write chunk to the store");
+        }
+    }
+    return ok;
+}
+
+/*
+ * Decodes a chunk file of file_len bytes, read into file_buffer, and checks
+ * the chunk against len and digest. Returns the chunk in a new buffer, or
+ * NULL if the file does not hold it.
+ */
+static char* decode_chunk(const char* file_buffer, size_t file_len, const unsigned char* digest,
+                          size_t len) {
+    char* chunk = NULL;
+    size_t chunk_len = 0;
+    if (file_len > 0 && file_len <= CHUNK_FILE_MAX && file_buffer[0] == CHUNK_TAG_RAW) {
+        chunk_len = file_len - 1;
+        chunk = malloc(chunk_len + 1);
+        if (!chunk) {
+            handle_memory_error();
+            return NULL;
+        }
+        memcpy(chunk, file_buffer + 1, chunk_len);
+    } else if (file_len > 1 && file_len <= CHUNK_FILE_MAX && file_buffer[0] == CHUNK_TAG_HUFFMAN) {
+        chunk = huffman_decompress(file_buffer + 1, file_len - 1, &chunk_len);
+    } else if (file_len > 1 && file_len <= CHUNK_FILE_MAX && file_buffer[0] == CHUNK_TAG_CONTEXT) {
+        chunk = context_decompress(file_buffer + 1, file_len - 1, &chunk_len);
+    }
+
+    unsigned char actual[SHA256_DIGEST_SIZE];
+    if (chunk && chunk_len == len) {
+        STATS_BEGIN(fingerprint_mark);
+        sha256(chunk, chunk_len, actual);
+        STATS_END(fingerprint_mark, STATS_FINGERPRINT, chunk_len);
+    }
+    if (!chunk || chunk_len != len || memcmp(actual, digest, SHA256_DIGEST_SIZE) != 0) {
+        free(chunk);
+        return NULL;
+    }
+    return chunk;
+}
+
+/*
+ * Checks that a chunk file already in the store holds the chunk, by
+ * decoding and hashing it as a restore would. A store written before
+ * chunks were synced may hold empty or cut-off files, and a compressed
+ * chunk can be cut off after an intact header; such a chunk is written
+ * again. Chunks are at most CHUNK_MAX_SIZE bytes, so this stays cheap.
+ */
+static int existing_chunk_usable(const char* path, const unsigned char* digest, size_t len) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+    char* file_buffer = malloc(CHUNK_FILE_MAX + 1);
+    if (!file_buffer) {
+        handle_memory_error();
+        fclose(file);
+        return 0;
+    }
+    STATS_BEGIN(read_mark);
+    size_t file_len = fread(file_buffer, 1, CHUNK_FILE_MAX + 1, file);
+    STATS_END(read_mark, STATS_READ, file_len);
+    int read_failed = ferror(file);
+    fclose(file);
+
+    // A bad chunk is replaced, so what the decoders report about it is not
+    // an error of this run
+    FILE* input = thread_stdin();
+    FILE* output = thread_stdout();
+    FILE* error = thread_stderr();
+    FILE* quiet = fopen("/dev/null", "w");
+    if (quiet) {
+        redirect_thread_stdio(input, output, quiet);
+    }
+    char* chunk = read_failed ? NULL : decode_chunk(file_buffer, file_len, digest, len);
+    if (quiet) {
+        redirect_thread_stdio(input, output, error);
+        fclose(quiet);
+    }
+
+    int usable = chunk != NULL;
+    free(chunk);
+    free(file_buffer);
+    return usable;
+}
+
+// Adds a chunk unless the store has it. Returns the bytes written to the
+// store in *stored_len (0 for a chunk it already had).
+static int store_chunk(const char* store_dir, HuffmanModel model, const char* data, size_t len,
+                       const unsigned char* digest, size_t* stored_len) {
+    *stored_len = 0;
+    char* path = chunk_path(store_dir, digest);
+    if (!path) {
+        return 0;
+    }
+    if (existing_chunk_usable(path, digest, len)) {
+        free(path);
+        return 1;
+    }
+
+    size_t compressed_len;
+    char* compressed = model == HUFFMAN_ORDER1 ? context_compress(data, len, &compressed_len)
+                                               : huffman_compress(data, len, &compressed_len);
+    if (!compressed) {
+        free(path);
+        return 0;
+    }
+    int raw = compressed_len >= len;
+    const char* body = raw ? data : compressed;
+    size_t body_len = raw ? len : compressed_len;
+    char tag = raw ? CHUNK_TAG_RAW : model == HUFFMAN_ORDER1 ? CHUNK_TAG_CONTEXT : CHUNK_TAG_HUFFMAN;
+    int ok = write_chunk_file(path, tag, body, body_len);
+    if (ok) {
+        *stored_len = 1 + body_len;
+    }
+    free(compressed);
+    free(path);
+    return ok;
+}
+
+// --- Adding files ---
+
+typedef struct {
+    const char* store_dir;
+    HuffmanModel model;
+    OutputBuffer* manifest;
+    size_t chunk_count;
+    size_t new_count;
+    uint64_t stored_bytes;
+} ChunkWriter;
+
+static int add_chunk(ChunkWriter* writer, const char* data, size_t len) {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    STATS_BEGIN(fingerprint_mark);
+    sha256(data, len, digest);
+    STATS_END(fingerprint_mark, STATS_FINGERPRINT, len);
+
+    size_t stored_len;
+    if (!store_chunk(writer->store_dir, writer->model, data, len, digest, &stored_len)) {
+        return 0;
+    }
+    writer->chunk_count++;
+    if (stored_len > 0) {
+        writer->new_count++;
+        writer->stored_bytes += stored_len;
+    }
+
+    unsigned char length[HUFFMAN_MAX_VARINT_LEN];
+    size_t length_len = put_varint(length, len);
+    return output_buffer_write(writer->manifest, (const char*)length, length_len) &&
+           output_buffer_write(writer->manifest, (const char*)digest, SHA256_DIGEST_SIZE);
+}
+
+// Cuts and adds the input. A cut is only made with CHUNK_MAX_SIZE bytes in
+// the window or at the end of the input, so boundaries do not depend on how
+// the input was read.
+static int add_stream(ChunkWriter* writer, AsyncReader* reader, char* window) {
+    size_t window_len = 0;
+    for (;;) {
+        char* block;
+        size_t block_len;
+        int status = async_reader_next(reader, &block, &block_len);
+        if (status < 0) {
+            handle_error("Failed to read file");
+            return 0;
+        }
+        if (status > 0) {
+            memcpy(window + window_len, block, block_len);
+            window_len += block_len;
+        }
+
+        size_t offset = 0;
+        while (offset < window_len && (status == 0 || window_len - offset >= CHUNK_MAX_SIZE)) {
+            STATS_BEGIN(chunk_mark);
+            size_t len = find_chunk_boundary((const unsigned char*)window + offset, window_len - offset);
+            STATS_END(chunk_mark, STATS_CHUNK, len);
+            if (!add_chunk(writer, window + offset, len)) {
+                return 0;
+            }
+            offset += len;
+        }
+        memmove(window, window + offset, window_len - offset);
+        window_len -= offset;
+        if (status == 0) {
+            return 1;
+        }
+    }
+}
+
+int chunk_store_compress(const char* input_file, const char* output_file, const char* store_dir,
+                         HuffmanModel model, FILE* report, Workspace* workspace) {
+    if (!create_store_directories(store_dir)) {
+        return 0;
+    }
+
+    char* window;
+    if (workspace) {
+        window = reserve_scratch(&workspace->frame, &workspace->frame_capacity, CHUNK_WINDOW_SIZE);
+    } else {
+        window = malloc(CHUNK_WINDOW_SIZE);
+        if (!window) {
+            handle_memory_error();
+        }
+    }
+    FILE* input = window ? open_input_stream(input_file) : NULL;
+    FILE* output = input ? open_output_stream(output_file) : NULL;
+    AsyncReader* reader = output ? create_async_reader(input, CHUNK_READ_SIZE, workspace) : NULL;
+    ChunkWriter writer = { store_dir, model, NULL, 0, 0, 0 };
+    writer.manifest = reader ? create_output_buffer(output, STREAM_CHUNK_SIZE) : NULL;
+
+    int ok = writer.manifest &&
+             output_buffer_write(writer.manifest, CHUNK_MANIFEST_MAGIC, CHUNK_MANIFEST_MAGIC_LEN) &&
+             add_stream(&writer, reader, window) &&
+             output_buffer_write(writer.manifest, "", 1); // A zero length ends the manifest
+    if (writer.manifest) {
+        ok = flush_output_buffer(writer.manifest) && ok;
+    }
+
+    free_output_buffer(writer.manifest);
+    free_async_reader(reader);
+    if (output && close_stream(output) != 0) {
+        if (ok) {
+            handle_error("Failed to write file");
+        }
+        ok = 0;
+    }
+    if (input) {
+        close_stream(input);
+    }
+    if (!workspace) {
+        free(window);
+    }
+
+    if (ok && report) {
+        fprintf(report, "%zu chunks, %zu new (%llu bytes stored), %zu already in the store\n",
+                writer.chunk_count, writer.new_count, (unsigned long long)writer.stored_bytes,
+                writer.chunk_count - writer.new_count);
+    }
+    return ok;
+}
+
+// --- Restoring files ---
+
+// Reads a varint from a stream; returns 0 if it ends first or is invalid
+static int read_varint(FILE* input, uint64_t* value) {
+    unsigned char bytes[HUFFMAN_MAX_VARINT_LEN];
+    size_t len = 0;
+    int c;
+    do {
+        if ((c = getc(input)) == EOF) {
+            return 0;
+        }
+        bytes[len++] = (unsigned char)c;
+    } while ((c & 0x80) && len < HUFFMAN_MAX_VARINT_LEN);
+    return get_varint(bytes, len, value) != 0;
+}
+
+// Loads the chunk with the given digest and checks it; the chunk is
+// returned in a new buffer
+static char* load_chunk(const char* store_dir, const unsigned char* digest, size_t len,
+                        char* file_buffer) {
+    char* path = chunk_path(store_dir, digest);
+    if (!path) {
+        return NULL;
+    }
+    FILE* file = fopen(path, "rb");
+    free(path);
+    if (!file) {
+        handle_error("Chunk missing from the store");
+        return NULL;
+    }
+    STATS_BEGIN(read_mark);
+    size_t file_len = fread(file_buffer, 1, CHUNK_FILE_MAX + 1, file);
+    STATS_END(read_mark, STATS_READ, file_len);
+    int read_failed = ferror(file);
+    fclose(file);
+    if (read_failed) {
+        handle_error("Failed to read chunk from the store");
+        return NULL;
+    }
+
+    char* chunk = decode_chunk(file_buffer, file_len, digest, len);
+    if (!chunk) {
+        handle_error("Corrupt chunk in the store");
+    }
+    return chunk;
+}
+
+// Copies every chunk the manifest lists to out
+static int restore_chunks(FILE* manifest, OutputBuffer* out, const char* store_dir, char* file_buffer) {
+    for (;;) {
+        uint64_t len;
+        unsigned char digest[SHA256_DIGEST_SIZE];
+        if (!read_varint(manifest, &len)) {
+            handle_error("Truncated chunk manifest.");
+            return 0;
+        }
+        if (len == 0) {
+            return 1;
+        }
+        if (len > CHUNK_MAX_SIZE) {
+            handle_error("Corrupt chunk length in manifest.");
+            return 0;
+        }
+        if (fread(digest, 1, SHA256_DIGEST_SIZE, manifest) != SHA256_DIGEST_SIZE) {
+            handle_error("Truncated chunk manifest.");
+            return 0;
+        }
+
+        char* chunk = load_chunk(store_dir, digest, (size_t)len, file_buffer);
+        if (!chunk) {
+            return 0;
+        }
+        int ok = output_buffer_write(out, chunk, (size_t)len);
+        free(chunk);
+        if (!ok) {
+            return 0;
+        }
+    }
+}
+
+int chunk_store_restore(const char* input_file, const char* output_file, const char* store_dir,
+                        Workspace* workspace) {
+    FILE* input = open_input_stream(input_file);
+    if (!input) {
+        return 0;
+    }
+    char magic[CHUNK_MANIFEST_MAGIC_LEN];
+    if (fread(magic, 1, CHUNK_MANIFEST_MAGIC_LEN, input) != CHUNK_MANIFEST_MAGIC_LEN ||
+        memcmp(magic, CHUNK_MANIFEST_MAGIC, CHUNK_MANIFEST_MAGIC_LEN) != 0) {
+        handle_error("Input is not a chunk manifest.");
+        close_stream(input);
+        return 0;
+    }
+
+    char* file_buffer;
+    if (workspace) {
+        file_buffer = reserve_scratch(&workspace->frame, &workspace->frame_capacity, CHUNK_FILE_MAX + 1);
+    } else {
+        file_buffer = malloc(CHUNK_FILE_MAX + 1);
+        if (!file_buffer) {
+            handle_memory_error();
+        }
+    }
+    FILE* output = file_buffer ? open_output_stream(output_file) : NULL;
+    OutputBuffer* out = output ? create_async_output_buffer(output, OUTPUT_BUFFER_SIZE, workspace) : NULL;
+
+    int ok = out && restore_chunks(input, out, store_dir, file_buffer);
+    if (out) {
+        ok = flush_output_buffer(out) && ok;
+    }
+    free_output_buffer(out);
+    if (output && close_stream(output) != 0) {
+        if (ok) {
+            handle_error("Failed to write file");
+        }
+        ok = 0;
+    }
+    close_stream(input);
+    if (!workspace) {
+        free(file_buffer);
+    }
+    return ok;
+}
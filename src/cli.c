@@ -1,9 +1,51 @@
 #include "../include/cli.h"
 #include "../include/io.h"
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Parses a non-negative decimal count, rejecting trailing garbage and
+// values that do not fit a size_t
+static int parse_count(const char* text, size_t* value) {
+    char* end;
+    if (!text || *text == '\0' || *text == '-') {
+        return 0;
+    }
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed > SIZE_MAX) {
+        return 0;
+    }
+    *value = (size_t)parsed;
+    return 1;
+}
+
+// Parses a byte size with an optional K, M or G suffix, rejecting sizes
+// that do not fit a size_t
+static int parse_size(const char* text, size_t* value) {
+    char* end;
+    if (!text || *text == '\0' || *text == '-') {
+        return 0;
+    }
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || parsed == 0 || errno == ERANGE || parsed > SIZE_MAX >> shift) {
+        return 0;
+    }
+    parsed <<= shift;
+    *value = (size_t)parsed;
+    return 1;
+}
+
 Options* parse_cli(int argc, char** argv) {
     if (argc < 2) {
         print_help();
@@ -22,6 +64,37 @@ Options* parse_cli(int argc, char** argv) {
     opts->output_file = NULL;
     opts->key = NULL;
     opts->search_term = NULL;
+    opts->count_only = 0;
+    opts->max_count = 0;
+    opts->files_with_matches = 0;
+    opts->quiet = 0;
+    opts->fuzzy = 0;
+    opts->max_errors = 0;
+    opts->memory_limit = 0;
+    opts->max_memory = 0;
+    opts->temp_dir = NULL;
+    opts->threads = 1;
+    opts->key_field = 0;
+    opts->separator = '\0';
+    opts->numeric = 0;
+    opts->human = 0;
+    opts->reverse = 0;
+    opts->stable = 0;
+    opts->unique = 0;
+    opts->dedup = 0;
+    opts->count_lines = 0;
+    opts->sorted_output = 0;
+    opts->top_k = 0;
+    opts->top_tail = 0;
+    opts->top_count = 0;
+    opts->batch_source = NULL;
+    opts->output_template = NULL;
+    opts->serve_socket = NULL;
+    opts->client_socket = NULL;
+    opts->max_payload = 0;
+    opts->stats = 0;
+    opts->store_dir = NULL;
+    opts->context = 0;
 
     // Parse arguments
     for (int i = 1; i < argc; i++) {
@@ -47,19 +120,203 @@ Options* parse_cli(int argc, char** argv) {
             opts->key = my_strdup(argv[++i]);
         } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
             opts->search_term = my_strdup(argv[++i]);
+        } else if (strcmp(argv[i], "--count") == 0) {
+            opts->count_only = 1;
+        } else if (strcmp(argv[i], "--max-count") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], &opts->max_count) || opts->max_count == 0) {
+                handle_error("Invalid value for --max-count");
+                free_options(opts);
+                return NULL;
+            }
+        } else if (strcmp(argv[i], "--files-with-matches") == 0) {
+            opts->files_with_matches = 1;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            opts->quiet = 1;
+        } else if (strcmp(argv[i], "--fuzzy") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], &opts->max_errors)) {
+                handle_error("Invalid value for --fuzzy");
+                free_options(opts);
+                return NULL;
+            }
+            opts->fuzzy = 1;
+        } else if (strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+            if (!parse_size(argv[++i], &opts->memory_limit)) {
+                handle_error("Invalid value for --memory-limit");
+                free_options(opts);
+                return NULL;
+            }
+        } else if (strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+            if (!parse_size(argv[++i], &opts->max_memory)) {
+                handle_error("Invalid value for --max-memory");
+                free_options(opts);
+                return NULL;
+            }
+            if (opts->max_memory < MIN_MAX_MEMORY) {
+                handle_error("--max-memory must be at least 16M");
+                free_options(opts);
+                return NULL;
+            }
+        } else if (strcmp(argv[i], "--temp-dir") == 0 && i + 1 < argc) {
+            free(opts->temp_dir);
+            opts->temp_dir = my_strdup(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], &opts->threads) || opts->threads == 0) {
+                handle_error("Invalid value for -j");
+                free_options(opts);
+                return NULL;
+            }
+        } else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+            if (!parse_count(argv[++i], &opts->key_field) || opts->key_field == 0) {
+                handle_error("Invalid value for --key");
+                free_options(opts);
+                return NULL;
+            }
+        } else if (strcmp(argv[i], "--sep") == 0 && i + 1 < argc) {
+            if (strlen(argv[++i]) != 1) {
+                handle_error("Field separator must be a single character");
+                free_options(opts);
+                return NULL;
+            }
+            opts->separator = argv[i][0];
+        } else if (strcmp(argv[i], "--numeric") == 0) {
+            opts->numeric = 1;
+        } else if (strcmp(argv[i], "--human") == 0) {
+            opts->human = 1;
+        } else if (strcmp(argv[i], "--reverse") == 0) {
+            opts->reverse = 1;
+        } else if (strcmp(argv[i], "--stable") == 0) {
+            opts->stable = 1;
+        } else if (strcmp(argv[i], "--unique") == 0) {
+            opts->unique = 1;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            free(opts->batch_source);
+            opts->batch_source = my_strdup(argv[++i]);
+        } else if (strcmp(argv[i], "--output-template") == 0 && i + 1 < argc) {
+            free(opts->output_template);
+            opts->output_template = my_strdup(argv[++i]);
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            free(opts->serve_socket);
+            opts->serve_socket = my_strdup(argv[++i]);
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            free(opts->client_socket);
+            opts->client_socket = my_strdup(argv[++i]);
+        } else if (strcmp(argv[i], "--max-payload") == 0 && i + 1 < argc) {
+            if (!parse_size(argv[++i], &opts->max_payload)) {
+                handle_error("Invalid value for --max-payload");
+                free_options(opts);
+                return NULL;
+            }
+        } else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) {
+            free(opts->store_dir);
+            opts->store_dir = my_strdup(argv[++i]);
+        } else if (strcmp(argv[i], "--context") == 0) {
+            opts->context = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            opts->stats = 1;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            opts->stats = 2;
+        } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            handle_error("--stats takes no value or =json");
+            free_options(opts);
+            return NULL;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            opts->dedup = 1;
+        } else if (strcmp(argv[i], "--count-lines") == 0) {
+            opts->count_lines = 1;
+        } else if ((strcmp(argv[i], "--head") == 0 || strcmp(argv[i], "--tail") == 0) &&
+                   i + 1 < argc) {
+            opts->top_k = 1;
+            opts->top_tail = argv[i][2] == 't';
+            if (!parse_count(argv[++i], &opts->top_count)) {
+                handle_error("Invalid line count for --head or --tail");
+                free_options(opts);
+                return NULL;
+            }
+        }
+    }
+
+    // --dedup and --count-lines form their own mode; with --sort only the
+    // distinct lines get sorted
+    if ((opts->dedup || opts->count_lines) &&
+        (opts->mode == MODE_SORT || opts->mode == MODE_INVALID)) {
+        opts->sorted_output = opts->mode == MODE_SORT;
+        opts->mode = MODE_DEDUP;
+    }
+
+    // Statistics cover the whole process, so they mean nothing per request
+    if (opts->stats && (opts->serve_socket || opts->client_socket)) {
+        handle_error("--stats cannot be used with --serve or --client");
+        free_options(opts);
+        return NULL;
+    }
+
+    // A server takes its modes from each request
+    if (opts->serve_socket) {
+        if (opts->mode != MODE_INVALID || opts->client_socket || opts->batch_source) {
+            handle_error("--serve takes no mode, --client or --batch");
+            free_options(opts);
+            return NULL;
         }
+        return opts;
+    }
+
+    if (opts->max_payload) {
+        handle_error("--max-payload is only used with --serve");
+        free_options(opts);
+        return NULL;
+    }
+
+    if (opts->client_socket && opts->batch_source) {
+        handle_error("--batch cannot be sent to a server");
+        free_options(opts);
+        return NULL;
     }
 
     // Validate required options
-    if (opts->mode != MODE_HELP && !opts->input_file) {
+    int needs_output = opts->mode == MODE_COMPRESS || opts->mode == MODE_DECOMPRESS ||
+                       opts->mode == MODE_ENCRYPT || opts->mode == MODE_DECRYPT ||
+                       opts->mode == MODE_SORT || opts->mode == MODE_DEDUP;
+
+    if (opts->batch_source && opts->mode != MODE_HELP) {
+        if (opts->input_file || opts->output_file) {
+            handle_error("--batch replaces -i and -o; use --output-template for output names");
+            free_options(opts);
+            return NULL;
+        }
+        if (needs_output && !opts->output_template) {
+            handle_error("Output template is required for this mode");
+            free_options(opts);
+            return NULL;
+        }
+        if (is_stdio_name(opts->output_template)) {
+            handle_error("Batch output cannot go to standard output");
+            free_options(opts);
+            return NULL;
+        }
+        if (opts->quiet) {
+            handle_error("--quiet cannot be combined with --batch");
+            free_options(opts);
+            return NULL;
+        }
+    } else if (opts->mode != MODE_HELP && !opts->input_file) {
         handle_error("Input file is required");
         free_options(opts);
         return NULL;
+    } else if (needs_output && !opts->output_file) {
+        handle_error("Output file is required for this mode");
+        free_options(opts);
+        return NULL;
     }
 
-    if ((opts->mode == MODE_COMPRESS || opts->mode == MODE_ENCRYPT || 
-         opts->mode == MODE_DECRYPT || opts->mode == MODE_SORT) && !opts->output_file) {
-        handle_error("Output file is required for this mode");
+    if (opts->store_dir && opts->mode != MODE_COMPRESS && opts->mode != MODE_DECOMPRESS &&
+        opts->mode != MODE_HELP) {
+        handle_error("--store is only used with --compress or --decompress");
+        free_options(opts);
+        return NULL;
+    }
+
+    if (opts->context && opts->mode != MODE_COMPRESS && opts->mode != MODE_HELP) {
+        handle_error("--context is only used with --compress");
         free_options(opts);
         return NULL;
     }
@@ -85,6 +342,12 @@ void free_options(Options* opts) {
         free(opts->output_file);
         free(opts->key);
         free(opts->search_term);
+        free(opts->temp_dir);
+        free(opts->batch_source);
+        free(opts->output_template);
+        free(opts->serve_socket);
+        free(opts->client_socket);
+        free(opts->store_dir);
         free(opts);
     }
 }
@@ -99,13 +362,66 @@ void print_help(void) {
     printf("  --decrypt       Decrypt input file\n");
     printf("  --search        Search in input file\n");
     printf("  --sort          Sort lines in input file\n");
+    printf("  --dedup         Remove duplicate lines, keeping first-seen order\n");
+    printf("  --count-lines   Count occurrences of each distinct line\n");
+    printf("                  (with --sort, the distinct lines are sorted)\n");
     printf("  --help          Show this help message\n");
-    printf("  -i <file>       Input file\n");
-    printf("  -o <file>       Output file\n");
-    printf("  -k <key>        Encryption key\n");
-    printf("  -s <term>       Search term\n\n");
+    printf("  -i <file>       Input file ('-' for standard input)\n");
+    printf("  -o <file>       Output file ('-' for standard output)\n");
+    printf("  -k <key>        Encryption key (with --search, decrypts the input on the fly)\n");
+    printf("  -s <term>       Search term\n");
+    printf("  -j <n>          Sort or batch: number of worker threads (default 1)\n");
+    printf("  --batch <path>  Process every file under a directory, or every file listed\n");
+    printf("                  one per line in a file ('-' reads the list from standard input)\n");
+    printf("  --serve <socket>\n");
+    printf("                  Run as a daemon answering requests on a Unix domain socket,\n");
+    printf("                  with -j worker threads\n");
+    printf("  --max-payload <size>\n");
+    printf("                  Serve: largest standard input a request may send (default 256M)\n");
+    printf("  --client <socket>\n");
+    printf("                  Send this command to a running --serve daemon\n");
+    printf("  --output-template <t>\n");
+    printf("                  Batch: output name, where {path}, {dir}, {name}, {stem} and {ext}\n");
+    printf("                  stand for parts of the input path (e.g. out/{stem}.huff)\n");
+    printf("  --count         Search: print only the number of matching lines\n");
+    printf("  --max-count <n> Search: stop after n (at least 1) matching lines\n");
+    printf("  --files-with-matches\n");
+    printf("                  Search: print only the input name if it matches\n");
+    printf("  --quiet         Search: print nothing, exit status 0 on a match\n");
+    printf("  --fuzzy <k>     Search: match the term within k edits\n");
+    printf("  --key <n>       Sort: sort on field n instead of the whole line\n");
+    printf("  --sep <c>       Sort: field separator (default runs of blanks)\n");
+    printf("  --numeric       Sort: compare keys as numbers\n");
+    printf("  --human         Sort: compare keys as sizes such as 2K or 1.5G\n");
+    printf("  --reverse       Sort: reverse the order\n");
+    printf("  --stable        Sort: keep the input order of lines with equal keys\n");
+    printf("  --unique        Sort: output only the first line of equal keys\n");
+    printf("  --head <n>      Sort: output only the first n lines of the sorted order\n");
+    printf("  --tail <n>      Sort: output only the last n lines of the sorted order\n");
+    printf("  --memory-limit <size>\n");
+    printf("                  Sort: sort externally using about this much memory (e.g. 512M)\n");
+    printf("  --max-memory <size>\n");
+    printf("                  Keep every mode within about this much memory (at least 16M):\n");
+    printf("                  large searches read in chunks, large sorts sort externally,\n");
+    printf("                  and a mode that cannot fit stops with an error\n");
+    printf("  --store <dir>   Compress: split the input into content-defined chunks, add the\n");
+    printf("                  new ones to this chunk store and write a manifest as output.\n");
+    printf("                  Decompress: rebuild the file from a manifest and the store\n");
+    printf("  --context       Compress: code each byte with tables chosen by the byte before\n");
+    printf("                  it, for smaller text at some extra CPU; decompression detects it\n");
+    printf("  --stats[=json]  After the run, print the time spent in each phase, bytes in\n");
+    printf("                  and out, allocations and peak memory to standard error\n");
+    printf("  --temp-dir <dir>\n");
+    printf("                  Sort: directory for temporary files (default $TMPDIR or /tmp)\n\n");
     printf("Examples:\n");
     printf("  ./bin/file_processor --compress -i input.txt -o output.huff\n");
     printf("  ./bin/file_processor --encrypt -i input.txt -o output.enc -k secret\n");
     printf("  ./bin/file_processor --search -i input.txt -s keyword\n");
+    printf("  ./bin/file_processor --search -i output.enc -k secret -s keyword\n");
+    printf("  ./bin/file_processor --compress --context -i input.txt -o output.huff\n");
+    printf("  cat input.txt | ./bin/file_processor --compress -i - -o - > output.huff\n");
+    printf("  ./bin/file_processor --compress -i backup.tar -o backup.manifest --store store/\n");
+    printf("  ./bin/file_processor --compress --batch logs/ --output-template {path}.huff -j 8\n");
+    printf("  ./bin/file_processor --serve /tmp/fp.sock -j 4 &\n");
+    printf("  ./bin/file_processor --client /tmp/fp.sock --compress -i input.txt -o output.huff\n");
 } 
\ No newline at end of file
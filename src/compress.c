@@ -1,28 +1,35 @@
 #include "../include/compress.h"
+#include "../include/arena.h"
+#include "../include/asyncio.h"
+#include "../include/contextmodel.h"
+#include "../include/cpu.h"
 #include "../include/io.h"
+#include "../include/stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #define MAX_TREE_NODES 256 // Assuming ASCII characters
 
 // Helper structure for the min-heap
 typedef struct MinHeapNode {
     HuffmanNode* h_node;
-    unsigned frequency; // Frequency is also in HuffmanNode, but duplicated here for easier heap operations
+    uint64_t frequency; // Frequency is also in HuffmanNode, but duplicated here for easier heap operations
 } MinHeapNode;
 
 typedef struct MinHeap {
-    unsigned size;
-    unsigned capacity;
+    size_t size;
+    size_t capacity;
     MinHeapNode** array;
 } MinHeap;
 
 // --- Huffman Node Utility Functions ---
-HuffmanNode* new_huffman_node(char character, unsigned frequency) {
-    HuffmanNode* node = (HuffmanNode*)malloc(sizeof(HuffmanNode));
+// Nodes, heap entries and codes all come from the arena of the operation, so
+// a failure part way through leaves nothing to free: the caller rewinds.
+HuffmanNode* new_huffman_node(char character, uint64_t frequency, Arena* arena) {
+    HuffmanNode* node = arena_alloc(arena, sizeof(HuffmanNode));
     if (!node) {
-        handle_memory_error();
         return NULL;
     }
     node->left = node->right = NULL;
@@ -33,18 +40,15 @@ HuffmanNode* new_huffman_node(char character, unsigned frequency) {
 
 // --- Min-Heap Utility Functions (for building Huffman Tree) ---
 
-MinHeap* create_min_heap(unsigned capacity) {
-    MinHeap* min_heap = (MinHeap*)malloc(sizeof(MinHeap));
+MinHeap* create_min_heap(size_t capacity, Arena* arena) {
+    MinHeap* min_heap = arena_alloc(arena, sizeof(MinHeap));
     if (!min_heap) {
-        handle_memory_error();
         return NULL;
     }
     min_heap->size = 0;
     min_heap->capacity = capacity;
-    min_heap->array = (MinHeapNode**)malloc(min_heap->capacity * sizeof(MinHeapNode*));
+    min_heap->array = arena_alloc(arena, min_heap->capacity * sizeof(MinHeapNode*));
     if (!min_heap->array) {
-        handle_memory_error();
-        free(min_heap);
         return NULL;
     }
     return min_heap;
@@ -56,10 +60,10 @@ void swap_min_heap_nodes(MinHeapNode** a, MinHeapNode** b) {
     *b = t;
 }
 
-void min_heapify(MinHeap* min_heap, unsigned int idx) {
-    unsigned int smallest = idx;
-    unsigned int left = 2 * idx + 1;
-    unsigned int right = 2 * idx + 2;
+void min_heapify(MinHeap* min_heap, size_t idx) {
+    size_t smallest = idx;
+    size_t left = 2 * idx + 1;
+    size_t right = 2 * idx + 2;
 
     if (left < min_heap->size && min_heap->array[left]->frequency < min_heap->array[smallest]->frequency)
         smallest = left;
@@ -78,7 +82,7 @@ int is_heap_size_one(MinHeap* min_heap) {
 }
 
 MinHeapNode* extract_min(MinHeap* min_heap) {
-    if (is_heap_size_one(min_heap) && min_heap->size == 0) return NULL; // Check if actually empty
+    if (min_heap->size == 0) return NULL;
 
     MinHeapNode* temp = min_heap->array[0];
     min_heap->array[0] = min_heap->array[min_heap->size - 1];
@@ -89,26 +93,24 @@ MinHeapNode* extract_min(MinHeap* min_heap) {
     return temp;
 }
 
-
-void insert_min_heap(MinHeap* min_heap, HuffmanNode* h_node) {
+// Wraps h_node in heap entry, reusing entry when given one; returns 0 on failure
+int insert_min_heap(MinHeap* min_heap, HuffmanNode* h_node, MinHeapNode* entry, Arena* arena) {
     if (min_heap->size == min_heap->capacity) {
         // This case should ideally not happen if capacity is set correctly (e.g., MAX_TREE_NODES)
         // Or, implement dynamic resizing if needed.
         handle_error("Min-heap is full. Cannot insert.");
-        return;
+        return 0;
     }
-    
-    MinHeapNode* min_heap_node = (MinHeapNode*)malloc(sizeof(MinHeapNode));
-    if(!min_heap_node){
-        handle_memory_error();
-        return;
+
+    MinHeapNode* min_heap_node = entry ? entry : arena_alloc(arena, sizeof(MinHeapNode));
+    if (!min_heap_node) {
+        return 0;
     }
     min_heap_node->h_node = h_node;
     min_heap_node->frequency = h_node->frequency;
 
-
     ++min_heap->size;
-    int i = min_heap->size - 1;
+    size_t i = min_heap->size - 1;
     min_heap->array[i] = min_heap_node; // Insert new node at the end
 
     // Fix the min heap property if it is violated
@@ -116,79 +118,58 @@ void insert_min_heap(MinHeap* min_heap, HuffmanNode* h_node) {
         swap_min_heap_nodes(&min_heap->array[i], &min_heap->array[(i - 1) / 2]);
         i = (i - 1) / 2;
     }
+    return 1;
 }
 
-MinHeap* build_and_create_min_heap(const char* data, size_t size, unsigned* frequencies) {
+void count_frequencies(const char* data, size_t size, uint64_t* frequencies) {
+    STATS_BEGIN(mark);
     for (int i = 0; i < 256; ++i) frequencies[i] = 0;
-    for (size_t i = 0; i < size; ++i) frequencies[(unsigned char)data[i]]++;
+    cpu_kernels()->byte_histogram((const unsigned char*)data, size, frequencies);
+    STATS_END(mark, STATS_HISTOGRAM, size);
+}
 
-    MinHeap* min_heap = create_min_heap(MAX_TREE_NODES); // Max 256 distinct characters
+// Heap of the characters with nonzero frequency, inserted in character order
+static MinHeap* create_frequency_heap(const uint64_t* frequencies, Arena* arena) {
+    MinHeap* min_heap = create_min_heap(MAX_TREE_NODES, arena); // Max 256 distinct characters
     if (!min_heap) return NULL;
 
     for (int i = 0; i < 256; ++i) {
         if (frequencies[i] > 0) {
-            HuffmanNode* h_node = new_huffman_node((char)i, frequencies[i]);
-            if(!h_node){
-                // new_huffman_node calls handle_memory_error
-                // Need to free min_heap and its array if h_node creation fails mid-way
-                for(unsigned j=0; j < min_heap->size; ++j) {
-                    free(min_heap->array[j]->h_node); // Free HuffmanNode
-                    free(min_heap->array[j]);      // Free MinHeapNode
-                }
-                free(min_heap->array);
-                free(min_heap);
+            HuffmanNode* h_node = new_huffman_node((char)i, frequencies[i], arena);
+            if (!h_node || !insert_min_heap(min_heap, h_node, NULL, arena)) {
                 return NULL;
             }
-            insert_min_heap(min_heap, h_node);
         }
     }
     return min_heap;
 }
 
-HuffmanNode* build_huffman_tree(MinHeap* min_heap) {
-    HuffmanNode *left, *right, *top;
-
+HuffmanNode* build_huffman_tree(MinHeap* min_heap, Arena* arena) {
     // Iterate while size of heap doesn't become 1
     while (!is_heap_size_one(min_heap)) {
         // Extract the two minimum freq items from min heap
         MinHeapNode* left_min_node = extract_min(min_heap);
         MinHeapNode* right_min_node = extract_min(min_heap);
-
-        if(!left_min_node || !right_min_node){
-             // Should not happen if heap has more than one item
-             handle_error("Error extracting from min-heap during tree build.");
-             // Free extracted nodes if any
-             if(left_min_node) { free(left_min_node->h_node); free(left_min_node); }
-             if(right_min_node) { free(right_min_node->h_node); free(right_min_node); }
-             // Free remaining nodes in heap (complex cleanup, or rely on program exit for now)
-             return NULL;
+        if (!left_min_node || !right_min_node) {
+            handle_error("Error extracting from min-heap during tree build.");
+            return NULL;
         }
-        
-        left = left_min_node->h_node;
-        right = right_min_node->h_node;
-
 
         // Create a new internal node with frequency equal to the
         // sum of the two nodes' frequencies. Make the two extracted
         // node as left and right children of this new node.
         // '$' is a special value for internal nodes, not used for character data.
-        top = new_huffman_node('$', left->frequency + right->frequency);
-        if(!top){
-            // new_huffman_node calls handle_memory_error
-            // Free the extracted nodes as they are no longer in the heap
-            free(left_min_node->h_node); free(left_min_node);
-            free(right_min_node->h_node); free(right_min_node);
+        HuffmanNode* top = new_huffman_node('$', left_min_node->frequency + right_min_node->frequency, arena);
+        if (!top) {
             return NULL;
         }
+        top->left = left_min_node->h_node;
+        top->right = right_min_node->h_node;
 
-        top->left = left;
-        top->right = right;
-
-        insert_min_heap(min_heap, top);
-        
-        // Free the MinHeapNode wrappers, HuffmanNodes are now part of the tree
-        free(left_min_node);
-        free(right_min_node);
+        // The left entry is free again and carries the new node back in
+        if (!insert_min_heap(min_heap, top, left_min_node, arena)) {
+            return NULL;
+        }
     }
 
     // The remaining node is the root node and the tree is complete.
@@ -197,8 +178,21 @@ HuffmanNode* build_huffman_tree(MinHeap* min_heap) {
         handle_error("Min-heap became empty unexpectedly.");
         return NULL;
     }
-    HuffmanNode* root = root_min_node->h_node;
-    free(root_min_node); // Free the MinHeapNode wrapper
+    return root_min_node->h_node;
+}
+
+HuffmanNode* build_huffman_tree_from_frequencies(const uint64_t* frequencies, Arena* arena) {
+    STATS_BEGIN(mark);
+    MinHeap* min_heap = create_frequency_heap(frequencies, arena);
+    if (!min_heap) {
+        return NULL;
+    }
+
+    HuffmanNode* root = NULL;
+    if (min_heap->size > 0) {
+        root = build_huffman_tree(min_heap, arena); // min_heap is consumed
+    }
+    STATS_END(mark, STATS_TREE, 0);
     return root;
 }
 
@@ -206,137 +200,149 @@ HuffmanNode* build_huffman_tree(MinHeap* min_heap) {
 // --- Huffman Code Generation ---
 #define MAX_CODE_LENGTH 256 // Max depth of Huffman tree for 256 chars
 
-void generate_codes_recursive(HuffmanNode* root, int arr[], int top, HuffmanCode** codes_head) {
+// Returns 0 when a code could not be allocated
+static int generate_codes_recursive(HuffmanNode* root, int arr[], int top, HuffmanCode** codes_head,
+                                    Arena* arena) {
     // Assign 0 to left edge and recur
     if (root->left) {
         arr[top] = 0;
-        generate_codes_recursive(root->left, arr, top + 1, codes_head);
+        if (!generate_codes_recursive(root->left, arr, top + 1, codes_head, arena)) {
+            return 0;
+        }
     }
 
     // Assign 1 to right edge and recur
     if (root->right) {
         arr[top] = 1;
-        generate_codes_recursive(root->right, arr, top + 1, codes_head);
+        if (!generate_codes_recursive(root->right, arr, top + 1, codes_head, arena)) {
+            return 0;
+        }
     }
 
     // If this is a leaf node, then it contains one of the input characters,
     // print the character and its code from arr[]
     if (!(root->left) && !(root->right)) { // is_leaf(root)
-        HuffmanCode* new_code_entry = (HuffmanCode*)malloc(sizeof(HuffmanCode));
-        if(!new_code_entry){
-            handle_memory_error();
-            return; // Cannot add this code, potential memory leak of previously added codes if not handled
+        HuffmanCode* new_code_entry = arena_alloc(arena, sizeof(HuffmanCode));
+        char* code = arena_alloc(arena, top + 1);
+        if (!new_code_entry || !code) {
+            return 0;
         }
         new_code_entry->character = root->character;
-        new_code_entry->code = (char*)malloc(top + 1);
-        if(!new_code_entry->code){
-            handle_memory_error();
-            free(new_code_entry);
-            return;
-        }
+        new_code_entry->code = code;
         for (int i = 0; i < top; ++i)
-            new_code_entry->code[i] = arr[i] + '0'; // Convert int 0/1 to char '0'/'1'
-        new_code_entry->code[top] = '\0';
-        
+            code[i] = arr[i] + '0'; // Convert int 0/1 to char '0'/'1'
+        code[top] = '\0';
+
         // Add to linked list of codes
         new_code_entry->next = *codes_head;
         *codes_head = new_code_entry;
     }
+    return 1;
 }
 
-HuffmanCode* get_huffman_codes(HuffmanNode* root) {
+HuffmanCode* get_huffman_codes(HuffmanNode* root, Arena* arena) {
+    STATS_BEGIN(mark);
     int arr[MAX_CODE_LENGTH];
     HuffmanCode* codes_head = NULL;
-    generate_codes_recursive(root, arr, 0, &codes_head);
+    if (!generate_codes_recursive(root, arr, 0, &codes_head, arena)) {
+        codes_head = NULL;
+    }
+    STATS_END(mark, STATS_CODES, 0);
     return codes_head;
 }
 
-void free_huffman_tree(HuffmanNode* root) {
-    if (root == NULL) return;
-    free_huffman_tree(root->left);
-    free_huffman_tree(root->right);
-    free(root);
-}
+// --- Serialization/Deserialization of Huffman Tree/Frequencies ---
+// The block header holds what decompression needs to rebuild the tree: the
+// input length, then each byte that occurs followed by its frequency. Counts
+// are varints, so the layout is the same on every host.
+#define BLOCK_HEADER_MAX (2 * HUFFMAN_MAX_VARINT_LEN + 256 * (1 + HUFFMAN_MAX_VARINT_LEN))
+
+static size_t put_block_header(unsigned char* header, size_t input_len, const uint64_t* frequencies) {
+    size_t symbol_count = 0;
+    for (int i = 0; i < 256; ++i) {
+        symbol_count += frequencies[i] > 0;
+    }
 
-void free_huffman_codes(HuffmanCode* codes_head) {
-    HuffmanCode* current = codes_head;
-    while (current != NULL) {
-        HuffmanCode* next = current->next;
-        free(current->code);
-        free(current);
-        current = next;
+    size_t len = put_varint(header, input_len);
+    len += put_varint(header + len, symbol_count);
+    for (int i = 0; i < 256; ++i) {
+        if (frequencies[i] > 0) {
+            header[len++] = (unsigned char)i;
+            len += put_varint(header + len, frequencies[i]);
+        }
     }
+    return len;
 }
 
+// Reads a header written by put_block_header and returns its length, or 0
+// when it is corrupt
+static size_t get_block_header(const unsigned char* input, size_t input_len,
+                               size_t* original_len, uint64_t* frequencies) {
+    uint64_t declared_len, symbol_count;
+    size_t len = get_varint(input, input_len, &declared_len);
+    size_t field_len = len ? get_varint(input + len, input_len - len, &symbol_count) : 0;
+    if (!field_len || symbol_count > 256 || declared_len >= SIZE_MAX) {
+        return 0;
+    }
+    len += field_len;
+
+    memset(frequencies, 0, 256 * sizeof(uint64_t));
+    uint64_t total = 0;
+    int previous = -1;
+    for (uint64_t i = 0; i < symbol_count; ++i) {
+        // Each byte is listed once, in increasing order
+        if (len >= input_len || input[len] <= previous) {
+            return 0;
+        }
+        int symbol = input[len++];
+        field_len = get_varint(input + len, input_len - len, &frequencies[symbol]);
+        if (!field_len || frequencies[symbol] == 0 || frequencies[symbol] > UINT64_MAX - total) {
+            return 0;
+        }
+        total += frequencies[symbol];
+        len += field_len;
+        previous = symbol;
+    }
 
-// --- Serialization/Deserialization of Huffman Tree/Frequencies ---
-// For simplicity, we will serialize the frequencies.
-// Format: [char_1][freq_1_byte1]...[freq_1_byte4][char_2]...
-// Or even simpler: list of (char, freq) pairs until a sentinel.
-// Or fixed size 256 frequencies.
+    // The frequencies count every byte of the input
+    if (total != declared_len) {
+        return 0;
+    }
+    *original_len = (size_t)declared_len;
+    return len;
+}
 
 // --- Main Compression/Decompression Functions ---
 
-char* huffman_compress(const char* input, size_t input_len, size_t* output_len) {
+// The tree and codes live in arena; the caller rewinds it
+static char* compress_block(const char* input, size_t input_len, size_t* output_len, Arena* arena) {
     if (!input || input_len == 0) {
         handle_error("Invalid input for Huffman compression");
         *output_len = 0;
         return NULL;
     }
 
-    unsigned frequencies[256];
-    MinHeap* min_heap = build_and_create_min_heap(input, input_len, frequencies);
-    if (!min_heap) {
-        // Error handled in build_and_create_min_heap
-        *output_len = 0;
-        return NULL;
-    }
-
-    // Handle case of single unique character or empty effective input after frequency calculation
-    if (min_heap->size == 0) { // No characters with frequency > 0
-        handle_error("Input has no characters with positive frequency for Huffman compression.");
-        // Free MinHeap (it's empty or contains only already freed nodes)
-        free(min_heap->array);
-        free(min_heap);
-        *output_len = 0;
-        return NULL;
-    }
-     if (min_heap->size == 1) {
-        // Special case: input contains only one distinct character
-        // Or only one character type.
-        // The standard Huffman tree building might not work as expected or be optimal.
-        // A simple encoding: [char][original_length_as_bytes]...
-        // Or just store the char and its count.
-        // For now, let's just indicate it's not a typical case for standard Huffman.
-        // Or, proceed and let it form a simple tree.
-        // The current build_huffman_tree extracts the single node as root.
-    }
-
-
-    HuffmanNode* root = build_huffman_tree(min_heap); // min_heap is consumed (emptied and its array possibly modified)
-    // Free the min_heap structure itself and its array (nodes are now in the Huffman tree)
-    free(min_heap->array); // The array itself
-    free(min_heap);       // The MinHeap struct
-
+    uint64_t frequencies[256];
+    count_frequencies(input, input_len, frequencies);
+    HuffmanNode* root = build_huffman_tree_from_frequencies(frequencies, arena);
     if (!root) {
         handle_error("Failed to build Huffman tree.");
         *output_len = 0;
         return NULL;
     }
 
-    HuffmanCode* codes = get_huffman_codes(root);
+    HuffmanCode* codes = get_huffman_codes(root, arena);
     if(!codes){
         handle_error("Failed to generate Huffman codes.");
-        free_huffman_tree(root);
         *output_len = 0;
         return NULL;
     }
 
     // --- Actual bitstream encoding ---
-    // 1. Serialize frequencies (or tree structure) for decompression
-    //    For now, let's assume frequencies are written directly.
-    //    Size of frequency table: 256 * sizeof(unsigned) for character counts.
-    size_t freq_table_size = 256 * sizeof(unsigned);
+    STATS_BEGIN(encode_mark);
+    // 1. Serialize the frequencies for decompression
+    unsigned char header[BLOCK_HEADER_MAX];
+    size_t header_len = put_block_header(header, input_len, frequencies);
     
     // 2. Calculate size of encoded data.
     //    Iterate through input, look up code for each char, sum lengths of codes.
@@ -353,33 +359,26 @@ char* huffman_compress(const char* input, size_t input_len, size_t* output_len)
         if(!current_code_entry){
              // Should not happen if all input characters are in the codes list
             handle_error("Character in input not found in Huffman codes during size calculation.");
-            free_huffman_tree(root);
-            free_huffman_codes(codes);
             *output_len = 0;
             return NULL;
         }
     }
     size_t encoded_data_bytes = (encoded_data_bits + 7) / 8; // Round up to nearest byte
 
-    // 3. Allocate output buffer: freq_table + encoded_data_bytes + potentially other headers
-    *output_len = freq_table_size + encoded_data_bytes + sizeof(size_t); // Add space for original_len
+    // 3. Allocate output buffer: header + encoded_data_bytes
+    *output_len = header_len + encoded_data_bytes;
     char* output = (char*)malloc(*output_len);
     if (!output) {
         handle_memory_error();
-        free_huffman_tree(root);
-        free_huffman_codes(codes);
         *output_len = 0;
         return NULL;
     }
 
-    // 4. Write frequency table to output
+    // 4. Write the header, which also stores the original length (needed for
+    //    decompression since padding bits exist)
     char* ptr = output;
-    memcpy(ptr, frequencies, freq_table_size);
-    ptr += freq_table_size;
-
-    // Store original length (needed for decompression if padding bits exist)
-    memcpy(ptr, &input_len, sizeof(size_t));
-    ptr += sizeof(size_t);
+    memcpy(ptr, header, header_len);
+    ptr += header_len;
 
     // 5. Write encoded bitstream
     unsigned char bit_buffer = 0;
@@ -408,10 +407,7 @@ char* huffman_compress(const char* input, size_t input_len, size_t* output_len)
          if(!current_code_entry){
              // Should not happen if all input characters are in the codes list
             handle_error("Character in input not found in Huffman codes during encoding.");
-            // free output, tree, codes
             free(output);
-            free_huffman_tree(root);
-            free_huffman_codes(codes);
             *output_len = 0;
             return NULL;
         }
@@ -427,42 +423,18 @@ char* huffman_compress(const char* input, size_t input_len, size_t* output_len)
     // The allocated *output_len was an estimate. The actual ptr - output might be slightly different.
     // For now, the initial *output_len calculation should be correct.
     // If we want exact, *output_len = ptr - output;
-
-    // Cleanup
-    free_huffman_tree(root);
-    free_huffman_codes(codes);
-
+    STATS_END(encode_mark, STATS_ENCODE, input_len);
     return output;
 }
 
-char* huffman_decompress(const char* input, size_t input_len, size_t* output_len) {
-    if (!input || input_len == 0) {
-        handle_error("Invalid input for Huffman decompression");
-        *output_len = 0;
-        return NULL;
-    }
-
-    // 1. Read frequency table
-    if (input_len < (256 * sizeof(unsigned) + sizeof(size_t))) {
-        handle_error("Input data too short for Huffman header.");
-        *output_len = 0;
-                return NULL;
-            }
-    unsigned frequencies[256];
-    const char* ptr = input;
-    memcpy(frequencies, ptr, 256 * sizeof(unsigned));
-    ptr += (256 * sizeof(unsigned));
-
-    size_t original_data_len;
-    memcpy(&original_data_len, ptr, sizeof(size_t));
-    ptr += sizeof(size_t);
-    
-    size_t compressed_data_offset = (256 * sizeof(unsigned)) + sizeof(size_t);
-
-
+// Decodes original_data_len bytes from the bitstream at ptr with the tree
+// built from frequencies. The tree lives in arena; the caller rewinds it.
+static char* decode_block(const uint64_t* frequencies, size_t original_data_len,
+                          const unsigned char* ptr, size_t compressed_data_len,
+                          size_t* output_len, Arena* arena) {
     // 2. Rebuild Huffman tree from frequencies
     // Create a min-heap with capacity equal to the number of unique characters.
-    unsigned unique_chars_count = 0;
+    size_t unique_chars_count = 0;
     for(int i=0; i<256; ++i) if(frequencies[i] > 0) unique_chars_count++;
     
     if (unique_chars_count == 0) {
@@ -484,39 +456,19 @@ char* huffman_decompress(const char* input, size_t input_len, size_t* output_len
     }
 
 
-    MinHeap* min_heap = create_min_heap(unique_chars_count > 0 ? unique_chars_count : 1); // ensure capacity >=1
-    if(!min_heap){
+    // Same frequencies, same insertion order: the tree the compressor built
+    HuffmanNode* root = build_huffman_tree_from_frequencies(frequencies, arena);
+
+    if (!root) {
+        handle_error("Failed to rebuild Huffman tree during decompression.");
         *output_len = 0;
         return NULL;
     }
 
-    for (int i = 0; i < 256; ++i) {
-        if (frequencies[i] > 0) {
-            HuffmanNode* h_node = new_huffman_node((char)i, frequencies[i]);
-            if(!h_node){
-                 for(unsigned j=0; j < min_heap->size; ++j) {
-                    free(min_heap->array[j]->h_node);
-                    free(min_heap->array[j]);
-                }
-                free(min_heap->array);
-                free(min_heap);
-                *output_len = 0;
-                return NULL;
-            }
-            insert_min_heap(min_heap, h_node);
-        }
-    }
-    
-    // Handle single unique character case for decompression
-    // If unique_chars_count is 1, build_huffman_tree will return that single node.
-    // Decompression loop needs to handle this (always taking the same path, or just repeating the char).
-
-    HuffmanNode* root = build_huffman_tree(min_heap); // min_heap is consumed
-    free(min_heap->array);
-    free(min_heap);
-
-    if (!root) {
-        handle_error("Failed to rebuild Huffman tree during decompression.");
+    // With two or more distinct bytes every byte takes at least one bit,
+    // so a length the payload cannot hold is refused before allocating it
+    if ((root->left || root->right) && original_data_len / 8 > compressed_data_len) {
+        handle_error("Mismatch between expected and actual decompressed data length.");
         *output_len = 0;
         return NULL;
     }
@@ -526,15 +478,23 @@ char* huffman_decompress(const char* input, size_t input_len, size_t* output_len
     char* decompressed_output = (char*)malloc(original_data_len + 1);
     if (!decompressed_output) {
         handle_memory_error();
-        free_huffman_tree(root);
         *output_len = 0;
         return NULL;
     }
 
+    // A single distinct character has an empty code: the tree is one leaf
+    STATS_BEGIN(decode_mark);
+    if (!root->left && !root->right) {
+        memset(decompressed_output, root->character, original_data_len);
+        STATS_END(decode_mark, STATS_DECODE, original_data_len);
+        decompressed_output[original_data_len] = '\0';
+        *output_len = original_data_len;
+        return decompressed_output;
+    }
+
     // 4. Decode bitstream
     HuffmanNode* current_node = root;
     size_t decompressed_count = 0;
-    size_t compressed_data_len = input_len - compressed_data_offset;
 
     for (size_t i = 0; i < compressed_data_len && decompressed_count < original_data_len; ++i) {
         unsigned char byte = ptr[i];
@@ -548,7 +508,6 @@ char* huffman_decompress(const char* input, size_t input_len, size_t* output_len
             if (!current_node) {
                 // This indicates a corrupted stream or error in tree traversal
                 handle_error("Error during Huffman decompression: Invalid path in tree.");
-                free_huffman_tree(root);
                 free(decompressed_output);
                 *output_len = 0;
                 return NULL;
@@ -566,7 +525,6 @@ char* huffman_decompress(const char* input, size_t input_len, size_t* output_len
         handle_error("Mismatch between expected and actual decompressed data length.");
         // Depending on strictness, might still return partially decompressed data or fail.
         // For now, let's consider it an error.
-        free_huffman_tree(root);
         free(decompressed_output);
         *output_len = 0;
         return NULL;
@@ -575,10 +533,382 @@ char* huffman_decompress(const char* input, size_t input_len, size_t* output_len
 
     decompressed_output[decompressed_count] = '\0';
     *output_len = decompressed_count;
+    STATS_END(decode_mark, STATS_DECODE, decompressed_count);
+    return decompressed_output;
+}
+
+static char* decompress_block(const char* input, size_t input_len, size_t* output_len, Arena* arena) {
+    if (!input || input_len == 0) {
+        handle_error("Invalid input for Huffman decompression");
+        *output_len = 0;
+        return NULL;
+    }
 
-    // Cleanup
-    free_huffman_tree(root);
+    // 1. Read the header
+    uint64_t frequencies[256];
+    size_t original_data_len;
+    size_t header_len = get_block_header((const unsigned char*)input, input_len,
+                                         &original_data_len, frequencies);
+    if (header_len == 0) {
+        handle_error("Corrupt Huffman header.");
+        *output_len = 0;
+        return NULL;
+    }
+    return decode_block(frequencies, original_data_len, (const unsigned char*)input + header_len,
+                        input_len - header_len, output_len, arena);
+}
 
-    return decompressed_output;
+static char* decompress_legacy_block(const char* input, size_t input_len, size_t* output_len, Arena* arena) {
+    if (!input || input_len == 0) {
+        handle_error("Invalid input for Huffman decompression");
+        *output_len = 0;
+        return NULL;
+    }
+
+    // 1. Read frequency table
+    unsigned legacy_frequencies[256];
+    size_t original_data_len;
+    size_t header_len = sizeof(legacy_frequencies) + sizeof(size_t);
+    if (input_len < header_len) {
+        handle_error("Input data too short for Huffman header.");
+        *output_len = 0;
+        return NULL;
+    }
+    memcpy(legacy_frequencies, input, sizeof(legacy_frequencies));
+    memcpy(&original_data_len, input + sizeof(legacy_frequencies), sizeof(size_t));
+
+    // The frequencies count every byte of the input, as in get_block_header;
+    // the length is a raw host word, so anything else is not this format
+    uint64_t frequencies[256];
+    uint64_t total = 0;
+    for (int i = 0; i < 256; ++i) {
+        frequencies[i] = legacy_frequencies[i];
+        total += frequencies[i];
+    }
+    if (total != original_data_len) {
+        handle_error("Corrupt Huffman header.");
+        *output_len = 0;
+        return NULL;
+    }
+    return decode_block(frequencies, original_data_len, (const unsigned char*)input + header_len,
+                        input_len - header_len, output_len, arena);
+}
+
+char* huffman_compress(const char* input, size_t input_len, size_t* output_len) {
+    Arena* arena = thread_arena();
+    if (!arena) {
+        *output_len = 0;
+        return NULL;
+    }
+    ArenaMark mark = arena_mark(arena);
+    char* output = compress_block(input, input_len, output_len, arena);
+    arena_rewind(arena, mark);
+    return output;
+}
+
+char* huffman_decompress(const char* input, size_t input_len, size_t* output_len) {
+    Arena* arena = thread_arena();
+    if (!arena) {
+        *output_len = 0;
+        return NULL;
+    }
+    ArenaMark mark = arena_mark(arena);
+    char* output = decompress_block(input, input_len, output_len, arena);
+    arena_rewind(arena, mark);
+    return output;
+}
+
+char* huffman_decompress_legacy(const char* input, size_t input_len, size_t* output_len) {
+    Arena* arena = thread_arena();
+    if (!arena) {
+        *output_len = 0;
+        return NULL;
+    }
+    ArenaMark mark = arena_mark(arena);
+    char* output = decompress_legacy_block(input, input_len, output_len, arena);
+    arena_rewind(arena, mark);
+    return output;
+}
+
+/* Compression functions using Huffman coding */ 
+
+// --- Framed Streaming ---
+
+size_t put_varint(unsigned char* out, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (unsigned char)value;
+    return len;
+}
+
+size_t get_varint(const unsigned char* in, size_t len, uint64_t* value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < len && i < HUFFMAN_MAX_VARINT_LEN; ++i) {
+        uint64_t bits = in[i] & 0x7f;
+        // The tenth byte holds only the top bit of a 64-bit value
+        if (i == HUFFMAN_MAX_VARINT_LEN - 1 && in[i] > 1) {
+            return 0;
+        }
+        result |= bits << (7 * i);
+        if (!(in[i] & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+size_t get_frame_length(const unsigned char* header) {
+    size_t len = 0;
+    for (int i = 0; i < 4; ++i) {
+        len |= (size_t)header[i] << (8 * i);
+    }
+    return len;
+}
+
+int huffman_compress_stream(FILE* input, FILE* output, HuffmanModel model, Workspace* workspace) {
+    // The next block is read and earlier frames written while this one is compressed
+    AsyncReader* reader = create_async_reader(input, HUFFMAN_BLOCK_SIZE, workspace);
+    OutputBuffer* out = reader ? create_async_output_buffer(output, OUTPUT_BUFFER_SIZE, workspace) : NULL;
+    if (!out) {
+        free_async_reader(reader);
+        return 0;
+    }
+
+    const char* magic = model == HUFFMAN_ORDER1 ? HUFFMAN_CONTEXT_FRAME_MAGIC : HUFFMAN_FRAME_MAGIC;
+    int ok = output_buffer_write(out, magic, HUFFMAN_FRAME_MAGIC_LEN);
+    char* block;
+    size_t block_len;
+    int status = 0;
+    while (ok && (status = async_reader_next(reader, &block, &block_len)) > 0) {
+        size_t frame_len;
+        char* frame = model == HUFFMAN_ORDER1 ? context_compress(block, block_len, &frame_len)
+                                              : huffman_compress(block, block_len, &frame_len);
+        if (!frame) {
+            ok = 0;
+            break;
+        }
+
+        unsigned char header[HUFFMAN_MAX_VARINT_LEN];
+        size_t header_len = put_varint(header, frame_len);
+        ok = output_buffer_write(out, (const char*)header, header_len) &&
+             output_buffer_write(out, frame, frame_len);
+        free(frame);
+    }
+    if (status < 0) {
+        handle_error("Failed to read file");
+        ok = 0;
+    }
+
+    // A zero length marks the end of the stream
+    if (ok) {
+        ok = output_buffer_write(out, "", 1) && flush_output_buffer(out);
+    }
+    free_output_buffer(out);
+    free_async_reader(reader);
+    return ok;
+}
+
+// Reads the length that starts each frame: a varint, or 4 little-endian
+// bytes in FPH1 streams. Returns 0 when the stream ends early.
+static int read_frame_length(FILE* input, int version, size_t* frame_len, size_t* header_len) {
+    unsigned char header[HUFFMAN_MAX_VARINT_LEN];
+    size_t len = 0;
+    if (version == 1) {
+        len = fread(header, 1, 4, input);
+        *header_len = len;
+        if (len != 4) {
+            return 0;
+        }
+        *frame_len = get_frame_length(header);
+        return 1;
+    }
+
+    int c;
+    do {
+        if ((c = getc(input)) == EOF) {
+            *header_len = len;
+            return 0;
+        }
+        header[len++] = (unsigned char)c;
+    } while ((c & 0x80) && len < HUFFMAN_MAX_VARINT_LEN);
+    *header_len = len;
+
+    uint64_t value;
+    if (!get_varint(header, len, &value) || value > HUFFMAN_MAX_FRAME_SIZE) {
+        *frame_len = HUFFMAN_MAX_FRAME_SIZE + 1; // Reported as corrupt
+    } else {
+        *frame_len = (size_t)value;
+    }
+    return 1;
+}
+
+// version is 1 for FPH1, 2 for FPH2, or 3 for FPC1: FPH2 framing around
+// context-coded blocks
+static int decompress_frames(FILE* input, FILE* output, Workspace* workspace, int version) {
+    char* frame;
+    if (workspace) {
+        frame = reserve_scratch(&workspace->frame, &workspace->frame_capacity, HUFFMAN_MAX_FRAME_SIZE);
+    } else {
+        frame = malloc(HUFFMAN_MAX_FRAME_SIZE);
+        if (!frame) {
+            handle_memory_error();
+        }
+    }
+
+    // Standalone, decoded blocks are written on a background thread while the next frame is decoded
+    OutputBuffer* out = frame ? create_async_output_buffer(output, OUTPUT_BUFFER_SIZE, workspace) : NULL;
+    if (!out) {
+        if (!workspace) {
+            free(frame);
+        }
+        return 0;
+    }
+
+    int ok = 1;
+    for (;;) {
+        size_t frame_len, header_len;
+        STATS_BEGIN(read_mark);
+        if (!read_frame_length(input, version, &frame_len, &header_len)) {
+            handle_error("Truncated compressed stream.");
+            ok = 0;
+            break;
+        }
+        if (frame_len == 0) {
+            break;
+        }
+        if (frame_len > HUFFMAN_MAX_FRAME_SIZE) {
+            handle_error("Corrupt frame length in compressed stream.");
+            ok = 0;
+            break;
+        }
+        if (fread(frame, 1, frame_len, input) != frame_len) {
+            handle_error("Truncated compressed stream.");
+            ok = 0;
+            break;
+        }
+        STATS_END(read_mark, STATS_READ, header_len + frame_len);
+
+        size_t block_len;
+        char* block = version == 1 ? huffman_decompress_legacy(frame, frame_len, &block_len)
+                      : version == 3 ? context_decompress(frame, frame_len, &block_len)
+                                     : huffman_decompress(frame, frame_len, &block_len);
+        if (!block) {
+            ok = 0;
+            break;
+        }
+        ok = output_buffer_write(out, block, block_len);
+        free(block);
+        if (!ok) {
+            break;
+        }
+    }
+
+    ok = flush_output_buffer(out) && ok;
+    free_output_buffer(out);
+    if (!workspace) {
+        free(frame);
+    }
+    return ok;
+}
+
+// Reads the rest of a stream that started with the given prefix bytes,
+// failing once it grows past limit (0 for no limit)
+static char* read_remaining(FILE* input, const unsigned char* prefix, size_t prefix_len,
+                            size_t limit, size_t* size) {
+    size_t capacity = HUFFMAN_BLOCK_SIZE;
+    char* buffer = malloc(capacity);
+    if (!buffer) {
+        handle_memory_error();
+        return NULL;
+    }
+    memcpy(buffer, prefix, prefix_len);
+    size_t used = prefix_len;
+
+    for (;;) {
+        STATS_BEGIN(read_mark);
+        size_t bytes_read = fread(buffer + used, 1, capacity - used, input);
+        STATS_END(read_mark, STATS_READ, bytes_read);
+        used += bytes_read;
+        if (used < capacity) {
+            break;
+        }
+        if (limit > 0 && used >= limit) {
+            handle_error("Input in the single-block format does not fit in --max-memory.");
+            free(buffer);
+            return NULL;
+        }
+        char* grown = realloc(buffer, capacity * 2);
+        if (!grown) {
+            handle_memory_error();
+            free(buffer);
+            return NULL;
+        }
+        buffer = grown;
+        capacity *= 2;
+    }
+    if (ferror(input)) {
+        handle_error("Failed to read file");
+        free(buffer);
+        return NULL;
+    }
+
+    *size = used;
+    return buffer;
+}
+
+int huffman_decompress_stream(FILE* input, FILE* output, Workspace* workspace, size_t memory_limit) {
+    unsigned char magic[HUFFMAN_FRAME_MAGIC_LEN];
+    STATS_BEGIN(read_mark);
+    size_t magic_len = fread(magic, 1, HUFFMAN_FRAME_MAGIC_LEN, input);
+    STATS_END(read_mark, STATS_READ, magic_len);
+    if (magic_len == HUFFMAN_FRAME_MAGIC_LEN) {
+        if (memcmp(magic, HUFFMAN_FRAME_MAGIC, HUFFMAN_FRAME_MAGIC_LEN) == 0) {
+            return decompress_frames(input, output, workspace, 2);
+        }
+        if (memcmp(magic, HUFFMAN_CONTEXT_FRAME_MAGIC, HUFFMAN_FRAME_MAGIC_LEN) == 0) {
+            return decompress_frames(input, output, workspace, 3);
+        }
+        if (memcmp(magic, HUFFMAN_FRAME_MAGIC_V1, HUFFMAN_FRAME_MAGIC_LEN) == 0) {
+            return decompress_frames(input, output, workspace, 1);
+        }
+    }
+
+    // Original single-block format: the whole input is one block
+    size_t input_len;
+    char* data = read_remaining(input, magic, magic_len, memory_limit, &input_len);
+    if (!data) {
+        return 0;
+    }
+
+    // The input and the whole decoded output are held at once
+    size_t header_len = 256 * sizeof(unsigned) + sizeof(size_t);
+    if (memory_limit > 0 && input_len >= header_len) {
+        size_t original_len;
+        memcpy(&original_len, data + 256 * sizeof(unsigned), sizeof(size_t));
+        if (original_len > memory_limit || input_len > memory_limit - original_len) {
+            handle_error("Input in the single-block format does not fit in --max-memory.");
+            free(data);
+            return 0;
+        }
+    }
+
+    size_t output_len;
+    char* decompressed = huffman_decompress_legacy(data, input_len, &output_len);
+    free(data);
+    if (!decompressed) {
+        return 0;
+    }
+
+    STATS_BEGIN(write_mark);
+    int ok = fwrite(decompressed, 1, output_len, output) == output_len;
+    STATS_END(write_mark, STATS_WRITE, output_len);
+    if (!ok) {
+        handle_error("Failed to write output");
+    }
+    free(decompressed);
+    return ok;
 }
-/* Compression functions using Huffman coding */ 
\ No newline at end of file
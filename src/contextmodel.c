@@ -0,0 +1,708 @@
+#include "../include/contextmodel.h"
+#include "../include/arena.h"
+#include "../include/compress.h"
+#include "../include/io.h"
+#include "../include/stats.h"
+#include <math.h>
+#include <pthread.h>
+
+#define DECODE_TABLE_SIZE (1 << CONTEXT_MAX_CODE_LENGTH)
+#define PACKED_SIZE 128 // 256 four-bit fields
+#define CONTEXT_HEADER_MAX (HUFFMAN_MAX_VARINT_LEN + 1 + PACKED_SIZE * (1 + CONTEXT_MAX_TABLES))
+
+// Clustering starts from more tables than a block may hold and merges them
+// down to CONTEXT_MAX_TABLES, which groups far better than stopping at that many
+#define CLUSTER_SEEDS 32
+
+typedef struct {
+    uint64_t counts[256];
+    uint64_t total;
+} Histogram;
+
+typedef struct {
+    uint64_t weight;
+    int symbol;
+} Leaf;
+
+static uint64_t load_be64(const unsigned char* p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+static void store_be32(unsigned char* p, uint32_t x) {
+    p[0] = (unsigned char)(x >> 24);
+    p[1] = (unsigned char)(x >> 16);
+    p[2] = (unsigned char)(x >> 8);
+    p[3] = (unsigned char)x;
+}
+
+static void put_nibbles(unsigned char* out, const unsigned char* values) {
+    for (int i = 0; i < PACKED_SIZE; i++) {
+        out[i] = (unsigned char)(values[2 * i] | values[2 * i + 1] << 4);
+    }
+}
+
+static void get_nibbles(const unsigned char* in, unsigned char* values) {
+    for (int i = 0; i < PACKED_SIZE; i++) {
+        values[2 * i] = in[i] & 0x0f;
+        values[2 * i + 1] = in[i] >> 4;
+    }
+}
+
+// Counts each byte under the byte before it
+static void count_contexts(const unsigned char* data, size_t size, Histogram* contexts) {
+    STATS_BEGIN(mark);
+    memset(contexts, 0, 256 * sizeof(Histogram));
+    unsigned previous = 0;
+    for (size_t i = 0; i < size; i++) {
+        contexts[previous].counts[data[i]]++;
+        previous = data[i];
+    }
+    for (int c = 0; c < 256; c++) {
+        for (int s = 0; s < 256; s++) {
+            contexts[c].total += contexts[c].counts[s];
+        }
+    }
+    STATS_END(mark, STATS_HISTOGRAM, size);
+}
+
+static void add_histogram(Histogram* to, const Histogram* from) {
+    for (int s = 0; s < 256; s++) {
+        to->counts[s] += from->counts[s];
+    }
+    to->total += from->total;
+}
+
+// --- Clustering ---
+// Costs are the bits ideal codes would spend, which is close enough to the
+// Huffman codes that are built at the end to compare groupings.
+
+// Most counts in a merge are small, so those come from a table
+#define N_LOG2_N_TABLE_SIZE 4096
+
+static double n_log2_n_table[N_LOG2_N_TABLE_SIZE];
+static pthread_once_t n_log2_n_once = PTHREAD_ONCE_INIT;
+
+static void fill_n_log2_n_table(void) {
+    for (int n = 2; n < N_LOG2_N_TABLE_SIZE; n++) {
+        n_log2_n_table[n] = n * log2(n);
+    }
+}
+
+static double n_log2_n(uint64_t n) {
+    return n < N_LOG2_N_TABLE_SIZE ? n_log2_n_table[n] : (double)n * log2((double)n);
+}
+
+static double entropy_bits(const Histogram* h) {
+    double bits = n_log2_n(h->total);
+    for (int s = 0; s < 256; s++) {
+        bits -= n_log2_n(h->counts[s]);
+    }
+    return bits;
+}
+
+// Bits the two histograms would cost sharing one table, over what they cost apart
+static double merge_cost(const Histogram* a, const Histogram* b, double a_bits, double b_bits) {
+    double bits = n_log2_n(a->total + b->total);
+    for (int s = 0; s < 256; s++) {
+        bits -= n_log2_n(a->counts[s] + b->counts[s]);
+    }
+    return bits - a_bits - b_bits;
+}
+
+// Bits to code each byte with a table built from h. A byte h has not seen
+// is charged as if it had half a count.
+static void table_bits(const Histogram* h, double* bits) {
+    double scale = log2((double)h->total + 128.0);
+    for (int s = 0; s < 256; s++) {
+        bits[s] = scale - log2((double)h->counts[s] + 0.5);
+    }
+}
+
+// Bits a previous byte's followers cost at the given per-byte costs
+static double context_bits(const Histogram* context, const unsigned char* followers,
+                           int follower_count, const double* bits) {
+    double total = 0.0;
+    for (int f = 0; f < follower_count; f++) {
+        total += (double)context->counts[followers[f]] * bits[followers[f]];
+    }
+    return total;
+}
+
+// Drops clusters nothing was assigned to and returns how many are left
+static int compact_clusters(Histogram* clusters, int count, unsigned char* map,
+                            const int* active, int active_count) {
+    int renumber[CLUSTER_SEEDS];
+    int kept = 0;
+    for (int j = 0; j < count; j++) {
+        if (clusters[j].total > 0) {
+            renumber[j] = kept;
+            if (kept != j) {
+                clusters[kept] = clusters[j];
+            }
+            kept++;
+        }
+    }
+    for (int i = 0; i < active_count; i++) {
+        map[active[i]] = (unsigned char)renumber[map[active[i]]];
+    }
+    return kept;
+}
+
+/*
+ * Groups the previous bytes that occur into at most CONTEXT_MAX_TABLES
+ * tables: up to CLUSTER_SEEDS of them are picked as seeds and the rest join
+ * the seed that codes their followers in the fewest bits. The groups are
+ * then merged pairwise, cheapest first, down to CONTEXT_MAX_TABLES and on
+ * while a merge costs fewer bits than the header space it saves. Fills map
+ * with the table of each previous byte and clusters with the summed counts
+ * of each table, and returns the table count, or 0 on error. Scratch space
+ * comes from arena.
+ */
+static int cluster_contexts(const Histogram* contexts, unsigned char* map, Histogram* clusters,
+                            Arena* arena) {
+    int active[256];
+    int active_count = 0;
+    for (int c = 0; c < 256; c++) {
+        if (contexts[c].total > 0) {
+            active[active_count++] = c;
+        }
+    }
+    memset(map, 0, 256);
+    pthread_once(&n_log2_n_once, fill_n_log2_n_table);
+
+    // The bytes that follow each previous byte, so costing skips the rest
+    unsigned char (*followers)[256] = arena_alloc(arena, 256 * 256);
+    int follower_count[256];
+    if (!followers) {
+        return 0;
+    }
+    for (int i = 0; i < active_count; i++) {
+        int c = active[i];
+        follower_count[c] = 0;
+        for (int s = 0; s < 256; s++) {
+            if (contexts[c].counts[s] > 0) {
+                followers[c][follower_count[c]++] = (unsigned char)s;
+            }
+        }
+    }
+
+    // The first seed is the most frequent previous byte. Each next one is the
+    // previous byte the seeds so far serve worst, as long as it would pay
+    // for a table of its own. Every previous byte joins its closest seed.
+    double own_bits[256], closest_bits[256];
+    int seeded[256] = { 0 };
+    int seed = active[0];
+    for (int i = 1; i < active_count; i++) {
+        if (contexts[active[i]].total > contexts[seed].total) {
+            seed = active[i];
+        }
+    }
+    for (int i = 0; i < active_count; i++) {
+        own_bits[active[i]] = entropy_bits(&contexts[active[i]]);
+    }
+    int count = 0;
+    for (;;) {
+        double bits[256];
+        table_bits(&contexts[seed], bits);
+        seeded[seed] = 1;
+
+        int worst = -1;
+        double worst_extra = 8.0 * PACKED_SIZE;
+        for (int i = 0; i < active_count; i++) {
+            int c = active[i];
+            double cost = context_bits(&contexts[c], followers[c], follower_count[c], bits);
+            if (count == 0 || cost < closest_bits[c]) {
+                closest_bits[c] = cost;
+                map[c] = (unsigned char)count;
+            }
+            if (!seeded[c] && closest_bits[c] - own_bits[c] > worst_extra) {
+                worst = c;
+                worst_extra = closest_bits[c] - own_bits[c];
+            }
+        }
+        count++;
+        if (worst < 0 || count == CLUSTER_SEEDS) {
+            break;
+        }
+        seed = worst;
+    }
+
+    memset(clusters, 0, count * sizeof(Histogram));
+    for (int i = 0; i < active_count; i++) {
+        add_histogram(&clusters[map[active[i]]], &contexts[active[i]]);
+    }
+    count = compact_clusters(clusters, count, map, active, active_count);
+
+    // Each table costs its code lengths in the header, and the map is only
+    // written while there are two or more
+    double cost[CLUSTER_SEEDS];
+    double (*delta)[CLUSTER_SEEDS] = arena_alloc(arena, CLUSTER_SEEDS * sizeof(*delta));
+    if (!delta) {
+        return 0;
+    }
+    for (int a = 0; a < count; a++) {
+        cost[a] = entropy_bits(&clusters[a]);
+    }
+    for (int a = 0; a < count; a++) {
+        for (int b = a + 1; b < count; b++) {
+            delta[a][b] = delta[b][a] = merge_cost(&clusters[a], &clusters[b], cost[a], cost[b]);
+        }
+    }
+
+    while (count > 1) {
+        int best_a = 0, best_b = 1;
+        for (int a = 0; a < count; a++) {
+            for (int b = a + 1; b < count; b++) {
+                if (delta[a][b] < delta[best_a][best_b]) {
+                    best_a = a;
+                    best_b = b;
+                }
+            }
+        }
+        double saved_bits = 8.0 * PACKED_SIZE * (count == 2 ? 2 : 1);
+        if (count <= CONTEXT_MAX_TABLES && delta[best_a][best_b] >= saved_bits) {
+            break;
+        }
+
+        // best_b goes into best_a, and the last table takes its place
+        int last = count - 1;
+        add_histogram(&clusters[best_a], &clusters[best_b]);
+        cost[best_a] += cost[best_b] + delta[best_a][best_b];
+        for (int i = 0; i < active_count; i++) {
+            int c = active[i];
+            if (map[c] == best_b) {
+                map[c] = (unsigned char)best_a;
+            } else if (map[c] == last) {
+                map[c] = (unsigned char)best_b;
+            }
+        }
+        if (best_b != last) {
+            clusters[best_b] = clusters[last];
+            cost[best_b] = cost[last];
+        }
+        count--;
+
+        for (int j = 0; j < count; j++) {
+            if (j != best_a) {
+                delta[best_a][j] = delta[j][best_a] =
+                    merge_cost(&clusters[best_a], &clusters[j], cost[best_a], cost[j]);
+            }
+            if (best_b < count && j != best_b && j != best_a) {
+                delta[best_b][j] = delta[j][best_b] =
+                    merge_cost(&clusters[best_b], &clusters[j], cost[best_b], cost[j]);
+            }
+        }
+    }
+    return count;
+}
+
+// --- Codes ---
+
+static int compare_leaves(const void* a, const void* b) {
+    const Leaf* x = a;
+    const Leaf* y = b;
+    if (x->weight != y->weight) {
+        return x->weight < y->weight ? -1 : 1;
+    }
+    return x->symbol - y->symbol;
+}
+
+// Depths of the Huffman tree over n >= 2 leaves sorted by weight, built
+// with one queue of leaves and one of merged nodes. Returns the deepest.
+static int tree_depths(const Leaf* leaves, int n, int* depths) {
+    uint64_t node_weight[255];
+    int leaf_parent[256];
+    int node_parent[255];
+    int next_leaf = 0, next_node = 0;
+    for (int node = 0; node < n - 1; node++) {
+        uint64_t weight = 0;
+        for (int child = 0; child < 2; child++) {
+            if (next_leaf < n && (next_node == node || leaves[next_leaf].weight <= node_weight[next_node])) {
+                weight += leaves[next_leaf].weight;
+                leaf_parent[next_leaf++] = node;
+            } else {
+                weight += node_weight[next_node];
+                node_parent[next_node++] = node;
+            }
+        }
+        node_weight[node] = weight;
+    }
+
+    // The root is the last node, and every parent comes after its children
+    int node_depth[255];
+    node_depth[n - 2] = 0;
+    for (int node = n - 3; node >= 0; node--) {
+        node_depth[node] = node_depth[node_parent[node]] + 1;
+    }
+    int deepest = 0;
+    for (int i = 0; i < n; i++) {
+        depths[i] = node_depth[leaf_parent[i]] + 1;
+        if (depths[i] > deepest) {
+            deepest = depths[i];
+        }
+    }
+    return deepest;
+}
+
+// Huffman code lengths for the bytes of h, at most CONTEXT_MAX_CODE_LENGTH.
+// Too deep a tree is rebuilt from halved counts, which flattens it.
+static void build_code_lengths(const Histogram* h, unsigned char* lengths) {
+    Leaf leaves[256];
+    int n = 0;
+    memset(lengths, 0, 256);
+    for (int s = 0; s < 256; s++) {
+        if (h->counts[s] > 0) {
+            leaves[n].weight = h->counts[s];
+            leaves[n].symbol = s;
+            n++;
+        }
+    }
+    if (n < 2) {
+        return; // A single byte takes no bits at all
+    }
+
+    int depths[256];
+    for (;;) {
+        qsort(leaves, n, sizeof(Leaf), compare_leaves);
+        if (tree_depths(leaves, n, depths) <= CONTEXT_MAX_CODE_LENGTH) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            leaves[i].weight = (leaves[i].weight + 1) / 2;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        lengths[leaves[i].symbol] = (unsigned char)depths[i];
+    }
+}
+
+// Canonical codes: shorter codes first, and in byte order within a length
+static void assign_codes(const unsigned char* lengths, uint16_t* codes) {
+    unsigned length_count[CONTEXT_MAX_CODE_LENGTH + 1] = { 0 };
+    for (int s = 0; s < 256; s++) {
+        length_count[lengths[s]]++;
+    }
+    length_count[0] = 0;
+
+    unsigned next_code[CONTEXT_MAX_CODE_LENGTH + 1];
+    unsigned code = 0;
+    for (int len = 1; len <= CONTEXT_MAX_CODE_LENGTH; len++) {
+        code = (code + length_count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+    for (int s = 0; s < 256; s++) {
+        codes[s] = lengths[s] ? (uint16_t)next_code[lengths[s]]++ : 0;
+    }
+}
+
+// Checks the 4-bit length fields of a table read from a header and fills its
+// decode entries, the byte in the low bits and the code length above it.
+// Returns 0 unless the lengths form a complete prefix code.
+static int build_decode_table(const unsigned char* fields, uint16_t* table) {
+    unsigned char lengths[256];
+    int used = 0;
+    int sole = -1;
+    uint32_t space = 0;
+    for (int s = 0; s < 256; s++) {
+        lengths[s] = 0;
+        if (fields[s] == 0) {
+            continue;
+        }
+        used++;
+        if (fields[s] == 1) {
+            sole = s;
+        } else if (fields[s] - 1 > CONTEXT_MAX_CODE_LENGTH) {
+            return 0;
+        } else {
+            lengths[s] = fields[s] - 1;
+            space += (uint32_t)1 << (CONTEXT_MAX_CODE_LENGTH - lengths[s]);
+        }
+    }
+
+    if (sole >= 0) {
+        if (used != 1) {
+            return 0;
+        }
+        for (int i = 0; i < DECODE_TABLE_SIZE; i++) {
+            table[i] = (uint16_t)sole;
+        }
+        return 1;
+    }
+    if (space != DECODE_TABLE_SIZE) {
+        return 0;
+    }
+
+    uint16_t codes[256];
+    assign_codes(lengths, codes);
+    for (int s = 0; s < 256; s++) {
+        if (lengths[s]) {
+            int shift = CONTEXT_MAX_CODE_LENGTH - lengths[s];
+            uint16_t entry = (uint16_t)(s | lengths[s] << 8);
+            uint16_t* first = table + ((size_t)codes[s] << shift);
+            for (int i = 0; i < 1 << shift; i++) {
+                first[i] = entry;
+            }
+        }
+    }
+    return 1;
+}
+
+// --- Blocks ---
+
+// Histograms live in arena; the caller rewinds it
+static char* compress_block(const char* input, size_t input_len, size_t* output_len, Arena* arena) {
+    *output_len = 0;
+    if (!input || input_len == 0) {
+        handle_error("Invalid input for context compression");
+        return NULL;
+    }
+    if (input_len > HUFFMAN_BLOCK_SIZE) {
+        handle_error("Block too large for context compression");
+        return NULL;
+    }
+
+    const unsigned char* data = (const unsigned char*)input;
+    Histogram* contexts = arena_alloc(arena, 256 * sizeof(Histogram));
+    Histogram* clusters = arena_alloc(arena, CLUSTER_SEEDS * sizeof(Histogram));
+    if (!contexts || !clusters) {
+        return NULL;
+    }
+    count_contexts(data, input_len, contexts);
+
+    STATS_BEGIN(tree_mark);
+    unsigned char map[256];
+    int table_count = cluster_contexts(contexts, map, clusters, arena);
+    if (table_count == 0) {
+        return NULL;
+    }
+    unsigned char lengths[CONTEXT_MAX_TABLES][256];
+    for (int t = 0; t < table_count; t++) {
+        build_code_lengths(&clusters[t], lengths[t]);
+    }
+    STATS_END(tree_mark, STATS_TREE, 0);
+
+    // Each entry is a code with its length above it
+    STATS_BEGIN(codes_mark);
+    uint32_t entries[CONTEXT_MAX_TABLES][256];
+    uint64_t total_bits = 0;
+    for (int t = 0; t < table_count; t++) {
+        uint16_t codes[256];
+        assign_codes(lengths[t], codes);
+        for (int s = 0; s < 256; s++) {
+            entries[t][s] = codes[s] | (uint32_t)lengths[t][s] << 16;
+            total_bits += clusters[t].counts[s] * lengths[t][s];
+        }
+    }
+    STATS_END(codes_mark, STATS_CODES, 0);
+
+    STATS_BEGIN(encode_mark);
+    unsigned char header[CONTEXT_HEADER_MAX];
+    size_t header_len = put_varint(header, input_len);
+    header[header_len++] = (unsigned char)table_count;
+    if (table_count > 1) {
+        put_nibbles(header + header_len, map);
+        header_len += PACKED_SIZE;
+    }
+    for (int t = 0; t < table_count; t++) {
+        unsigned char fields[256];
+        for (int s = 0; s < 256; s++) {
+            fields[s] = clusters[t].counts[s] ? lengths[t][s] + 1 : 0;
+        }
+        put_nibbles(header + header_len, fields);
+        header_len += PACKED_SIZE;
+    }
+
+    uint64_t payload_len = (total_bits + 7) / 8;
+    if (payload_len > SIZE_MAX - header_len) {
+        handle_memory_error();
+        return NULL;
+    }
+    char* output = malloc(header_len + payload_len);
+    if (!output) {
+        handle_memory_error();
+        return NULL;
+    }
+    memcpy(output, header, header_len);
+
+    const uint32_t* table_of[256];
+    for (int c = 0; c < 256; c++) {
+        table_of[c] = entries[map[c]];
+    }
+
+    // Bits collect below the top of acc and leave 32 at a time
+    unsigned char* out = (unsigned char*)output + header_len;
+    uint64_t acc = 0;
+    unsigned count = 0;
+    const uint32_t* table = table_of[0];
+    for (size_t i = 0; i < input_len; i++) {
+        uint32_t entry = table[data[i]];
+        unsigned len = entry >> 16;
+        acc = acc << len | (entry & 0xffff);
+        count += len;
+        table = table_of[data[i]];
+        if (count >= 32) {
+            count -= 32;
+            store_be32(out, (uint32_t)(acc >> count));
+            out += 4;
+        }
+    }
+    while (count >= 8) {
+        count -= 8;
+        *out++ = (unsigned char)(acc >> count);
+    }
+    if (count > 0) {
+        *out++ = (unsigned char)(acc << (8 - count));
+    }
+    STATS_END(encode_mark, STATS_ENCODE, input_len);
+
+    *output_len = header_len + (size_t)payload_len;
+    return output;
+}
+
+// Decode tables live in arena; the caller rewinds it
+static char* decompress_block(const char* input, size_t input_len, size_t* output_len, Arena* arena) {
+    *output_len = 0;
+    if (!input || input_len == 0) {
+        handle_error("Invalid input for context decompression");
+        return NULL;
+    }
+
+    const unsigned char* in = (const unsigned char*)input;
+    uint64_t declared_len;
+    size_t pos = get_varint(in, input_len, &declared_len);
+    // Every writer cuts its input into blocks of at most HUFFMAN_BLOCK_SIZE
+    if (!pos || declared_len > HUFFMAN_BLOCK_SIZE || pos >= input_len) {
+        handle_error("Corrupt context-coded header.");
+        return NULL;
+    }
+    int table_count = in[pos++];
+    unsigned char map[256] = { 0 };
+    size_t header_rest = PACKED_SIZE * ((size_t)table_count + (table_count > 1));
+    if (table_count < 1 || table_count > CONTEXT_MAX_TABLES || input_len - pos < header_rest) {
+        handle_error("Corrupt context-coded header.");
+        return NULL;
+    }
+    if (table_count > 1) {
+        get_nibbles(in + pos, map);
+        pos += PACKED_SIZE;
+        for (int c = 0; c < 256; c++) {
+            if (map[c] >= table_count) {
+                handle_error("Corrupt context-coded header.");
+                return NULL;
+            }
+        }
+    }
+
+    STATS_BEGIN(codes_mark);
+    uint16_t* tables = arena_alloc(arena, (size_t)table_count * DECODE_TABLE_SIZE * sizeof(uint16_t));
+    if (!tables) {
+        return NULL;
+    }
+    for (int t = 0; t < table_count; t++, pos += PACKED_SIZE) {
+        unsigned char fields[256];
+        get_nibbles(in + pos, fields);
+        if (!build_decode_table(fields, tables + (size_t)t * DECODE_TABLE_SIZE)) {
+            handle_error("Corrupt context-coded header.");
+            return NULL;
+        }
+    }
+    STATS_END(codes_mark, STATS_CODES, 0);
+
+    // Each byte takes at least one bit, unless a table codes a single byte
+    const unsigned char* payload = in + pos;
+    size_t payload_len = input_len - pos;
+    int free_bytes = 0;
+    for (int t = 0; t < table_count; t++) {
+        if ((tables[(size_t)t * DECODE_TABLE_SIZE] >> 8) == 0) {
+            free_bytes = 1;
+        }
+    }
+    if (!free_bytes && declared_len > (uint64_t)payload_len * 8) {
+        handle_error("Corrupt context-coded header.");
+        return NULL;
+    }
+
+    size_t original_len = (size_t)declared_len;
+    char* output = malloc(original_len + 1);
+    if (!output) {
+        handle_memory_error();
+        return NULL;
+    }
+
+    const uint16_t* table_of[256];
+    for (int c = 0; c < 256; c++) {
+        table_of[c] = tables + (size_t)map[c] * DECODE_TABLE_SIZE;
+    }
+
+    // The next bits sit at the top of bits; past the end of the payload the
+    // stream reads as zeros, and overrunning it is caught below
+    STATS_BEGIN(decode_mark);
+    unsigned char* out = (unsigned char*)output;
+    uint64_t bits = 0;
+    unsigned count = 0;
+    size_t next = 0;
+    const uint16_t* table = table_of[0];
+    for (size_t i = 0; i < original_len; i++) {
+        if (count < CONTEXT_MAX_CODE_LENGTH) {
+            if (payload_len >= 8 && next <= payload_len - 8) {
+                // Whole bytes that fit are taken; the rest of the load is
+                // the same bits the next refill brings again
+                bits |= load_be64(payload + next) >> count;
+                next += (63 - count) >> 3;
+                count |= 56;
+            } else {
+                while (count <= 56) {
+                    uint64_t byte = next < payload_len ? payload[next] : 0;
+                    bits |= byte << (56 - count);
+                    next++;
+                    count += 8;
+                }
+            }
+        }
+        uint16_t entry = table[bits >> (64 - CONTEXT_MAX_CODE_LENGTH)];
+        unsigned len = entry >> 8;
+        out[i] = (unsigned char)entry;
+        table = table_of[entry & 0xff];
+        bits <<= len;
+        count -= len;
+    }
+
+    if ((uint64_t)next * 8 - count > (uint64_t)payload_len * 8) {
+        handle_error("Truncated context-coded data.");
+        free(output);
+        return NULL;
+    }
+    STATS_END(decode_mark, STATS_DECODE, original_len);
+
+    output[original_len] = '\0';
+    *output_len = original_len;
+    return output;
+}
+
+char* context_compress(const char* input, size_t input_len, size_t* output_len) {
+    Arena* arena = thread_arena();
+    if (!arena) {
+        *output_len = 0;
+        return NULL;
+    }
+    ArenaMark mark = arena_mark(arena);
+    char* output = compress_block(input, input_len, output_len, arena);
+    arena_rewind(arena, mark);
+    return output;
+}
+
+char* context_decompress(const char* input, size_t input_len, size_t* output_len) {
+    Arena* arena = thread_arena();
+    if (!arena) {
+        *output_len = 0;
+        return NULL;
+    }
+    ArenaMark mark = arena_mark(arena);
+    char* output = decompress_block(input, input_len, output_len, arena);
+    arena_rewind(arena, mark);
+    return output;
+}
@@ -0,0 +1,292 @@
+#include "../include/cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#include <immintrin.h>
+#endif
+
+static const char* const level_names[CPU_LEVEL_COUNT] = { "generic", "sse2", "avx2", "avx512" };
+
+// --- Generic kernels: 8 bytes at a time in ordinary registers ---
+
+static uint64_t load64(const char* p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x); // Byte i of memory in bits 8i .. 8i+7
+#endif
+    return x;
+}
+
+// High bit of every zero byte of x, and no other bits
+static uint64_t zero_bytes(uint64_t x) {
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+    return ~(((x & low7) + low7) | x | low7);
+}
+
+// Moves the high bit of byte i to bit i
+static uint64_t gather_high_bits(uint64_t x) {
+    return ((x >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+// Finishes an XOR one byte at a time
+static void xor_pattern_tail(char* data, size_t len, const char* pattern, size_t period, size_t k) {
+    for (size_t i = 0; i < len; i++) {
+        data[i] ^= pattern[k];
+        if (++k == period) {
+            k = 0;
+        }
+    }
+}
+
+static void xor_pattern_generic(char* data, size_t len, const char* pattern, size_t period, size_t k) {
+    size_t step = 8 % period;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, data + i, 8);
+        memcpy(&b, pattern + k, 8);
+        a ^= b;
+        memcpy(data + i, &a, 8);
+        k += step;
+        if (k >= period) {
+            k -= period;
+        }
+    }
+    xor_pattern_tail(data + i, len - i, pattern, period, k);
+}
+
+// Bytes counted per pass, few enough that the 32-bit tables cannot overflow
+#define HISTOGRAM_PASS_SIZE ((size_t)1 << 30)
+
+// Four tables break the dependency between equal consecutive bytes
+static void byte_histogram_pass(const unsigned char* data, size_t size, uint64_t* frequencies) {
+    unsigned counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        counts[0][data[i]]++;
+        counts[1][data[i + 1]]++;
+        counts[2][data[i + 2]]++;
+        counts[3][data[i + 3]]++;
+        counts[0][data[i + 4]]++;
+        counts[1][data[i + 5]]++;
+        counts[2][data[i + 6]]++;
+        counts[3][data[i + 7]]++;
+    }
+    for (; i < size; i++) {
+        counts[0][data[i]]++;
+    }
+    for (int c = 0; c < 256; c++) {
+        frequencies[c] += (uint64_t)counts[0][c] + counts[1][c] + counts[2][c] + counts[3][c];
+    }
+}
+
+static void byte_histogram_generic(const unsigned char* data, size_t size, uint64_t* frequencies) {
+    while (size > 0) {
+        size_t pass = size < HISTOGRAM_PASS_SIZE ? size : HISTOGRAM_PASS_SIZE;
+        byte_histogram_pass(data, pass, frequencies);
+        data += pass;
+        size -= pass;
+    }
+}
+
+static uint64_t byte_mask_generic(const char* block, char byte) {
+    uint64_t pattern = 0x0101010101010101ULL * (unsigned char)byte;
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i += 8) {
+        mask |= gather_high_bits(zero_bytes(load64(block + i) ^ pattern)) << i;
+    }
+    return mask;
+}
+
+static uint64_t pair_mask_generic(const char* block, char first, char last, size_t gap) {
+    uint64_t first_pattern = 0x0101010101010101ULL * (unsigned char)first;
+    uint64_t last_pattern = 0x0101010101010101ULL * (unsigned char)last;
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i += 8) {
+        uint64_t differ = (load64(block + i) ^ first_pattern) | (load64(block + i + gap) ^ last_pattern);
+        mask |= gather_high_bits(zero_bytes(differ)) << i;
+    }
+    return mask;
+}
+
+#ifdef CPU_X86
+
+// --- SSE2 ---
+
+__attribute__((target("sse2")))
+static void xor_pattern_sse2(char* data, size_t len, const char* pattern, size_t period, size_t k) {
+    size_t step = 16 % period;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(pattern + k));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(a, b));
+        k += step;
+        if (k >= period) {
+            k -= period;
+        }
+    }
+    xor_pattern_tail(data + i, len - i, pattern, period, k);
+}
+
+__attribute__((target("sse2")))
+static uint64_t byte_mask_sse2(const char* block, char byte) {
+    __m128i needle = _mm_set1_epi8(byte);
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(block + i));
+        mask |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, needle)) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("sse2")))
+static uint64_t pair_mask_sse2(const char* block, char first, char last, size_t gap) {
+    __m128i first_needle = _mm_set1_epi8(first);
+    __m128i last_needle = _mm_set1_epi8(last);
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i += 16) {
+        __m128i heads = _mm_loadu_si128((const __m128i*)(block + i));
+        __m128i tails = _mm_loadu_si128((const __m128i*)(block + i + gap));
+        __m128i both = _mm_and_si128(_mm_cmpeq_epi8(heads, first_needle), _mm_cmpeq_epi8(tails, last_needle));
+        mask |= (uint64_t)(unsigned)_mm_movemask_epi8(both) << i;
+    }
+    return mask;
+}
+
+// --- AVX2 ---
+
+__attribute__((target("avx2")))
+static void xor_pattern_avx2(char* data, size_t len, const char* pattern, size_t period, size_t k) {
+    size_t step = 32 % period;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(pattern + k));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(a, b));
+        k += step;
+        if (k >= period) {
+            k -= period;
+        }
+    }
+    xor_pattern_tail(data + i, len - i, pattern, period, k);
+}
+
+__attribute__((target("avx2")))
+static uint64_t byte_mask_avx2(const char* block, char byte) {
+    __m256i needle = _mm256_set1_epi8(byte);
+    __m256i low = _mm256_loadu_si256((const __m256i*)block);
+    __m256i high = _mm256_loadu_si256((const __m256i*)(block + 32));
+    uint64_t low_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, needle));
+    uint64_t high_mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, needle));
+    return low_mask | high_mask << 32;
+}
+
+__attribute__((target("avx2")))
+static uint64_t pair_mask_avx2(const char* block, char first, char last, size_t gap) {
+    __m256i first_needle = _mm256_set1_epi8(first);
+    __m256i last_needle = _mm256_set1_epi8(last);
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i += 32) {
+        __m256i heads = _mm256_loadu_si256((const __m256i*)(block + i));
+        __m256i tails = _mm256_loadu_si256((const __m256i*)(block + i + gap));
+        __m256i both = _mm256_and_si256(_mm256_cmpeq_epi8(heads, first_needle),
+                                        _mm256_cmpeq_epi8(tails, last_needle));
+        mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(both) << i;
+    }
+    return mask;
+}
+
+// --- AVX-512 ---
+
+__attribute__((target("avx512f,avx512bw")))
+static void xor_pattern_avx512(char* data, size_t len, const char* pattern, size_t period, size_t k) {
+    size_t step = 64 % period;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m512i a = _mm512_loadu_si512((const void*)(data + i));
+        __m512i b = _mm512_loadu_si512((const void*)(pattern + k));
+        _mm512_storeu_si512((void*)(data + i), _mm512_xor_si512(a, b));
+        k += step;
+        if (k >= period) {
+            k -= period;
+        }
+    }
+    xor_pattern_tail(data + i, len - i, pattern, period, k);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t byte_mask_avx512(const char* block, char byte) {
+    return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)block), _mm512_set1_epi8(byte));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t pair_mask_avx512(const char* block, char first, char last, size_t gap) {
+    __mmask64 heads = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)block), _mm512_set1_epi8(first));
+    return _mm512_mask_cmpeq_epi8_mask(heads, _mm512_loadu_si512((const void*)(block + gap)),
+                                       _mm512_set1_epi8(last));
+}
+
+#endif // CPU_X86
+
+// The histogram is bound by its table updates rather than by loads, so every
+// level shares the multi-table version
+static const CpuKernels level_kernels[CPU_LEVEL_COUNT] = {
+    { xor_pattern_generic, byte_histogram_generic, byte_mask_generic, pair_mask_generic },
+#ifdef CPU_X86
+    { xor_pattern_sse2, byte_histogram_generic, byte_mask_sse2, pair_mask_sse2 },
+    { xor_pattern_avx2, byte_histogram_generic, byte_mask_avx2, pair_mask_avx2 },
+    { xor_pattern_avx512, byte_histogram_generic, byte_mask_avx512, pair_mask_avx512 },
+#else
+    { xor_pattern_generic, byte_histogram_generic, byte_mask_generic, pair_mask_generic },
+    { xor_pattern_generic, byte_histogram_generic, byte_mask_generic, pair_mask_generic },
+    { xor_pattern_generic, byte_histogram_generic, byte_mask_generic, pair_mask_generic },
+#endif
+};
+
+// Generic until the loader runs init_cpu_dispatch, so early callers are safe
+static CpuLevel selected_level = CPU_GENERIC;
+
+static CpuLevel detect_level(void) {
+#ifdef CPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return CPU_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return CPU_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return CPU_SSE2;
+    }
+#endif
+    return CPU_GENERIC;
+}
+
+__attribute__((constructor))
+static void init_cpu_dispatch(void) {
+    CpuLevel level = detect_level();
+    const char* cap = getenv("FP_CPU");
+    if (cap) {
+        for (int i = 0; i < CPU_LEVEL_COUNT; i++) {
+            if (strcmp(cap, level_names[i]) == 0 && (CpuLevel)i < level) {
+                level = (CpuLevel)i;
+            }
+        }
+    }
+    selected_level = level;
+}
+
+CpuLevel cpu_level(void) {
+    return selected_level;
+}
+
+const char* cpu_level_name(CpuLevel level) {
+    return level_names[level];
+}
+
+const CpuKernels* cpu_kernels(void) {
+    return &level_kernels[selected_level];
+}
@@ -0,0 +1,288 @@
+#include "../include/dedup.h"
+#include "../include/io.h"
+#include "../include/stats.h"
+#include "../include/lineindex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_SLOT_COUNT 1024
+
+// --- Line hashing ---
+// Consumes 8 bytes per multiply and finishes with the MurmurHash3 mixer.
+
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t hash_line(const char* p, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t word;
+
+    while (len >= 8) {
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 0x87c37b91114253d5ULL;
+        h ^= h >> 31;
+        p += 8;
+        len -= 8;
+    }
+    if (len > 0) {
+        word = 0;
+        memcpy(&word, p, len);
+        h = (h ^ word) * 0x87c37b91114253d5ULL;
+    }
+    return mix64(h);
+}
+
+// --- Hash table ---
+
+static LineTable* create_line_table(const char* text) {
+    LineTable* table = malloc(sizeof(LineTable));
+    if (!table) {
+        handle_memory_error();
+        return NULL;
+    }
+
+    table->text = text;
+    table->memory_limit = 0;
+    table->crlf = 0;
+    table->count = 0;
+    table->capacity = INITIAL_SLOT_COUNT / 2;
+    table->slot_count = INITIAL_SLOT_COUNT;
+    table->lines = malloc(table->capacity * sizeof(DistinctLine));
+    table->slots = calloc(table->slot_count, sizeof(size_t));
+    table->slot_hashes = malloc(table->slot_count * sizeof(uint64_t));
+    if (!table->lines || !table->slots || !table->slot_hashes) {
+        handle_memory_error();
+        free_line_table(table);
+        return NULL;
+    }
+    return table;
+}
+
+// Bytes a table holds in use, counting the slice each distinct line gets
+// when the output is formatted. Line capacity not yet filled is never touched.
+static size_t line_table_size(size_t slot_count, size_t line_count) {
+    return slot_count * (sizeof(size_t) + sizeof(uint64_t)) +
+           line_count * (sizeof(DistinctLine) + sizeof(LineSlice));
+}
+
+static int line_table_fits(const LineTable* table, size_t slot_count, size_t line_count) {
+    if (table->memory_limit > 0 && line_table_size(slot_count, line_count) > table->memory_limit) {
+        handle_error("Too many distinct lines to fit in the memory limit");
+        return 0;
+    }
+    return 1;
+}
+
+// Doubles the slot array, keeping the load factor at or below one half
+static int grow_line_table(LineTable* table) {
+    size_t slot_count = table->slot_count * 2;
+    if (!line_table_fits(table, slot_count, table->count)) {
+        return 0;
+    }
+    size_t* slots = calloc(slot_count, sizeof(size_t));
+    uint64_t* slot_hashes = malloc(slot_count * sizeof(uint64_t));
+    DistinctLine* lines = realloc(table->lines, (slot_count / 2) * sizeof(DistinctLine));
+    if (!slots || !slot_hashes || !lines) {
+        handle_memory_error();
+        free(slots);
+        free(slot_hashes);
+        if (lines) {
+            table->lines = lines;
+        }
+        return 0;
+    }
+
+    size_t mask = slot_count - 1;
+    for (size_t i = 0; i < table->slot_count; i++) {
+        if (table->slots[i]) {
+            size_t slot = table->slot_hashes[i] & mask;
+            while (slots[slot]) {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = table->slots[i];
+            slot_hashes[slot] = table->slot_hashes[i];
+        }
+    }
+
+    free(table->slots);
+    free(table->slot_hashes);
+    table->slots = slots;
+    table->slot_hashes = slot_hashes;
+    table->slot_count = slot_count;
+    table->lines = lines;
+    table->capacity = slot_count / 2;
+    return 1;
+}
+
+static int add_line(LineTable* table, size_t offset, size_t length) {
+    const char* line = table->text + offset;
+    uint64_t hash = hash_line(line, length);
+    size_t mask = table->slot_count - 1;
+    size_t slot = hash & mask;
+
+    while (table->slots[slot]) {
+        if (table->slot_hashes[slot] == hash) {
+            DistinctLine* entry = &table->lines[table->slots[slot] - 1];
+            if (entry->line.length == length &&
+                memcmp(table->text + entry->line.offset, line, length) == 0) {
+                entry->count++;
+                return 1;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (table->count == table->capacity) {
+        if (!grow_line_table(table)) {
+            return 0;
+        }
+        return add_line(table, offset, length);
+    }
+
+    if (!line_table_fits(table, table->slot_count, table->count + 1)) {
+        return 0;
+    }
+
+    DistinctLine* entry = &table->lines[table->count++];
+    entry->line = make_line_slice(table->text, offset, length);
+    entry->count = 1;
+    table->slots[slot] = table->count;
+    table->slot_hashes[slot] = hash;
+    return 1;
+}
+
+const DistinctLine* find_distinct_line(const LineTable* table, const char* line, size_t length) {
+    uint64_t hash = hash_line(line, length);
+    size_t mask = table->slot_count - 1;
+    size_t slot = hash & mask;
+
+    while (table->slots[slot]) {
+        if (table->slot_hashes[slot] == hash) {
+            const DistinctLine* entry = &table->lines[table->slots[slot] - 1];
+            if (entry->line.length == length &&
+                memcmp(table->text + entry->line.offset, line, length) == 0) {
+                return entry;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+LineTable* count_distinct_lines(const char* text, size_t text_len, size_t threads,
+                                size_t memory_limit) {
+    if (!text) {
+        handle_error("Invalid input for line counting");
+        return NULL;
+    }
+
+    STATS_BEGIN(mark);
+    LineIndex* index = build_line_index(text, text_len, threads);
+    if (!index) {
+        return NULL;
+    }
+
+    LineTable* table = create_line_table(text);
+    if (!table) {
+        free_line_index(index);
+        return NULL;
+    }
+    table->crlf = index->crlf;
+    table->memory_limit = memory_limit;
+
+    for (size_t i = 0; i < index->count; i++) {
+        if (!add_line(table, line_index_start(index, i), line_index_length(index, i))) {
+            free_line_table(table);
+            free_line_index(index);
+            return NULL;
+        }
+    }
+
+    free_line_index(index);
+    STATS_END(mark, STATS_DEDUP, text_len);
+    return table;
+}
+
+char* format_distinct_lines(const LineTable* table, int with_counts,
+                            const SortOptions* sort_options, size_t threads, size_t* output_len) {
+    *output_len = 0;
+    if (!table || table->count == 0) {
+        return NULL;
+    }
+
+    LineArray lines;
+    lines.text = table->text;
+    lines.count = table->count;
+    lines.lines = malloc(table->count * sizeof(LineSlice));
+    if (!lines.lines) {
+        handle_memory_error();
+        return NULL;
+    }
+    for (size_t i = 0; i < table->count; i++) {
+        lines.lines[i] = table->lines[i].line;
+    }
+
+    if (sort_options && !sort_lines_with_options(&lines, sort_options, threads)) {
+        free(lines.lines);
+        return NULL;
+    }
+
+    // Counts take at most 20 digits plus padding and a space
+    size_t total_size = 0;
+    for (size_t i = 0; i < lines.count; i++) {
+        total_size += lines.lines[i].length + 2 + (with_counts ? 24 : 0);
+    }
+
+    char* output = malloc(total_size + 1);
+    if (!output) {
+        handle_memory_error();
+        free(lines.lines);
+        return NULL;
+    }
+
+    STATS_BEGIN(mark);
+    size_t pos = 0;
+    for (size_t i = 0; i < lines.count; i++) {
+        const LineSlice* line = &lines.lines[i];
+        const char* bytes = table->text + line->offset;
+        if (with_counts) {
+            const DistinctLine* entry = sort_options
+                ? find_distinct_line(table, bytes, line->length)
+                : &table->lines[i];
+            pos += snprintf(output + pos, 25, "%7zu ", entry ? entry->count : 0);
+        }
+        memcpy(output + pos, bytes, line->length);
+        pos += line->length;
+        if (table->crlf) {
+            output[pos++] = '\r';
+        }
+        output[pos++] = '\n';
+    }
+
+    output[pos] = '\0';
+    *output_len = pos;
+    STATS_END(mark, STATS_JOIN, pos);
+    free(lines.lines);
+    return output;
+}
+
+size_t dedup_memory_estimate(size_t text_len, size_t line_count, int with_counts) {
+    // The newline index, and output of at most the text plus a terminator and count per line
+    return text_len + line_count * (sizeof(uint64_t) + (with_counts ? 24 : 2));
+}
+
+void free_line_table(LineTable* table) {
+    if (table) {
+        free(table->lines);
+        free(table->slots);
+        free(table->slot_hashes);
+        free(table);
+    }
+}
@@ -1,9 +1,16 @@
 #include "../include/encrypt.h"
+#include "../include/asyncio.h"
+#include "../include/cpu.h"
 #include "../include/io.h"
+#include "../include/stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Shorter runs, or keys too long for the stack pattern, are XORed bytewise
+#define XOR_VECTOR_MIN 256
+#define XOR_PATTERN_MAX_KEY 4096
+
 char* xor_encrypt(const char* input, size_t input_len, const char* key, size_t* output_len) {
     if (!input || !key || input_len == 0) {
         handle_error("Invalid input for encryption");
@@ -22,16 +29,76 @@ char* xor_encrypt(const char* input, size_t input_len, const char* key, size_t*
         return NULL;
     }
 
-    for (size_t i = 0; i < input_len; i++) {
-        output[i] = input[i] ^ key[i % key_len];
-    }
+    memcpy(output, input, input_len);
+    xor_apply(output, input_len, key, key_len, 0);
 
     output[input_len] = '\0';
     *output_len = input_len;
     return output;
 }
 
+void xor_apply(char* data, size_t len, const char* key, size_t key_len, size_t position) {
+    STATS_BEGIN(mark);
+    size_t k = position % key_len;
+    if (len < XOR_VECTOR_MIN || key_len > XOR_PATTERN_MAX_KEY) {
+        for (size_t i = 0; i < len; i++) {
+            data[i] ^= key[k];
+            if (++k == key_len) {
+                k = 0;
+            }
+        }
+    } else {
+        // The key repeated past one period, so a vector load at any phase
+        // reads the key bytes for the next 64 positions
+        char pattern[XOR_PATTERN_MAX_KEY + 64];
+        for (size_t i = 0; i < key_len + 63; i++) {
+            pattern[i] = key[i % key_len];
+        }
+        cpu_kernels()->xor_pattern(data, len, pattern, key_len, k);
+    }
+    STATS_END(mark, STATS_CIPHER, len);
+}
+
 char* xor_decrypt(const char* input, size_t input_len, const char* key, size_t* output_len) {
     /* XOR decryption is the same as encryption */
     return xor_encrypt(input, input_len, key, output_len);
-} 
\ No newline at end of file
+} 
+
+int xor_stream(FILE* input, FILE* output, const char* key, Workspace* workspace) {
+    size_t key_len = strlen(key);
+    if (key_len == 0) {
+        handle_error("Empty encryption key");
+        return 0;
+    }
+
+    // The next chunk is read and the previous one written while this one is processed
+    AsyncReader* reader = create_async_reader(input, STREAM_CHUNK_SIZE, workspace);
+    OutputBuffer* out = reader ? create_async_output_buffer(output, OUTPUT_BUFFER_SIZE, workspace) : NULL;
+    if (!out) {
+        free_async_reader(reader);
+        return 0;
+    }
+
+    int ok = 1;
+    size_t position = 0;
+    char* chunk;
+    size_t chunk_len;
+    int status;
+    while ((status = async_reader_next(reader, &chunk, &chunk_len)) > 0) {
+        xor_apply(chunk, chunk_len, key, key_len, position);
+        position += chunk_len;
+        if (!output_buffer_write(out, chunk, chunk_len)) {
+            ok = 0;
+            break;
+        }
+    }
+    if (status < 0) {
+        handle_error("Failed to read file");
+        ok = 0;
+    }
+
+    ok = flush_output_buffer(out) && ok;
+    free_output_buffer(out);
+    free_async_reader(reader);
+    return ok;
+}
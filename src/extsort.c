@@ -0,0 +1,663 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/extsort.h"
+#include "../include/io.h"
+#include "../include/sort.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIN_MEMORY_LIMIT (256 * 1024)
+#define MIN_READ_BUFFER (64 * 1024)
+
+// --- Buffered line reader ---
+
+typedef struct {
+    FILE* file;
+    char* buffer;
+    size_t capacity;
+    size_t start;     // First unread byte
+    size_t end;       // End of valid data
+    int eof;
+    const char* line; // Current line, not including the newline
+    size_t line_len;
+    int detect_crlf;  // Treat CRLF as the terminator if the first line ends in it
+    int crlf;         // CRLF endings detected, as in a LineIndex
+    size_t lines_read;
+} LineReader;
+
+static int init_line_reader(LineReader* reader, FILE* file, size_t capacity, int detect_crlf) {
+    reader->buffer = malloc(capacity);
+    if (!reader->buffer) {
+        handle_memory_error();
+        return 0;
+    }
+    reader->file = file;
+    reader->capacity = capacity;
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+    reader->line = NULL;
+    reader->line_len = 0;
+    reader->detect_crlf = detect_crlf;
+    reader->crlf = 0;
+    reader->lines_read = 0;
+    return 1;
+}
+
+// Advances to the next line. Returns 1 on success, 0 at the end of input
+// and -1 on error.
+static int next_line(LineReader* reader) {
+    for (;;) {
+        char* data = reader->buffer + reader->start;
+        size_t available = reader->end - reader->start;
+        char* nl = memchr(data, '\n', available);
+        if (nl) {
+            reader->line = data;
+            reader->line_len = nl - data;
+            reader->start += reader->line_len + 1;
+            int ends_in_cr = reader->line_len > 0 && data[reader->line_len - 1] == '\r';
+            if (reader->lines_read == 0 && reader->detect_crlf) {
+                reader->crlf = ends_in_cr;
+            }
+            if (reader->crlf && ends_in_cr) {
+                reader->line_len--;
+            }
+            reader->lines_read++;
+            return 1;
+        }
+
+        if (reader->eof) {
+            if (available == 0) {
+                return 0;
+            }
+            // Last line without a trailing newline
+            reader->line = data;
+            reader->line_len = available;
+            reader->start = reader->end;
+            reader->lines_read++;
+            return 1;
+        }
+
+        // Keep the partial line and refill behind it
+        memmove(reader->buffer, data, available);
+        reader->start = 0;
+        reader->end = available;
+        if (reader->end == reader->capacity) {
+            // A single line longer than the buffer
+            char* grown = realloc(reader->buffer, reader->capacity * 2);
+            if (!grown) {
+                handle_memory_error();
+                return -1;
+            }
+            reader->buffer = grown;
+            reader->capacity *= 2;
+        }
+
+        size_t bytes_read = fread(reader->buffer + reader->end, 1,
+                                  reader->capacity - reader->end, reader->file);
+        if (bytes_read == 0) {
+            if (ferror(reader->file)) {
+                handle_error("Failed to read file");
+                return -1;
+            }
+            reader->eof = 1;
+        }
+        reader->end += bytes_read;
+    }
+}
+
+static int write_terminator(OutputBuffer* out, int crlf) {
+    return crlf ? output_buffer_write(out, "\r\n", 2) : output_buffer_write(out, "\n", 1);
+}
+
+// --- Run formation ---
+
+typedef struct {
+    FILE** files;
+    size_t count;
+    size_t capacity;
+} RunList;
+
+static void close_runs(RunList* runs) {
+    for (size_t i = 0; i < runs->count; i++) {
+        fclose(runs->files[i]);
+    }
+    free(runs->files);
+    runs->files = NULL;
+    runs->count = 0;
+}
+
+static FILE* create_temp_file(const char* temp_dir) {
+    size_t path_len = strlen(temp_dir) + sizeof("/fp_sort_XXXXXX");
+    char* path = malloc(path_len);
+    if (!path) {
+        handle_memory_error();
+        return NULL;
+    }
+    snprintf(path, path_len, "%s/fp_sort_XXXXXX", temp_dir);
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        handle_error("Failed to create temporary file");
+        free(path);
+        return NULL;
+    }
+
+    // Unlink right away so the file is reclaimed however the process exits
+    unlink(path);
+    free(path);
+
+    FILE* file = fdopen(fd, "w+b");
+    if (!file) {
+        handle_error("Failed to open temporary file");
+        close(fd);
+    }
+    return file;
+}
+
+static int write_lines(FILE* file, const LineArray* lines, size_t buffer_size, int crlf) {
+    OutputBuffer* out = create_output_buffer(file, buffer_size);
+    if (!out) {
+        return 0;
+    }
+
+    int ok = 1;
+    for (size_t i = 0; i < lines->count && ok; i++) {
+        const LineSlice* line = &lines->lines[i];
+        ok = output_buffer_write(out, lines->text + line->offset, line->length) &&
+             write_terminator(out, crlf);
+    }
+    ok = flush_output_buffer(out) && ok;
+    free_output_buffer(out);
+    return ok;
+}
+
+static int add_run(RunList* runs, FILE* file) {
+    if (runs->count == runs->capacity) {
+        size_t new_capacity = runs->capacity ? runs->capacity * 2 : 16;
+        FILE** grown = realloc(runs->files, new_capacity * sizeof(FILE*));
+        if (!grown) {
+            handle_memory_error();
+            return 0;
+        }
+        runs->files = grown;
+        runs->capacity = new_capacity;
+    }
+    runs->files[runs->count++] = file;
+    return 1;
+}
+
+/*
+ * Reads the input into sorted runs. The memory limit is split between the
+ * read buffer, the run text and the line pointers. If the whole input fits
+ * in a single run it is written straight to the output and no temporary
+ * file is created; *done is set in that case.
+ */
+static int create_runs(FILE* input, FILE* output, size_t memory_limit, const char* temp_dir,
+                       const SortOptions* options, RunList* runs, int* done, int* crlf) {
+    size_t read_size = memory_limit / 8;
+    size_t text_capacity = memory_limit / 2;
+    size_t slice_capacity = (memory_limit - read_size - text_capacity) / sizeof(LineSlice);
+
+    LineReader reader;
+    if (!init_line_reader(&reader, input, read_size, 1)) {
+        return 0;
+    }
+
+    char* text = malloc(text_capacity);
+    LineArray run;
+    run.text = text;
+    run.crlf = 0;
+    run.lines = malloc(slice_capacity * sizeof(LineSlice));
+    run.count = 0;
+    if (!text || !run.lines) {
+        handle_memory_error();
+        free(text);
+        free(run.lines);
+        free(reader.buffer);
+        return 0;
+    }
+
+    int ok = 1;
+    int status;
+    size_t text_used = 0;
+    *done = 0;
+    while (ok && (status = next_line(&reader)) != 0) {
+        if (status < 0) {
+            ok = 0;
+            break;
+        }
+
+        if (text_used + reader.line_len > text_capacity || run.count == slice_capacity) {
+            // Spill the current run
+            if (run.count > 0) {
+                ok = sort_lines_with_options(&run, options, 1);
+                FILE* temp = ok ? create_temp_file(temp_dir) : NULL;
+                ok = temp && add_run(runs, temp) && write_lines(temp, &run, read_size, 0);
+                run.count = 0;
+                text_used = 0;
+            }
+            if (ok && reader.line_len > text_capacity) {
+                // A line longer than the run buffer gets a run of its own
+                char* grown = realloc(text, reader.line_len);
+                if (!grown) {
+                    handle_memory_error();
+                    ok = 0;
+                    break;
+                }
+                text = grown;
+                text_capacity = reader.line_len;
+            }
+            if (!ok) {
+                break;
+            }
+        }
+
+        memcpy(text + text_used, reader.line, reader.line_len);
+        run.text = text;
+        run.lines[run.count++] = make_line_slice(text, text_used, reader.line_len);
+        text_used += reader.line_len;
+    }
+
+    if (ok && run.count > 0) {
+        if (!sort_lines_with_options(&run, options, 1)) {
+            ok = 0;
+        } else if (runs->count == 0) {
+            ok = write_lines(output, &run, read_size, reader.crlf);
+            *done = 1;
+        } else {
+            FILE* temp = create_temp_file(temp_dir);
+            ok = temp && add_run(runs, temp) && write_lines(temp, &run, read_size, 0);
+        }
+    } else if (ok && runs->count == 0) {
+        *done = 1; // Empty input
+    }
+
+    *crlf = reader.crlf;
+    free(text);
+    free(run.lines);
+    free(reader.buffer);
+    return ok;
+}
+
+// --- K-way merge with a loser tree ---
+// tree[0] holds the index of the current smallest run head and every
+// internal node holds the loser of the match played there. Replacing the
+// winner only replays the matches on its path to the root, so each output
+// line costs about log2(k) comparisons.
+
+typedef struct {
+    LineReader* readers;
+    KeyedLine* heads;    // Sort key of every run's current line
+    int* exhausted;
+    size_t* tree;
+    size_t k;
+    const SortOptions* options;
+} Merger;
+
+// Returns 1 if run a should be output before run b. Index k stands for a
+// virtual run that wins every match, used while the tree is built. Runs
+// hold consecutive parts of the input, so ties go to the earlier run.
+static int merger_beats(const Merger* merger, size_t a, size_t b) {
+    if (a == merger->k) return 1;
+    if (b == merger->k) return 0;
+    if (merger->exhausted[a]) return 0;
+    if (merger->exhausted[b]) return 1;
+
+    int cmp = compare_keyed_lines(merger->options, merger->readers[a].line, &merger->heads[a],
+                                  merger->readers[b].line, &merger->heads[b]);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void merger_adjust(Merger* merger, size_t leaf) {
+    size_t winner = leaf;
+    for (size_t node = (leaf + merger->k) / 2; node > 0; node /= 2) {
+        if (merger_beats(merger, merger->tree[node], winner)) {
+            size_t temp = merger->tree[node];
+            merger->tree[node] = winner;
+            winner = temp;
+        }
+    }
+    merger->tree[0] = winner;
+}
+
+// Advances run i and computes the key of its new head
+static int merger_next(Merger* merger, size_t i) {
+    LineReader* reader = &merger->readers[i];
+    int status = next_line(reader);
+    merger->exhausted[i] = status <= 0;
+    if (status > 0) {
+        LineSlice line = make_line_slice(reader->line, 0, reader->line_len);
+        merger->heads[i] = make_keyed_line(reader->line, &line, merger->options, 0);
+    }
+    return status >= 0;
+}
+
+static int merge_runs(RunList* runs, FILE* output, size_t memory_limit, const SortOptions* options,
+                      int crlf) {
+    size_t k = runs->count;
+    size_t buffer_size = memory_limit / (k + 1);
+    if (buffer_size < MIN_READ_BUFFER) {
+        buffer_size = MIN_READ_BUFFER;
+    }
+
+    Merger merger;
+    merger.k = k;
+    merger.options = options;
+    merger.readers = calloc(k, sizeof(LineReader));
+    merger.heads = calloc(k, sizeof(KeyedLine));
+    merger.exhausted = calloc(k, sizeof(int));
+    merger.tree = malloc(k * sizeof(size_t));
+    if (!merger.readers || !merger.heads || !merger.exhausted || !merger.tree) {
+        handle_memory_error();
+        free(merger.readers);
+        free(merger.heads);
+        free(merger.exhausted);
+        free(merger.tree);
+        return 0;
+    }
+
+    int ok = 1;
+    size_t initialized = 0;
+    for (; initialized < k && ok; initialized++) {
+        rewind(runs->files[initialized]);
+        ok = init_line_reader(&merger.readers[initialized], runs->files[initialized], buffer_size, 0) &&
+             merger_next(&merger, initialized);
+    }
+
+    // With unique, the last line written is kept to drop equal keys that
+    // arrive from other runs
+    char* last = NULL;
+    size_t last_capacity = 0;
+    KeyedLine last_key;
+    int have_last = 0;
+
+    OutputBuffer* out = ok ? create_output_buffer(output, buffer_size) : NULL;
+    if (out) {
+        for (size_t i = 0; i < k; i++) {
+            merger.tree[i] = k;
+        }
+        for (size_t i = k; i-- > 0;) {
+            merger_adjust(&merger, i);
+        }
+
+        while (ok && !merger.exhausted[merger.tree[0]]) {
+            size_t winner = merger.tree[0];
+            LineReader* reader = &merger.readers[winner];
+            KeyedLine* head = &merger.heads[winner];
+
+            int duplicate = options->unique && have_last &&
+                compare_sort_keys(options, last, &last_key, reader->line, head) == 0;
+            if (!duplicate) {
+                ok = output_buffer_write(out, reader->line, reader->line_len) &&
+                     write_terminator(out, crlf);
+            }
+            if (ok && !duplicate && options->unique) {
+                if (reader->line_len > last_capacity) {
+                    char* grown = realloc(last, reader->line_len);
+                    if (!grown) {
+                        handle_memory_error();
+                        ok = 0;
+                        break;
+                    }
+                    last = grown;
+                    last_capacity = reader->line_len;
+                }
+                memcpy(last, reader->line, reader->line_len);
+                last_key = *head;
+                have_last = 1;
+            }
+
+            ok = ok && merger_next(&merger, winner);
+            merger_adjust(&merger, winner);
+        }
+
+        ok = flush_output_buffer(out) && ok;
+        free_output_buffer(out);
+    } else {
+        ok = 0;
+    }
+
+    for (size_t i = 0; i < initialized; i++) {
+        free(merger.readers[i].buffer);
+    }
+    free(last);
+    free(merger.readers);
+    free(merger.heads);
+    free(merger.exhausted);
+    free(merger.tree);
+    return ok;
+}
+
+int external_sort(const char* input_file, const char* output_file,
+                  size_t memory_limit, const char* temp_dir, const SortOptions* options) {
+    if (memory_limit < MIN_MEMORY_LIMIT) {
+        memory_limit = MIN_MEMORY_LIMIT;
+    }
+    if (!temp_dir) {
+        temp_dir = getenv("TMPDIR");
+        if (!temp_dir || *temp_dir == '\0') {
+            temp_dir = DEFAULT_TEMP_DIR;
+        }
+    }
+
+    FILE* input = open_input_stream(input_file);
+    if (!input) {
+        return 0;
+    }
+
+    FILE* output = open_output_stream(output_file);
+    if (!output) {
+        close_stream(input);
+        return 0;
+    }
+
+    RunList runs = { NULL, 0, 0 };
+    int done = 0;
+    int crlf = 0;
+    int ok = create_runs(input, output, memory_limit, temp_dir, options, &runs, &done, &crlf);
+    close_stream(input);
+
+    if (ok && !done) {
+        ok = merge_runs(&runs, output, memory_limit, options, crlf);
+    }
+    close_runs(&runs);
+
+    if (close_stream(output) != 0) {
+        handle_error("Failed to write file");
+        ok = 0;
+    }
+    return ok;
+}
+
+// --- Top-k selection ---
+// The heap keeps the best count lines seen so far, each in its own buffer.
+// For head the root is the line that sorts last among them (a max-heap), for
+// tail the line that sorts first, so a new line only has to beat the root.
+// The entry just past the heap holds the candidate line. Entries are
+// allocated as lines arrive, so a count larger than the input costs nothing.
+
+#define TOP_HEAP_MIN_CAPACITY 64
+
+typedef struct {
+    char* data;        // Copy of the line
+    size_t capacity;
+    KeyedLine keyed;   // Key relative to data
+} HeapEntry;
+
+typedef struct {
+    HeapEntry* entries;
+    size_t size;
+    size_t capacity;   // Entries allocated, at most count + 1
+    int tail;
+    const SortOptions* options;
+} TopHeap;
+
+static int entry_before(const TopHeap* heap, const HeapEntry* a, const HeapEntry* b) {
+    int cmp = compare_keyed_lines(heap->options, a->data, &a->keyed, b->data, &b->keyed);
+    return cmp < 0 || (cmp == 0 && a->keyed.index < b->keyed.index);
+}
+
+// Returns 1 if a belongs closer to the root than b
+static int entry_above(const TopHeap* heap, const HeapEntry* a, const HeapEntry* b) {
+    return heap->tail ? entry_before(heap, a, b) : entry_before(heap, b, a);
+}
+
+static void swap_entries(HeapEntry* a, HeapEntry* b) {
+    HeapEntry temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+static void top_heap_sift_down(TopHeap* heap, size_t size, size_t i) {
+    for (;;) {
+        size_t top = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < size && entry_above(heap, &heap->entries[left], &heap->entries[top]))
+            top = left;
+        if (right < size && entry_above(heap, &heap->entries[right], &heap->entries[top]))
+            top = right;
+        if (top == i) {
+            return;
+        }
+        swap_entries(&heap->entries[i], &heap->entries[top]);
+        i = top;
+    }
+}
+
+static void top_heap_sift_up(TopHeap* heap, size_t i) {
+    while (i > 0 && entry_above(heap, &heap->entries[i], &heap->entries[(i - 1) / 2])) {
+        swap_entries(&heap->entries[i], &heap->entries[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+}
+
+// Copies a line into an entry, reusing the entry's buffer
+static int set_entry(HeapEntry* entry, const char* line, size_t length, size_t index,
+                     const SortOptions* options) {
+    if (length > entry->capacity || !entry->data) {
+        char* grown = realloc(entry->data, length ? length : 1);
+        if (!grown) {
+            handle_memory_error();
+            return 0;
+        }
+        entry->data = grown;
+        entry->capacity = length;
+    }
+    memcpy(entry->data, line, length);
+    LineSlice slice = make_line_slice(entry->data, 0, length);
+    entry->keyed = make_keyed_line(entry->data, &slice, options, index);
+    return 1;
+}
+
+// Makes room for the candidate after the heap, up to limit entries
+static int top_heap_reserve(TopHeap* heap, size_t limit) {
+    if (heap->size < heap->capacity) {
+        return 1;
+    }
+    size_t capacity = heap->capacity ? heap->capacity * 2 : TOP_HEAP_MIN_CAPACITY;
+    if (capacity > limit || capacity < heap->capacity) {
+        capacity = limit;
+    }
+    HeapEntry* grown = realloc(heap->entries, capacity * sizeof(HeapEntry));
+    if (!grown) {
+        handle_memory_error();
+        return 0;
+    }
+    memset(grown + heap->capacity, 0, (capacity - heap->capacity) * sizeof(HeapEntry));
+    heap->entries = grown;
+    heap->capacity = capacity;
+    return 1;
+}
+
+int top_k_sort(const char* input_file, const char* output_file, size_t count, int tail,
+               const SortOptions* options) {
+    if (options->unique) {
+        handle_error("--unique cannot be combined with --head or --tail");
+        return 0;
+    }
+    if (count > SIZE_MAX / sizeof(HeapEntry) - 1) {
+        handle_error("Line count for --head or --tail is too large");
+        return 0;
+    }
+
+    FILE* input = open_input_stream(input_file);
+    if (!input) {
+        return 0;
+    }
+
+    FILE* output = open_output_stream(output_file);
+    if (!output) {
+        close_stream(input);
+        return 0;
+    }
+
+    TopHeap heap;
+    heap.entries = NULL;
+    heap.size = 0;
+    heap.capacity = 0;
+    heap.tail = tail;
+    heap.options = options;
+
+    LineReader reader;
+    reader.buffer = NULL;
+    int ok = init_line_reader(&reader, input, MIN_READ_BUFFER * 16, 1);
+
+    size_t index = 0;
+    int status;
+    while (ok && count > 0 && (status = next_line(&reader)) != 0) {
+        if (status < 0 || !top_heap_reserve(&heap, count + 1)) {
+            ok = 0;
+            break;
+        }
+        HeapEntry* candidate = &heap.entries[heap.size];
+        if (!set_entry(candidate, reader.line, reader.line_len, index++, options)) {
+            ok = 0;
+            break;
+        }
+
+        if (heap.size < count) {
+            top_heap_sift_up(&heap, heap.size++); // The candidate is already in place
+        } else if (entry_above(&heap, &heap.entries[0], candidate)) {
+            // The candidate beats the worst kept line; its buffer is reused
+            swap_entries(&heap.entries[0], candidate);
+            top_heap_sift_down(&heap, heap.size, 0);
+        }
+    }
+
+    if (ok) {
+        // Heapsort in place: the root always moves to the end of the heap
+        for (size_t end = heap.size; end > 1; end--) {
+            swap_entries(&heap.entries[0], &heap.entries[end - 1]);
+            top_heap_sift_down(&heap, end - 1, 0);
+        }
+
+        OutputBuffer* out = create_output_buffer(output, OUTPUT_BUFFER_SIZE);
+        ok = out != NULL;
+        for (size_t i = 0; i < heap.size && ok; i++) {
+            // Head leaves the lines in sorted order, tail in reverse
+            const HeapEntry* entry = &heap.entries[tail ? heap.size - 1 - i : i];
+            ok = output_buffer_write(out, entry->data, entry->keyed.line.length) &&
+                 write_terminator(out, reader.crlf);
+        }
+        if (out) {
+            ok = flush_output_buffer(out) && ok;
+            free_output_buffer(out);
+        }
+    }
+
+    for (size_t i = 0; i < heap.capacity; i++) {
+        free(heap.entries[i].data);
+    }
+    free(heap.entries);
+    free(reader.buffer);
+    close_stream(input);
+    if (close_stream(output) != 0) {
+        handle_error("Failed to write file");
+        ok = 0;
+    }
+    return ok;
+}
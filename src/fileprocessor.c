@@ -0,0 +1,560 @@
+#include "../include/fileprocessor.h"
+#include "../include/compress.h"
+#include "../include/contextmodel.h"
+#include "../include/encrypt.h"
+#include "../include/io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct FpStream {
+    FpOperation operation;
+    FpStatus status;        // First error; every later call returns it
+    int finished;
+    OutputBuffer* pending;  // Output waiting to be drained
+    // Cipher state
+    char* key;
+    size_t key_len;
+    size_t position;        // Bytes processed so far, for the key offset
+    // Compression: the block being filled. Decompression: the frame being
+    // collected, or the whole input in the original single-block format.
+    char* block;
+    size_t block_len;
+    size_t block_capacity;
+    // Decompression state
+    int framed;             // -1 until the first bytes are seen, then the FPH
+                            // version, 3 for FPC1, or 0 for the original
+                            // single-block format
+    unsigned char header[HUFFMAN_MAX_VARINT_LEN]; // Magic bytes, then the length of the next frame
+    size_t header_len;
+    int frame_started;      // The length of the current frame is known
+    size_t frame_len;
+    int ended;              // The end marker was read
+};
+
+struct FpSearch {
+    SearchContext* ctx;
+    OutputBuffer* pending;
+    char* keyword;          // The context points into these
+    char* label;
+    FpStatus status;
+    int finished;
+};
+
+const char* fp_status_string(FpStatus status) {
+    switch (status) {
+        case FP_OK: return "Success";
+        case FP_ERROR_ARGUMENT: return "Invalid argument";
+        case FP_ERROR_MEMORY: return "Memory allocation error";
+        case FP_ERROR_CORRUPT: return "Corrupt or truncated input";
+        case FP_ERROR_BUFFER_TOO_SMALL: return "Output buffer too small";
+    }
+    return "Unknown error";
+}
+
+static size_t pending_size(const OutputBuffer* pending) {
+    return pending->size - pending->start;
+}
+
+// Room before a feed has to stop and let the caller drain
+static size_t pending_room(const OutputBuffer* pending) {
+    size_t size = pending_size(pending);
+    return size < FP_PENDING_LIMIT ? FP_PENDING_LIMIT - size : 0;
+}
+
+// --- Byte streams ---
+
+FpStream* fp_create_stream(FpOperation operation, const char* key, FpStatus* status) {
+    FpStatus result = FP_OK;
+    FpStream* stream = NULL;
+    int cipher = operation == FP_ENCRYPT || operation == FP_DECRYPT;
+    int compress = operation == FP_COMPRESS || operation == FP_COMPRESS_CONTEXT;
+
+    if ((!compress && operation != FP_DECOMPRESS && !cipher) ||
+        (cipher && (!key || key[0] == '\0'))) {
+        handle_error(cipher ? "Empty encryption key" : "Invalid stream operation");
+        result = FP_ERROR_ARGUMENT;
+    } else if (!(stream = calloc(1, sizeof(FpStream))) ||
+               !(stream->pending = create_memory_output_buffer(STREAM_CHUNK_SIZE)) ||
+               (cipher && !(stream->key = my_strdup(key)))) {
+        if (!stream) {
+            handle_memory_error();
+        }
+        fp_free_stream(stream);
+        stream = NULL;
+        result = FP_ERROR_MEMORY;
+    } else {
+        stream->operation = operation;
+        stream->key_len = cipher ? strlen(key) : 0;
+        stream->framed = -1;
+        const char* magic = operation == FP_COMPRESS_CONTEXT ? HUFFMAN_CONTEXT_FRAME_MAGIC
+                                                             : HUFFMAN_FRAME_MAGIC;
+        if (compress && !output_buffer_write(stream->pending, magic, HUFFMAN_FRAME_MAGIC_LEN)) {
+            fp_free_stream(stream);
+            stream = NULL;
+            result = FP_ERROR_MEMORY;
+        }
+    }
+
+    if (status) {
+        *status = result;
+    }
+    return stream;
+}
+
+// Compresses one block into a frame of pending output
+static FpStatus emit_frame(FpStream* stream, const char* block, size_t block_len) {
+    size_t frame_len;
+    char* frame = stream->operation == FP_COMPRESS_CONTEXT ? context_compress(block, block_len, &frame_len)
+                                                           : huffman_compress(block, block_len, &frame_len);
+    if (!frame) {
+        return FP_ERROR_MEMORY;
+    }
+
+    unsigned char header[HUFFMAN_MAX_VARINT_LEN];
+    size_t header_len = put_varint(header, frame_len);
+    int ok = output_buffer_write(stream->pending, (const char*)header, header_len) &&
+             output_buffer_write(stream->pending, frame, frame_len);
+    free(frame);
+    return ok ? FP_OK : FP_ERROR_MEMORY;
+}
+
+static FpStatus compress_feed(FpStream* stream, const char* data, size_t len, size_t* consumed) {
+    while (*consumed < len && pending_room(stream->pending) > 0) {
+        const char* p = data + *consumed;
+        size_t remaining = len - *consumed;
+
+        // Whole blocks of the caller's chunk are compressed where they are
+        if (stream->block_len == 0 && remaining >= HUFFMAN_BLOCK_SIZE) {
+            FpStatus status = emit_frame(stream, p, HUFFMAN_BLOCK_SIZE);
+            if (status != FP_OK) {
+                return status;
+            }
+            *consumed += HUFFMAN_BLOCK_SIZE;
+            continue;
+        }
+
+        if (!reserve_scratch(&stream->block, &stream->block_capacity, HUFFMAN_BLOCK_SIZE)) {
+            return FP_ERROR_MEMORY;
+        }
+        size_t take = HUFFMAN_BLOCK_SIZE - stream->block_len;
+        if (take > remaining) {
+            take = remaining;
+        }
+        memcpy(stream->block + stream->block_len, p, take);
+        stream->block_len += take;
+        *consumed += take;
+
+        if (stream->block_len == HUFFMAN_BLOCK_SIZE) {
+            FpStatus status = emit_frame(stream, stream->block, stream->block_len);
+            stream->block_len = 0;
+            if (status != FP_OK) {
+                return status;
+            }
+        }
+    }
+    return FP_OK;
+}
+
+// Appends input in the original format, which is only decoded at the end
+static FpStatus collect_single_block(FpStream* stream, const char* data, size_t len) {
+    size_t needed = stream->block_len + len;
+    if (needed > stream->block_capacity) {
+        size_t capacity = stream->block_capacity * 2;
+        if (!reserve_scratch(&stream->block, &stream->block_capacity,
+                             capacity > needed ? capacity : needed)) {
+            return FP_ERROR_MEMORY;
+        }
+    }
+    memcpy(stream->block + stream->block_len, data, len);
+    stream->block_len += len;
+    return FP_OK;
+}
+
+// Takes bytes of the length that starts a frame: 4 in FPH1 streams, else a
+// varint, which ends at the first byte without the high bit
+static FpStatus collect_frame_length(FpStream* stream, const char* data, size_t len, size_t* consumed) {
+    size_t i = 0;
+    int complete = 0;
+    while (i < len && !complete) {
+        unsigned char c = (unsigned char)data[i++];
+        stream->header[stream->header_len++] = c;
+        complete = stream->framed == 1 ? stream->header_len == 4
+                                       : !(c & 0x80) || stream->header_len == HUFFMAN_MAX_VARINT_LEN;
+    }
+    *consumed += i;
+    if (!complete) {
+        return FP_OK;
+    }
+
+    uint64_t frame_len;
+    if (stream->framed == 1) {
+        frame_len = get_frame_length(stream->header);
+    } else if (!get_varint(stream->header, stream->header_len, &frame_len)) {
+        frame_len = (uint64_t)HUFFMAN_MAX_FRAME_SIZE + 1;
+    }
+    if (frame_len > HUFFMAN_MAX_FRAME_SIZE) {
+        handle_error("Corrupt frame length in compressed stream.");
+        return FP_ERROR_CORRUPT;
+    }
+    stream->frame_len = (size_t)frame_len;
+    stream->frame_started = 1;
+    if (frame_len == 0) {
+        stream->ended = 1;
+    }
+    return FP_OK;
+}
+
+static FpStatus decompress_feed(FpStream* stream, const char* data, size_t len, size_t* consumed) {
+    while (*consumed < len && pending_room(stream->pending) > 0) {
+        const char* p = data + *consumed;
+        size_t remaining = len - *consumed;
+
+        if (stream->framed < 0) {
+            // The magic bytes decide the format
+            size_t take = HUFFMAN_FRAME_MAGIC_LEN - stream->header_len;
+            if (take > remaining) {
+                take = remaining;
+            }
+            memcpy(stream->header + stream->header_len, p, take);
+            stream->header_len += take;
+            *consumed += take;
+            if (stream->header_len == HUFFMAN_FRAME_MAGIC_LEN) {
+                if (memcmp(stream->header, HUFFMAN_FRAME_MAGIC, HUFFMAN_FRAME_MAGIC_LEN) == 0) {
+                    stream->framed = 2;
+                } else if (memcmp(stream->header, HUFFMAN_CONTEXT_FRAME_MAGIC, HUFFMAN_FRAME_MAGIC_LEN) == 0) {
+                    stream->framed = 3;
+                } else if (memcmp(stream->header, HUFFMAN_FRAME_MAGIC_V1, HUFFMAN_FRAME_MAGIC_LEN) == 0) {
+                    stream->framed = 1;
+                } else {
+                    stream->framed = 0;
+                }
+                stream->header_len = 0;
+                if (!stream->framed) {
+                    FpStatus status = collect_single_block(stream, (const char*)stream->header,
+                                                           HUFFMAN_FRAME_MAGIC_LEN);
+                    if (status != FP_OK) {
+                        return status;
+                    }
+                }
+            }
+        } else if (!stream->framed) {
+            FpStatus status = collect_single_block(stream, p, remaining);
+            if (status != FP_OK) {
+                return status;
+            }
+            *consumed = len;
+        } else if (stream->ended) {
+            *consumed = len; // Anything after the end marker is ignored, as in the command line
+        } else if (!stream->frame_started) {
+            FpStatus status = collect_frame_length(stream, p, remaining, consumed);
+            if (status != FP_OK) {
+                return status;
+            }
+        } else {
+            // Collect the frame, then decode it into pending output
+            if (!reserve_scratch(&stream->block, &stream->block_capacity, stream->frame_len)) {
+                return FP_ERROR_MEMORY;
+            }
+            size_t take = stream->frame_len - stream->block_len;
+            if (take > remaining) {
+                take = remaining;
+            }
+            memcpy(stream->block + stream->block_len, p, take);
+            stream->block_len += take;
+            *consumed += take;
+
+            if (stream->block_len == stream->frame_len) {
+                size_t block_len;
+                char* block = stream->framed == 1
+                                  ? huffman_decompress_legacy(stream->block, stream->block_len, &block_len)
+                              : stream->framed == 3
+                                  ? context_decompress(stream->block, stream->block_len, &block_len)
+                                  : huffman_decompress(stream->block, stream->block_len, &block_len);
+                if (!block) {
+                    return FP_ERROR_CORRUPT;
+                }
+                int ok = output_buffer_write(stream->pending, block, block_len);
+                free(block);
+                if (!ok) {
+                    return FP_ERROR_MEMORY;
+                }
+                stream->block_len = 0;
+                stream->header_len = 0;
+                stream->frame_started = 0;
+            }
+        }
+    }
+    return FP_OK;
+}
+
+static FpStatus cipher_feed(FpStream* stream, const char* data, size_t len, size_t* consumed) {
+    size_t take = pending_room(stream->pending);
+    if (take > len) {
+        take = len;
+    }
+    if (take == 0) {
+        return FP_OK;
+    }
+    if (!output_buffer_write(stream->pending, data, take)) {
+        return FP_ERROR_MEMORY;
+    }
+    xor_apply(stream->pending->data + stream->pending->size - take, take,
+              stream->key, stream->key_len, stream->position);
+    stream->position += take;
+    *consumed = take;
+    return FP_OK;
+}
+
+FpStatus fp_stream_feed(FpStream* stream, const char* data, size_t len, size_t* consumed) {
+    if (consumed) {
+        *consumed = 0;
+    }
+    if (!stream || !consumed || (!data && len > 0)) {
+        return FP_ERROR_ARGUMENT;
+    }
+    if (stream->status != FP_OK) {
+        return stream->status;
+    }
+    if (stream->finished) {
+        return FP_ERROR_ARGUMENT;
+    }
+
+    switch (stream->operation) {
+        case FP_COMPRESS:
+        case FP_COMPRESS_CONTEXT:
+            stream->status = compress_feed(stream, data, len, consumed);
+            break;
+        case FP_DECOMPRESS:
+            stream->status = decompress_feed(stream, data, len, consumed);
+            break;
+        default:
+            stream->status = cipher_feed(stream, data, len, consumed);
+            break;
+    }
+    return stream->status;
+}
+
+FpStatus fp_stream_apply(FpStream* stream, char* data, size_t len) {
+    if (!stream || (!data && len > 0) || stream->finished ||
+        (stream->operation != FP_ENCRYPT && stream->operation != FP_DECRYPT)) {
+        return FP_ERROR_ARGUMENT;
+    }
+    xor_apply(data, len, stream->key, stream->key_len, stream->position);
+    stream->position += len;
+    return FP_OK;
+}
+
+FpStatus fp_stream_drain(FpStream* stream, char* output, size_t capacity, size_t* produced) {
+    if (produced) {
+        *produced = 0;
+    }
+    if (!stream || !produced || (!output && capacity > 0)) {
+        return FP_ERROR_ARGUMENT;
+    }
+    // Output decoded before an error is still delivered
+    *produced = output_buffer_drain(stream->pending, output, capacity);
+    return stream->status;
+}
+
+FpStatus fp_stream_finish(FpStream* stream) {
+    if (!stream) {
+        return FP_ERROR_ARGUMENT;
+    }
+    if (stream->status != FP_OK || stream->finished) {
+        return stream->status;
+    }
+    stream->finished = 1;
+
+    if (stream->operation == FP_COMPRESS || stream->operation == FP_COMPRESS_CONTEXT) {
+        if (stream->block_len > 0) {
+            stream->status = emit_frame(stream, stream->block, stream->block_len);
+            stream->block_len = 0;
+        }
+        // A zero length marks the end of the stream
+        if (stream->status == FP_OK && !output_buffer_write(stream->pending, "", 1)) {
+            stream->status = FP_ERROR_MEMORY;
+        }
+    } else if (stream->operation == FP_DECOMPRESS) {
+        if (stream->framed < 0 && stream->header_len > 0) {
+            // Shorter than the magic, so it can only be the original format
+            stream->framed = 0;
+            stream->status = collect_single_block(stream, (const char*)stream->header, stream->header_len);
+        }
+
+        if (stream->status != FP_OK) {
+            // Nothing more to do
+        } else if (stream->framed > 0 && !stream->ended) {
+            handle_error("Truncated compressed stream.");
+            stream->status = FP_ERROR_CORRUPT;
+        } else if (stream->framed <= 0) {
+            size_t output_len;
+            char* decompressed = huffman_decompress_legacy(stream->block ? stream->block : "",
+                                                           stream->block_len, &output_len);
+            if (!decompressed) {
+                stream->status = FP_ERROR_CORRUPT;
+            } else {
+                if (!output_buffer_write(stream->pending, decompressed, output_len)) {
+                    stream->status = FP_ERROR_MEMORY;
+                }
+                free(decompressed);
+            }
+        }
+    }
+    return stream->status;
+}
+
+size_t fp_stream_pending(const FpStream* stream) {
+    return stream ? pending_size(stream->pending) : 0;
+}
+
+void fp_free_stream(FpStream* stream) {
+    if (stream) {
+        free_output_buffer(stream->pending);
+        free(stream->key);
+        free(stream->block);
+        free(stream);
+    }
+}
+
+// --- Search ---
+
+FpSearch* fp_create_search(const char* keyword, const SearchOptions* options,
+                           const char* label, FpStatus* status) {
+    FpStatus result = FP_OK;
+    FpSearch* search = NULL;
+
+    if (!keyword || !options) {
+        handle_error("Invalid input for search");
+        result = FP_ERROR_ARGUMENT;
+    } else if (!(search = calloc(1, sizeof(FpSearch))) ||
+               !(search->pending = create_memory_output_buffer(STREAM_CHUNK_SIZE)) ||
+               !(search->keyword = my_strdup(keyword)) ||
+               (label && !(search->label = my_strdup(label))) ||
+               !(search->ctx = create_search_context(search->keyword, options, search->label,
+                                                     search->pending))) {
+        if (!search) {
+            handle_memory_error();
+        }
+        fp_free_search(search);
+        search = NULL;
+        result = FP_ERROR_MEMORY;
+    }
+
+    if (status) {
+        *status = result;
+    }
+    return search;
+}
+
+FpStatus fp_search_feed(FpSearch* search, const char* data, size_t len, size_t* consumed) {
+    if (consumed) {
+        *consumed = 0;
+    }
+    if (!search || !consumed || (!data && len > 0)) {
+        return FP_ERROR_ARGUMENT;
+    }
+    if (search->status != FP_OK) {
+        return search->status;
+    }
+    if (search->finished) {
+        return FP_ERROR_ARGUMENT;
+    }
+
+    // Matches are written in pieces so pending output stays near the limit
+    while (*consumed < len && pending_room(search->pending) > 0) {
+        if (search->ctx->done) {
+            *consumed = len;
+            break;
+        }
+        size_t take = len - *consumed;
+        if (take > STREAM_CHUNK_SIZE) {
+            take = STREAM_CHUNK_SIZE;
+        }
+        // search_feed also returns 0 once the answer is known, which is not an error
+        if ((!search_feed(search->ctx, data + *consumed, take) && !search->ctx->done) ||
+            search->pending->failed) {
+            search->status = FP_ERROR_MEMORY;
+            break;
+        }
+        *consumed += take;
+    }
+    return search->status;
+}
+
+int fp_search_done(const FpSearch* search) {
+    return search && search->ctx->done;
+}
+
+FpStatus fp_search_drain(FpSearch* search, char* output, size_t capacity, size_t* produced) {
+    if (produced) {
+        *produced = 0;
+    }
+    if (!search || !produced || (!output && capacity > 0)) {
+        return FP_ERROR_ARGUMENT;
+    }
+    *produced = output_buffer_drain(search->pending, output, capacity);
+    return search->status;
+}
+
+FpStatus fp_search_finish(FpSearch* search, size_t* match_count) {
+    if (!search) {
+        return FP_ERROR_ARGUMENT;
+    }
+    if (search->status == FP_OK && !search->finished) {
+        search->finished = 1;
+        search_finish(search->ctx);
+        if (search->pending->failed) {
+            search->status = FP_ERROR_MEMORY;
+        }
+    }
+    if (match_count) {
+        *match_count = search->ctx->match_count;
+    }
+    return search->status;
+}
+
+void fp_free_search(FpSearch* search) {
+    if (search) {
+        free_search_context(search->ctx);
+        free_output_buffer(search->pending);
+        free(search->keyword);
+        free(search->label);
+        free(search);
+    }
+}
+
+// --- Sort ---
+
+FpStatus fp_sort(const char* text, size_t len, const SortOptions* options, size_t threads,
+                 char* output, size_t capacity, size_t* produced) {
+    if (produced) {
+        *produced = 0;
+    }
+    if (!text || !produced || (!output && capacity > 0)) {
+        return FP_ERROR_ARGUMENT;
+    }
+
+    SortOptions plain;
+    memset(&plain, 0, sizeof(plain));
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    LineArray* lines = split_into_lines(text, len, threads);
+    if (!lines) {
+        return FP_ERROR_MEMORY;
+    }
+    FpStatus status = FP_OK;
+    size_t needed = 0;
+    if (!sort_lines_with_options(lines, options ? options : &plain, threads)) {
+        status = FP_ERROR_MEMORY;
+    } else if ((needed = joined_lines_size(lines)) > capacity) {
+        *produced = needed;
+        status = FP_ERROR_BUFFER_TOO_SMALL;
+    } else {
+        *produced = join_lines_into(lines, output);
+    }
+    free_line_array(lines);
+    return status;
+}
@@ -1,7 +1,37 @@
+#define _DEFAULT_SOURCE
+
 #include "../include/io.h"
+#include "../include/asyncio.h"
+#include "../include/stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define READ_CHUNK_SIZE (1024 * 1024)
+
+// Standard streams of the calling thread; NULL means the process's own
+static __thread FILE* thread_input;
+static __thread FILE* thread_output;
+static __thread FILE* thread_error;
+
+// Off by default so a program linking the library gets an error back instead
+static int exit_on_memory_error;
+
+// Whether a whole file can be held in memory, so its size fits in size_t
+static int file_size_fits(off_t size) {
+#if SIZE_MAX < INT64_MAX
+    return (uint64_t)size <= SIZE_MAX;
+#else
+    (void)size;
+    return 1;
+#endif
+}
 
 char* read_file(const char* filename, size_t* file_size) {
     FILE* file = fopen(filename, "rb");
@@ -10,10 +40,14 @@ char* read_file(const char* filename, size_t* file_size) {
         return NULL;
     }
 
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    *file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    // Get file size; ftell's long is 32 bits on some hosts
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || !file_size_fits(st.st_size)) {
+        handle_error("Failed to read file");
+        fclose(file);
+        return NULL;
+    }
+    *file_size = (size_t)st.st_size;
 
     // Allocate buffer
     char* buffer = malloc(*file_size + 1);
@@ -24,7 +58,9 @@ char* read_file(const char* filename, size_t* file_size) {
     }
 
     // Read file
+    STATS_BEGIN(read_mark);
     size_t bytes_read = fread(buffer, 1, *file_size, file);
+    STATS_END(read_mark, STATS_READ, bytes_read);
     if (bytes_read != *file_size) {
         handle_error("Failed to read file");
         free(buffer);
@@ -37,31 +73,536 @@ char* read_file(const char* filename, size_t* file_size) {
     return buffer;
 }
 
+// Reads a descriptor that cannot be mapped until end of file
+static char* read_all(int fd, size_t* size) {
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t used = 0;
+    char* buffer = malloc(capacity + 1);
+    if (!buffer) {
+        handle_memory_error();
+        return NULL;
+    }
+
+    for (;;) {
+        if (used == capacity) {
+            char* grown = realloc(buffer, capacity * 2 + 1);
+            if (!grown) {
+                handle_memory_error();
+                free(buffer);
+                return NULL;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+
+        ssize_t bytes_read = read(fd, buffer + used, capacity - used);
+        if (bytes_read == 0) {
+            break;
+        }
+        if (bytes_read < 0) {
+            handle_error("Failed to read file");
+            free(buffer);
+            return NULL;
+        }
+        used += (size_t)bytes_read;
+    }
+
+    buffer[used] = '\0';
+    *size = used;
+    return buffer;
+}
+
+// Reads a stream without a descriptor, such as a redirected thread stdin
+static char* read_all_stream(FILE* file, size_t* size) {
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t used = 0;
+    char* buffer = malloc(capacity + 1);
+    if (!buffer) {
+        handle_memory_error();
+        return NULL;
+    }
+
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer + used, 1, capacity - used, file)) > 0) {
+        used += bytes_read;
+        if (used == capacity) {
+            char* grown = realloc(buffer, capacity * 2 + 1);
+            if (!grown) {
+                handle_memory_error();
+                free(buffer);
+                return NULL;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+    }
+    if (ferror(file)) {
+        handle_error("Failed to read file");
+        free(buffer);
+        return NULL;
+    }
+
+    buffer[used] = '\0';
+    *size = used;
+    return buffer;
+}
+
+/*
+ * Maps a regular file read-only. Large files are placed on a huge page
+ * boundary so transparent huge pages can back the mapping, and the kernel
+ * is told the file will be read sequentially so it reads ahead aggressively.
+ */
+static int map_regular_file(int fd, size_t size, InputFile* input) {
+    char* base = NULL;
+    size_t reserved = 0;
+
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGE_PAGE_SIZE) {
+        // Reserve address space with room to align, then map over it
+        reserved = size + HUGE_PAGE_SIZE;
+        base = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            base = NULL;
+            reserved = 0;
+        }
+    }
+#endif
+
+    char* data;
+    if (base) {
+        char* aligned = (char*)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        data = mmap(aligned, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+        if (data == MAP_FAILED) {
+            munmap(base, reserved);
+            return 0;
+        }
+        // Give back the unused parts of the reservation
+        if (aligned > base) {
+            munmap(base, aligned - base);
+        }
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        char* tail = aligned + ((size + page - 1) & ~(page - 1));
+        if (tail < base + reserved) {
+            munmap(tail, base + reserved - tail);
+        }
+    } else {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            return 0;
+        }
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(data, size, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGE_PAGE_SIZE) {
+        madvise(data, size, MADV_HUGEPAGE);
+    }
+#endif
+
+    input->data = data;
+    input->size = size;
+    input->mapped = 1;
+    input->mapping = data;
+    input->mapping_size = size;
+    return 1;
+}
+
+InputFile* open_input_file(const char* filename) {
+    int use_stdin = is_stdio_name(filename);
+    if (use_stdin && thread_input) {
+        InputFile* input = calloc(1, sizeof(InputFile));
+        if (!input) {
+            handle_memory_error();
+            return NULL;
+        }
+        STATS_BEGIN(read_mark);
+        char* buffer = read_all_stream(thread_input, &input->size);
+        STATS_END(read_mark, STATS_READ, buffer ? input->size : 0);
+        if (!buffer) {
+            free(input);
+            return NULL;
+        }
+        input->data = buffer;
+        return input;
+    }
+
+    int fd = use_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0) {
+        handle_error("Failed to open input file");
+        return NULL;
+    }
+
+    InputFile* input = malloc(sizeof(InputFile));
+    if (!input) {
+        handle_memory_error();
+        if (!use_stdin) {
+            close(fd);
+        }
+        return NULL;
+    }
+    input->mapped = 0;
+    input->mapping = NULL;
+    input->mapping_size = 0;
+
+    // Standard input redirected from a regular file is mapped like any other
+    STATS_BEGIN(read_mark);
+    struct stat st;
+    int is_regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    int mapped = is_regular && st.st_size > 0 && file_size_fits(st.st_size) &&
+                 map_regular_file(fd, (size_t)st.st_size, input);
+
+    // Empty files, pipes and special files are read into a buffer
+    char* buffer = mapped ? NULL : read_all(fd, &input->size);
+    STATS_END(read_mark, STATS_READ, mapped || buffer ? input->size : 0);
+    if (!use_stdin) {
+        close(fd);
+    }
+    if (mapped) {
+        return input;
+    }
+    if (!buffer) {
+        free(input);
+        return NULL;
+    }
+    input->data = buffer;
+    return input;
+}
+
+void close_input_file(InputFile* input) {
+    if (input) {
+        if (input->mapped) {
+            munmap(input->mapping, input->mapping_size);
+        } else {
+            free((char*)input->data);
+        }
+        free(input);
+    }
+}
+
 int write_file(const char* filename, const char* data, size_t data_size) {
-    FILE* file = fopen(filename, "wb");
+    FILE* file = open_output_stream(filename);
     if (!file) {
-        handle_error("Failed to open output file");
         return 0;
     }
 
+    STATS_BEGIN(write_mark);
     size_t bytes_written = fwrite(data, 1, data_size, file);
+    STATS_END(write_mark, STATS_WRITE, bytes_written);
     if (bytes_written != data_size) {
         handle_error("Failed to write file");
-        fclose(file);
+        close_stream(file);
         return 0;
     }
 
-    fclose(file);
+    if (close_stream(file) != 0) {
+        handle_error("Failed to write file");
+        return 0;
+    }
+    return 1;
+}
+
+int is_stdio_name(const char* filename) {
+    return filename && strcmp(filename, "-") == 0;
+}
+
+void redirect_thread_stdio(FILE* input, FILE* output, FILE* error) {
+    thread_input = input;
+    thread_output = output;
+    thread_error = error;
+}
+
+FILE* thread_stdin(void) {
+    return thread_input ? thread_input : stdin;
+}
+
+FILE* thread_stdout(void) {
+    return thread_output ? thread_output : stdout;
+}
+
+FILE* thread_stderr(void) {
+    return thread_error ? thread_error : stderr;
+}
+
+FILE* open_input_stream(const char* filename) {
+    if (is_stdio_name(filename)) {
+        return thread_stdin();
+    }
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        handle_error("Failed to open input file");
+    }
+    return file;
+}
+
+FILE* open_output_stream(const char* filename) {
+    if (is_stdio_name(filename)) {
+        return thread_stdout();
+    }
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        handle_error("Failed to open output file");
+    }
+    return file;
+}
+
+int close_stream(FILE* file) {
+    if (file == thread_stdin()) {
+        return 0;
+    }
+    if (file == thread_stdout()) {
+        return (fflush(file) != 0 || ferror(file)) ? EOF : 0;
+    }
+    return fclose(file);
+}
+
+OutputBuffer* create_output_buffer(FILE* file, size_t capacity) {
+    OutputBuffer* out = malloc(sizeof(OutputBuffer));
+    if (!out) {
+        handle_memory_error();
+        return NULL;
+    }
+
+    out->data = malloc(capacity);
+    if (!out->data) {
+        handle_memory_error();
+        free(out);
+        return NULL;
+    }
+
+    out->file = file;
+    out->size = 0;
+    out->start = 0;
+    out->capacity = capacity;
+    out->writer = NULL;
+    out->failed = 0;
+    out->borrowed = 0;
+    return out;
+}
+
+OutputBuffer* create_memory_output_buffer(size_t capacity) {
+    return create_output_buffer(NULL, capacity > 0 ? capacity : 1);
+}
+
+OutputBuffer* create_async_output_buffer(FILE* file, size_t capacity, Workspace* workspace) {
+    OutputBuffer* out = malloc(sizeof(OutputBuffer));
+    if (!out) {
+        handle_memory_error();
+        return NULL;
+    }
+
+    out->file = file;
+    out->size = 0;
+    out->start = 0;
+    out->capacity = capacity;
+    out->failed = 0;
+    out->borrowed = workspace != NULL;
+    out->writer = NULL;
+
+    // A worker pool already overlaps I/O across files, so workers write synchronously
+    if (workspace) {
+        out->data = reserve_scratch(&workspace->output, &workspace->output_capacity, capacity);
+        if (!out->data) {
+            free(out);
+            return NULL;
+        }
+        return out;
+    }
+
+    out->writer = create_async_writer(file, capacity);
+    if (!out->writer) {
+        free(out);
+        return NULL;
+    }
+
+    out->data = async_writer_acquire(out->writer);
+    return out;
+}
+
+// Hands the buffered bytes to the writer thread, or writes them directly
+static int emit_output(OutputBuffer* out) {
+    if (out->failed) {
+        out->size = 0;
+        return 0;
+    }
+
+    int ok;
+    if (out->writer) {
+        ok = async_writer_submit(out->writer, out->size);
+        out->data = async_writer_acquire(out->writer);
+    } else {
+        STATS_BEGIN(write_mark);
+        ok = fwrite(out->data, 1, out->size, out->file) == out->size;
+        STATS_END(write_mark, STATS_WRITE, out->size);
+    }
+    out->size = 0;
+    if (!ok) {
+        handle_error("Failed to write output");
+        out->failed = 1;
+    }
+    return ok;
+}
+
+// Makes room in a memory buffer for size bytes, dropping drained bytes first
+static int grow_output_buffer(OutputBuffer* out, size_t size) {
+    if (out->start > 0) {
+        memmove(out->data, out->data + out->start, out->size - out->start);
+        size -= out->start;
+        out->size -= out->start;
+        out->start = 0;
+        if (size <= out->capacity) {
+            return 1;
+        }
+    }
+
+    size_t capacity = out->capacity;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    char* grown = realloc(out->data, capacity);
+    if (!grown) {
+        handle_memory_error();
+        out->failed = 1;
+        return 0;
+    }
+    out->data = grown;
+    out->capacity = capacity;
+    return 1;
+}
+
+int output_buffer_write(OutputBuffer* out, const char* data, size_t len) {
+    if (!out->file) {
+        if (out->failed || (out->size + len > out->capacity && !grow_output_buffer(out, out->size + len))) {
+            return 0;
+        }
+    } else if (out->size + len > out->capacity) {
+        if (out->size > 0 && !emit_output(out)) {
+            return 0;
+        }
+        if (len > out->capacity) {
+            if (!out->writer) {
+                // Writes larger than the buffer bypass it
+                if (out->failed) {
+                    return 0;
+                }
+                STATS_BEGIN(write_mark);
+                size_t written = fwrite(data, 1, len, out->file);
+                STATS_END(write_mark, STATS_WRITE, written);
+                if (written != len) {
+                    handle_error("Failed to write output");
+                    out->failed = 1;
+                    return 0;
+                }
+                return 1;
+            }
+            // The writer thread owns the stream, so large writes go through it in pieces
+            while (len > out->capacity) {
+                memcpy(out->data, data, out->capacity);
+                out->size = out->capacity;
+                if (!emit_output(out)) {
+                    return 0;
+                }
+                data += out->capacity;
+                len -= out->capacity;
+            }
+        }
+    }
+
+    memcpy(out->data + out->size, data, len);
+    out->size += len;
+    return 1;
+}
+
+int flush_output_buffer(OutputBuffer* out) {
+    if (!out->file) {
+        return !out->failed; // Memory buffers are emptied by output_buffer_drain
+    }
+    if (out->size > 0 && !emit_output(out)) {
+        return 0;
+    }
+    if (out->failed) {
+        return 0;
+    }
+    if (out->writer && !async_writer_wait(out->writer)) {
+        handle_error("Failed to write output");
+        out->failed = 1;
+        return 0;
+    }
     return 1;
 }
 
+void free_output_buffer(OutputBuffer* out) {
+    if (out) {
+        flush_output_buffer(out);
+        if (out->writer) {
+            finish_async_writer(out->writer); // Owns the buffers
+        } else if (!out->borrowed) {
+            free(out->data);
+        }
+        if (out->file) {
+            fflush(out->file);
+        }
+        free(out);
+    }
+}
+
+size_t output_buffer_drain(OutputBuffer* out, char* dest, size_t capacity) {
+    size_t len = out->size - out->start;
+    if (len > capacity) {
+        len = capacity;
+    }
+    memcpy(dest, out->data + out->start, len);
+    out->start += len;
+    if (out->start == out->size) {
+        out->start = out->size = 0;
+    }
+    return len;
+}
+
+Workspace* create_workspace(void) {
+    Workspace* workspace = calloc(1, sizeof(Workspace));
+    if (!workspace) {
+        handle_memory_error();
+    }
+    return workspace;
+}
+
+void free_workspace(Workspace* workspace) {
+    if (workspace) {
+        free(workspace->input);
+        free(workspace->output);
+        free(workspace->frame);
+        free(workspace);
+    }
+}
+
+char* reserve_scratch(char** buffer, size_t* capacity, size_t size) {
+    if (*capacity < size) {
+        char* grown = realloc(*buffer, size);
+        if (!grown) {
+            handle_memory_error();
+            return NULL;
+        }
+        *buffer = grown;
+        *capacity = size;
+    }
+    return *buffer;
+}
+
 void handle_error(const char* message) {
-    fprintf(stderr, "Error: %s\n", message);
+    fprintf(thread_stderr(), "Error: %s\n", message);
+}
+
+void set_memory_error_exit(int enabled) {
+    exit_on_memory_error = enabled;
 }
 
 void handle_memory_error(void) {
-    fprintf(stderr, "Memory allocation error\n");
-    exit(EXIT_FAILURE);
+    fprintf(thread_stderr(), "Memory allocation error\n");
+    if (exit_on_memory_error) {
+        exit(EXIT_FAILURE);
+    }
 }
 
 // Custom string duplication function for C99 compatibility
@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/lineindex.h"
+#include "../include/cpu.h"
+#include "../include/io.h"
+#include "../include/stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define PARALLEL_INDEX_MIN_BYTES (8 * 1024 * 1024)
+#define MAX_INDEX_THREADS 64
+
+// Newline offsets of one chunk of the text
+typedef struct {
+    const char* text;
+    size_t start;
+    size_t end;
+    void* offsets;
+    int wide;
+    size_t count;
+    size_t capacity;
+    int failed;
+    uint64_t cpu_ns;     // CPU time of the scanning thread, for --stats
+} IndexChunk;
+
+static int reserve_offsets(IndexChunk* chunk, size_t extra) {
+    if (chunk->count + extra <= chunk->capacity) {
+        return 1;
+    }
+
+    size_t new_capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+    while (new_capacity < chunk->count + extra) {
+        new_capacity *= 2;
+    }
+    void* grown = realloc(chunk->offsets, new_capacity * (chunk->wide ? 8 : 4));
+    if (!grown) {
+        handle_memory_error();
+        chunk->failed = 1;
+        return 0;
+    }
+    chunk->offsets = grown;
+    chunk->capacity = new_capacity;
+    return 1;
+}
+
+static inline void append_offset(IndexChunk* chunk, size_t offset) {
+    if (chunk->wide) {
+        ((uint64_t*)chunk->offsets)[chunk->count++] = offset;
+    } else {
+        ((uint32_t*)chunk->offsets)[chunk->count++] = (uint32_t)offset;
+    }
+}
+
+// Compares 64 bytes at a time with the dispatched byte_mask kernel and walks
+// the set bits of the match mask
+static void* scan_chunk(void* arg) {
+    IndexChunk* chunk = arg;
+    const char* text = chunk->text;
+    size_t i = chunk->start;
+
+    uint64_t (*byte_mask)(const char*, char) = cpu_kernels()->byte_mask;
+    for (; i + 64 <= chunk->end; i += 64) {
+        uint64_t mask = byte_mask(text + i, '\n');
+        if (!mask) {
+            continue;
+        }
+        if (!reserve_offsets(chunk, (size_t)__builtin_popcountll(mask))) {
+            return NULL;
+        }
+        while (mask) {
+            append_offset(chunk, i + (size_t)__builtin_ctzll(mask));
+            mask &= mask - 1;
+        }
+    }
+
+    for (; i < chunk->end; i++) {
+        const char* nl = memchr(text + i, '\n', chunk->end - i);
+        if (!nl) {
+            break;
+        }
+        if (!reserve_offsets(chunk, 1)) {
+            return NULL;
+        }
+        i = nl - text;
+        append_offset(chunk, i);
+    }
+    return NULL;
+}
+
+static void* scan_chunk_thread(void* arg) {
+    IndexChunk* chunk = arg;
+    scan_chunk(chunk);
+    chunk->cpu_ns = STATS_THREAD_CPU();
+    return NULL;
+}
+
+static void finish_index(LineIndex* index) {
+    index->count = index->newlines;
+    if (index->text_len > 0 &&
+        (index->newlines == 0 || line_index_newline(index, index->newlines - 1) != index->text_len - 1)) {
+        index->count++; // Last line without a trailing newline
+    }
+    index->crlf = index->newlines > 0 && line_index_newline(index, 0) > 0 &&
+                  index->text[line_index_newline(index, 0) - 1] == '\r';
+}
+
+int rebuild_line_index(LineIndex* index, const char* text, size_t text_len) {
+    IndexChunk chunk;
+    chunk.text = text;
+    chunk.start = 0;
+    chunk.end = text_len;
+    chunk.offsets = index->offsets;
+    chunk.wide = text_len > UINT32_MAX;
+    chunk.count = 0;
+    chunk.capacity = chunk.wide == index->wide ? index->capacity : 0;
+    chunk.failed = 0;
+
+    if (chunk.wide != index->wide) {
+        free(chunk.offsets);
+        chunk.offsets = NULL;
+    }
+    scan_chunk(&chunk);
+
+    index->text = text;
+    index->text_len = text_len;
+    index->offsets = chunk.offsets;
+    index->wide = chunk.wide;
+    index->capacity = chunk.capacity;
+    index->newlines = chunk.count;
+    if (chunk.failed) {
+        index->newlines = 0;
+        index->count = 0;
+        return 0;
+    }
+    finish_index(index);
+    return 1;
+}
+
+static int build_parallel(LineIndex* index, size_t threads) {
+    IndexChunk chunks[MAX_INDEX_THREADS];
+    pthread_t workers[MAX_INDEX_THREADS];
+    int started[MAX_INDEX_THREADS];
+
+    for (size_t t = 0; t < threads; t++) {
+        chunks[t].text = index->text;
+        chunks[t].start = index->text_len * t / threads;
+        chunks[t].end = index->text_len * (t + 1) / threads;
+        chunks[t].offsets = NULL;
+        chunks[t].wide = index->wide;
+        chunks[t].count = 0;
+        chunks[t].capacity = 0;
+        chunks[t].failed = 0;
+        chunks[t].cpu_ns = 0;
+        started[t] = pthread_create(&workers[t], NULL, scan_chunk_thread, &chunks[t]) == 0;
+        if (!started[t]) {
+            scan_chunk(&chunks[t]);
+        }
+    }
+
+    size_t total = 0;
+    int failed = 0;
+    for (size_t t = 0; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(workers[t], NULL);
+            STATS_ADD_HELPER_CPU(chunks[t].cpu_ns);
+        }
+        total += chunks[t].count;
+        failed |= chunks[t].failed;
+    }
+
+    size_t width = index->wide ? 8 : 4;
+    index->offsets = failed ? NULL : malloc((total ? total : 1) * width);
+    if (!index->offsets && !failed) {
+        handle_memory_error();
+        failed = 1;
+    }
+
+    size_t pos = 0;
+    for (size_t t = 0; t < threads; t++) {
+        if (!failed) {
+            memcpy((char*)index->offsets + pos * width, chunks[t].offsets, chunks[t].count * width);
+            pos += chunks[t].count;
+        }
+        free(chunks[t].offsets);
+    }
+    index->newlines = total;
+    index->capacity = total;
+    return !failed;
+}
+
+LineIndex* build_line_index(const char* text, size_t text_len, size_t threads) {
+    if (!text && text_len > 0) {
+        handle_error("Invalid input for line indexing");
+        return NULL;
+    }
+
+    LineIndex* index = malloc(sizeof(LineIndex));
+    if (!index) {
+        handle_memory_error();
+        return NULL;
+    }
+    index->text = text;
+    index->text_len = text_len;
+    index->offsets = NULL;
+    index->wide = text_len > UINT32_MAX;
+    index->newlines = 0;
+    index->count = 0;
+    index->capacity = 0;
+    index->crlf = 0;
+
+    if (threads > MAX_INDEX_THREADS) {
+        threads = MAX_INDEX_THREADS;
+    }
+
+    int ok;
+    if (threads > 1 && text_len >= PARALLEL_INDEX_MIN_BYTES) {
+        ok = build_parallel(index, threads);
+        if (ok) {
+            finish_index(index);
+        }
+    } else {
+        ok = rebuild_line_index(index, text, text_len);
+    }
+
+    if (!ok) {
+        free_line_index(index);
+        return NULL;
+    }
+    return index;
+}
+
+size_t line_index_find(const LineIndex* index, size_t offset) {
+    // First newline at or after offset
+    size_t lo = 0, hi = index->newlines;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (line_index_newline(index, mid) < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void free_line_index(LineIndex* index) {
+    if (index) {
+        free(index->offsets);
+        free(index);
+    }
+}
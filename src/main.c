@@ -1,13 +1,39 @@
+#include "../include/batch.h"
 #include "../include/cli.h"
-#include "../include/compress.h"
-#include "../include/encrypt.h"
 #include "../include/io.h"
-#include "../include/search.h"
-#include "../include/sort.h"
+#include "../include/process.h"
+#include "../include/server.h"
+#include "../include/stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifndef FP_NO_STATS
+// The Makefile links the program with --wrap=malloc,calloc,realloc so that
+// --stats can count the allocations made by our own code
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    stats_note_allocation();
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    stats_note_allocation();
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    stats_note_allocation();
+    return __real_realloc(ptr, size);
+}
+#endif
+
 int main(int argc, char** argv) {
+    // A one-shot run has nothing to recover on running out of memory
+    set_memory_error_exit(1);
+
     // Parse command line arguments
     Options* opts = parse_cli(argc, argv);
     if (!opts) {
@@ -20,67 +46,37 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    // Read input file
-    size_t input_size;
-    char* input_data = read_file(opts->input_file, &input_size);
-    if (!input_data) {
+#ifdef FP_NO_STATS
+    if (opts->stats) {
+        handle_error("This build has no --stats support (built with STATS=0)");
         free_options(opts);
         return 1;
     }
+#else
+    if (opts->stats) {
+        stats_enable();
+    }
+#endif
 
-    size_t output_size;
-    char* output_data = NULL;
-    int result = 0;
-
-    // Process based on mode
-    switch (opts->mode) {
-        case MODE_COMPRESS:
-            output_data = huffman_compress(input_data, input_size, &output_size);
-            break;
-        case MODE_DECOMPRESS:
-            output_data = huffman_decompress(input_data, input_size, &output_size);
-            break;
-        case MODE_ENCRYPT:
-            output_data = xor_encrypt(input_data, input_size, opts->key, &output_size);
-            break;
-        case MODE_DECRYPT:
-            output_data = xor_decrypt(input_data, input_size, opts->key, &output_size);
-            break;
-        case MODE_SEARCH: {
-            SearchResult* results = search_text(input_data, opts->search_term);
-            if (results) {
-                print_search_results(results);
-                free_search_results(results);
-            }
-            break;
-        }
-        case MODE_SORT: {
-            LineArray* lines = split_into_lines(input_data);
-            if (lines) {
-                sort_lines(lines);
-                output_data = join_lines(lines);
-                output_size = strlen(output_data) + 1;
-                free_line_array(lines);
-            }
-            break;
-        }
-        default:
-            handle_error("Invalid mode");
-            result = 1;
-            break;
+    int result;
+    if (opts->serve_socket) {
+        // One failed allocation fails its request, not the daemon
+        set_memory_error_exit(0);
+        result = run_server(opts);
+    } else if (opts->client_socket) {
+        result = run_client(opts, argc, argv);
+    } else if (opts->batch_source) {
+        // One failed allocation fails its file, not the batch
+        set_memory_error_exit(0);
+        result = run_batch(opts);
+    } else {
+        result = process_file(opts, opts->input_file, opts->output_file, stdout, NULL);
     }
 
-    // Write output if applicable
-    if (output_data && opts->output_file) {
-        if (!write_file(opts->output_file, output_data, output_size)) {
-            result = 1;
-        }
-        free(output_data);
+    if (opts->stats) {
+        stats_report(stderr, opts->stats == 2);
     }
 
-    // Cleanup
-    free(input_data);
     free_options(opts);
-
     return result;
 }
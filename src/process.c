@@ -0,0 +1,372 @@
+#include "../include/process.h"
+#include "../include/asyncio.h"
+#include "../include/chunkstore.h"
+#include "../include/compress.h"
+#include "../include/dedup.h"
+#include "../include/encrypt.h"
+#include "../include/extsort.h"
+#include "../include/search.h"
+#include "../include/sort.h"
+#include "../include/stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static SearchOptions get_search_options(const Options* opts) {
+    SearchOptions search_opts;
+    search_opts.count_only = opts->count_only;
+    search_opts.max_count = opts->max_count;
+    search_opts.files_with_matches = opts->files_with_matches;
+    search_opts.quiet = opts->quiet;
+    search_opts.fuzzy = opts->fuzzy;
+    search_opts.max_errors = opts->max_errors;
+    search_opts.max_line_length = 0;
+    return search_opts;
+}
+
+static SortOptions get_sort_options(const Options* opts) {
+    SortOptions sort_opts;
+    sort_opts.key_field = opts->key_field;
+    sort_opts.separator = opts->separator;
+    sort_opts.numeric = opts->numeric;
+    sort_opts.human = opts->human;
+    sort_opts.reverse = opts->reverse;
+    sort_opts.stable = opts->stable;
+    sort_opts.unique = opts->unique;
+    return sort_opts;
+}
+
+// Labels the input in search output the way grep does for standard input
+static const char* input_label(const char* input_file) {
+    return is_stdio_name(input_file) ? "(standard input)" : input_file;
+}
+
+// Searches the input one chunk at a time as it arrives. An encrypted input
+// is decrypted chunk by chunk and its lines are limited to
+// SEARCH_MAX_LINE_LENGTH, so the plaintext never exists as a full buffer or
+// on disk.
+static int search_stream(const Options* opts, const char* input_file, FILE* results,
+                         Workspace* workspace) {
+    size_t key_len = opts->key ? strlen(opts->key) : 0;
+    if (opts->key && key_len == 0) {
+        handle_error("Empty encryption key");
+        return 1;
+    }
+
+    FILE* file = open_input_stream(input_file);
+    if (!file) {
+        return 1;
+    }
+
+    // The next chunk is read ahead while this one is decrypted and searched
+    AsyncReader* reader = create_async_reader(file, STREAM_CHUNK_SIZE, workspace);
+    SearchOptions search_opts = get_search_options(opts);
+    if (opts->key) {
+        search_opts.max_line_length = SEARCH_MAX_LINE_LENGTH;
+    }
+    OutputBuffer* out = reader ? create_async_output_buffer(results, OUTPUT_BUFFER_SIZE, workspace) : NULL;
+    SearchContext* search = out ? create_search_context(opts->search_term, &search_opts,
+                                                        input_label(input_file), out) : NULL;
+    if (!search) {
+        free_output_buffer(out);
+        free_async_reader(reader);
+        close_stream(file);
+        return 1;
+    }
+
+    int result = 0;
+    size_t position = 0;
+    char* window;
+    size_t window_len;
+    int status;
+    while ((status = async_reader_next(reader, &window, &window_len)) > 0) {
+        if (opts->key) {
+            xor_apply(window, window_len, opts->key, key_len, position);
+            position += window_len;
+        }
+        int more = search_feed(search, window, window_len);
+        if (opts->key) {
+            memset(window, 0, window_len); // Plaintext never outlives its window
+        }
+        if (!more) {
+            result = !search->done; // Stopped by an error rather than the answer
+            break;
+        }
+    }
+    if (status < 0) {
+        handle_error("Failed to read file");
+        result = 1;
+    }
+
+    if (result) {
+        flush_output_buffer(out); // Keep the matches found so far, with no summary
+    } else if ((search_finish(search) == 0 && opts->quiet) || !flush_output_buffer(out)) {
+        result = 1; // No match for --quiet, or the results were not all written
+    }
+
+    free_search_context(search);
+    free_output_buffer(out);
+    free_async_reader(reader);
+    close_stream(file);
+    return result;
+}
+
+// Runs the modes that transform their input chunk by chunk
+static int process_stream(const Options* opts, const char* input_file, const char* output_file,
+                          Workspace* workspace) {
+    FILE* input = open_input_stream(input_file);
+    if (!input) {
+        return 1;
+    }
+    FILE* output = open_output_stream(output_file);
+    if (!output) {
+        close_stream(input);
+        return 1;
+    }
+
+    int ok;
+    switch (opts->mode) {
+        case MODE_COMPRESS:
+            ok = huffman_compress_stream(input, output, opts->context ? HUFFMAN_ORDER1 : HUFFMAN_ORDER0,
+                                         workspace);
+            break;
+        case MODE_DECOMPRESS:
+            ok = huffman_decompress_stream(input, output, workspace, opts->max_memory);
+            break;
+        default:
+            ok = xor_stream(input, output, opts->key, workspace);
+            break;
+    }
+
+    close_stream(input);
+    if (close_stream(output) != 0) {
+        if (ok) {
+            handle_error("Failed to write file");
+        }
+        ok = 0;
+    }
+    return ok ? 0 : 1;
+}
+
+// Writes sorted lines straight from their slices, so the sorted text is
+// never built as a second copy of the input
+static int write_sorted_lines(const LineArray* lines, const char* output_file, Workspace* workspace) {
+    FILE* output = open_output_stream(output_file);
+    if (!output) {
+        return 0;
+    }
+    OutputBuffer* out = create_async_output_buffer(output, OUTPUT_BUFFER_SIZE, workspace);
+    int ok = out != NULL;
+    const char* terminator = lines->crlf ? "\r\n" : "\n";
+    size_t terminator_len = lines->crlf ? 2 : 1;
+    size_t joined = 0;
+    STATS_BEGIN(mark);
+    for (size_t i = 0; ok && i < lines->count; i++) {
+        const LineSlice* line = &lines->lines[i];
+        ok = output_buffer_write(out, lines->text + line->offset, line->length) &&
+             output_buffer_write(out, terminator, terminator_len);
+        joined += line->length + terminator_len;
+    }
+    STATS_END(mark, STATS_JOIN, joined);
+    if (out) {
+        ok = flush_output_buffer(out) && ok;
+        free_output_buffer(out);
+    }
+    if (close_stream(output) != 0) {
+        if (ok) {
+            handle_error("Failed to write file");
+        }
+        ok = 0;
+    }
+    return ok;
+}
+
+static size_t count_lines(const char* text, size_t len) {
+    size_t count = 0;
+    const char* p = text;
+    const char* end = text + len;
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        count++;
+        p++;
+    }
+    return count + (len > 0 && text[len - 1] != '\n');
+}
+
+// Bytes an in-memory run holds for this input, counting the mapped text.
+// For dedup this leaves out the table of distinct lines, which is checked as it grows.
+static size_t in_memory_estimate(const Options* opts, const InputFile* input) {
+    if (opts->mode == MODE_SEARCH) {
+        return input->size;
+    }
+    size_t lines = count_lines(input->data, input->size);
+    if (opts->mode == MODE_SORT) {
+        SortOptions sort_opts = get_sort_options(opts);
+        return input->size + sort_memory_estimate(lines, &sort_opts, opts->threads);
+    }
+    return input->size + dedup_memory_estimate(input->size, lines, opts->count_lines);
+}
+
+// External sort memory: --memory-limit, capped by the --max-memory budget
+static size_t external_sort_limit(const Options* opts) {
+    if (opts->memory_limit > 0 && (opts->max_memory == 0 || opts->memory_limit < opts->max_memory)) {
+        return opts->memory_limit;
+    }
+    return opts->max_memory;
+}
+
+// Runs an in-memory mode whose input does not fit the budget in chunks instead
+static int process_over_budget(const Options* opts, const char* input_file, const char* output_file,
+                               FILE* results, Workspace* workspace, size_t needed) {
+    switch (opts->mode) {
+        case MODE_SEARCH:
+            return search_stream(opts, input_file, results, workspace);
+        case MODE_SORT: {
+            SortOptions sort_opts = get_sort_options(opts);
+            return external_sort(input_file, output_file, external_sort_limit(opts),
+                                 opts->temp_dir, &sort_opts) ? 0 : 1;
+        }
+        default: {
+            // First-seen order needs every distinct line at once
+            char message[160];
+            snprintf(message, sizeof(message),
+                     "--dedup needs at least %zuM for this input, more than --max-memory allows",
+                     (needed >> 20) + 1);
+            handle_error(message);
+            return 1;
+        }
+    }
+}
+
+// Runs the modes that need the whole input in memory at once
+static int process_in_memory(const Options* opts, const char* input_file, const char* output_file,
+                             FILE* results, Workspace* workspace) {
+    // Map input file; every mode below only reads it
+    InputFile* input = open_input_file(input_file);
+    if (!input) {
+        return 1;
+    }
+    const char* input_data = input->data;
+    size_t input_size = input->size;
+
+    size_t needed = 0;
+    if (opts->max_memory > 0) {
+        needed = in_memory_estimate(opts, input);
+        if (needed > opts->max_memory) {
+            close_input_file(input);
+            return process_over_budget(opts, input_file, output_file, results, workspace, needed);
+        }
+    }
+
+    size_t output_size;
+    char* output_data = NULL;
+    int result = 0;
+
+    // Process based on mode
+    switch (opts->mode) {
+        case MODE_SEARCH: {
+            SearchOptions search_opts = get_search_options(opts);
+            OutputBuffer* out = create_async_output_buffer(results, OUTPUT_BUFFER_SIZE, workspace);
+            SearchContext* search = out ? create_search_context(opts->search_term, &search_opts,
+                                                                input_label(input_file), out) : NULL;
+            if (search) {
+                if (!search_feed(search, input_data, input_size) && !search->done) {
+                    flush_output_buffer(out); // A write failed; no summary, as when streaming
+                    result = 1;
+                } else if ((search_finish(search) == 0 && opts->quiet) || !flush_output_buffer(out)) {
+                    result = 1; // No match for --quiet, or the results were not all written
+                }
+                free_search_context(search);
+            } else {
+                result = 1;
+            }
+            free_output_buffer(out);
+            break;
+        }
+        case MODE_SORT: {
+            SortOptions sort_opts = get_sort_options(opts);
+            LineArray* lines = split_into_lines(input_data, input_size, opts->threads);
+            if (lines) {
+                if (!sort_lines_with_options(lines, &sort_opts, opts->threads) ||
+                    !write_sorted_lines(lines, output_file, workspace)) {
+                    result = 1;
+                }
+                free_line_array(lines);
+            } else {
+                result = 1;
+            }
+            break;
+        }
+        case MODE_DEDUP: {
+            SortOptions sort_opts = get_sort_options(opts);
+            // The distinct lines get whatever the budget leaves
+            LineTable* table = count_distinct_lines(input_data, input_size, opts->threads,
+                                                    opts->max_memory ? opts->max_memory - needed : 0);
+            if (table) {
+                output_data = format_distinct_lines(table, opts->count_lines,
+                                                    opts->sorted_output ? &sort_opts : NULL,
+                                                    opts->threads, &output_size);
+                free_line_table(table);
+            } else {
+                result = 1;
+            }
+            break;
+        }
+        default:
+            handle_error("Invalid mode");
+            result = 1;
+            break;
+    }
+
+    // Write output if applicable
+    if (output_data && output_file) {
+        if (!write_file(output_file, output_data, output_size)) {
+            result = 1;
+        }
+        free(output_data);
+    }
+
+    close_input_file(input);
+    return result;
+}
+
+int process_file(const Options* opts, const char* input_file, const char* output_file,
+                 FILE* results, Workspace* workspace) {
+    // The summary of a chunked compress is kept out of a manifest on standard output
+    if (opts->store_dir && opts->mode == MODE_COMPRESS) {
+        return chunk_store_compress(input_file, output_file, opts->store_dir,
+                                    opts->context ? HUFFMAN_ORDER1 : HUFFMAN_ORDER0,
+                                    is_stdio_name(output_file) ? NULL : results, workspace) ? 0 : 1;
+    }
+    if (opts->store_dir && opts->mode == MODE_DECOMPRESS) {
+        return chunk_store_restore(input_file, output_file, opts->store_dir, workspace) ? 0 : 1;
+    }
+
+    if (opts->mode == MODE_COMPRESS || opts->mode == MODE_DECOMPRESS ||
+        opts->mode == MODE_ENCRYPT || opts->mode == MODE_DECRYPT) {
+        return process_stream(opts, input_file, output_file, workspace);
+    }
+
+    if (opts->mode == MODE_SEARCH && (opts->key || is_stdio_name(input_file))) {
+        return search_stream(opts, input_file, results, workspace);
+    }
+
+    if (opts->mode == MODE_SORT && opts->top_k) {
+        SortOptions sort_opts = get_sort_options(opts);
+        return top_k_sort(input_file, output_file, opts->top_count,
+                          opts->top_tail, &sort_opts) ? 0 : 1;
+    }
+
+    // Standard input would be read whole before its size is known
+    if (opts->mode == MODE_SORT &&
+        (opts->memory_limit > 0 || (opts->max_memory > 0 && is_stdio_name(input_file)))) {
+        SortOptions sort_opts = get_sort_options(opts);
+        return external_sort(input_file, output_file, external_sort_limit(opts),
+                             opts->temp_dir, &sort_opts) ? 0 : 1;
+    }
+
+    if (opts->mode == MODE_DEDUP && opts->max_memory > 0 && is_stdio_name(input_file)) {
+        handle_error("--dedup cannot read standard input within --max-memory; give it a file");
+        return 1;
+    }
+
+    return process_in_memory(opts, input_file, output_file, results, workspace);
+}
@@ -1,114 +1,427 @@
 #include "../include/search.h"
+#include "../include/cpu.h"
 #include "../include/io.h"
+#include "../include/lineindex.h"
+#include "../include/stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-SearchResult* search_text(const char* text, const char* keyword) {
-    if (!text || !keyword) {
-        handle_error("Invalid input for search");
-        return NULL;
+// --- Streaming search ---
+
+#define SEARCH_BLOCK_SIZE (256 * 1024) // Bytes indexed at a time, sized for L2
+
+/*
+ * Approximate matching uses the Wu-Manber extension of the bit-parallel
+ * Shift-And (Bitap) algorithm. Bit i of state[d] is set when the first i + 1
+ * keyword bytes match a suffix of the current line with at most d edits.
+ * Keywords up to 64 bytes fit a single machine word; longer ones fall back
+ * to multi-word bit vectors. Every call starts at the beginning of a line and
+ * the state is reset at each newline, so matches never cross lines. Returns a
+ * pointer to the byte that completes the match.
+ */
+static const char* find_fuzzy_word(const SearchContext* ctx, const char* p, const char* end) {
+    const uint64_t* masks = ctx->fuzzy_masks;
+    uint64_t* state = ctx->fuzzy_state;
+    size_t k = ctx->options.max_errors;
+    uint64_t accept = (uint64_t)1 << (ctx->keyword_len - 1);
+
+    for (size_t d = 0; d <= k; d++) {
+        state[d] = ((uint64_t)1 << d) - 1;
     }
 
-    SearchResult* head = NULL;
-    SearchResult* current = NULL;
-    int line_number = 1;
-    const char* line_start = text;
-    const char* line_end;
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            for (size_t d = 0; d <= k; d++) {
+                state[d] = ((uint64_t)1 << d) - 1;
+            }
+            continue;
+        }
 
-    while ((line_end = strchr(line_start, '\n')) != NULL) {
-        size_t line_length = line_end - line_start;
-        char* line = malloc(line_length + 1);
-        if (!line) {
-            handle_memory_error();
-            free_search_results(head);
-            return NULL;
+        uint64_t mask = masks[(unsigned char)*p];
+        uint64_t prev_old = state[0];
+        uint64_t prev_new = ((state[0] << 1) | 1) & mask;
+        state[0] = prev_new;
+        for (size_t d = 1; d <= k; d++) {
+            uint64_t old = state[d];
+            prev_new = (((old << 1) | 1) & mask) | prev_old | (prev_old << 1) | (prev_new << 1) | 1;
+            prev_old = old;
+            state[d] = prev_new;
         }
 
-        strncpy(line, line_start, line_length);
-        line[line_length] = '\0';
+        if (state[k] & accept) {
+            return p;
+        }
+    }
+    return NULL;
+}
 
-        if (strstr(line, keyword) != NULL) {
-            SearchResult* result = malloc(sizeof(SearchResult));
-            if (!result) {
-                handle_memory_error();
-                free(line);
-                free_search_results(head);
-                return NULL;
+static void reset_fuzzy_state(const SearchContext* ctx) {
+    size_t words = ctx->fuzzy_words;
+    memset(ctx->fuzzy_state, 0, (ctx->options.max_errors + 1) * words * sizeof(uint64_t));
+    for (size_t d = 0; d <= ctx->options.max_errors; d++) {
+        uint64_t* row = ctx->fuzzy_state + d * words;
+        for (size_t bit = 0; bit < d; bit++) {
+            row[bit / 64] |= (uint64_t)1 << (bit % 64);
+        }
+    }
+}
+
+static const char* find_fuzzy_multiword(const SearchContext* ctx, const char* p, const char* end) {
+    size_t words = ctx->fuzzy_words;
+    size_t k = ctx->options.max_errors;
+    uint64_t* saved = ctx->fuzzy_state + (k + 1) * words; // Old values of the row above
+    size_t accept_word = (ctx->keyword_len - 1) / 64;
+    uint64_t accept = (uint64_t)1 << ((ctx->keyword_len - 1) % 64);
+
+    reset_fuzzy_state(ctx);
+
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            reset_fuzzy_state(ctx);
+            continue;
+        }
+
+        const uint64_t* mask = ctx->fuzzy_masks + (unsigned char)*p * words;
+        for (size_t d = 0; d <= k; d++) {
+            uint64_t* row = ctx->fuzzy_state + d * words;
+            const uint64_t* above = row - words; // Already updated for this byte
+            uint64_t carry = 1, old_carry = 1, new_carry = 1;
+
+            for (size_t w = 0; w < words; w++) {
+                uint64_t old = row[w];
+                uint64_t value = ((old << 1) | carry) & mask[w];
+                carry = old >> 63;
+                if (d > 0) {
+                    uint64_t up_old = saved[w];
+                    uint64_t up_new = above[w];
+                    value |= up_old | (up_old << 1) | old_carry | (up_new << 1) | new_carry;
+                    old_carry = up_old >> 63;
+                    new_carry = up_new >> 63;
+                }
+                saved[w] = old;
+                row[w] = value;
             }
+        }
+
+        if (ctx->fuzzy_state[k * words + accept_word] & accept) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const char* find_keyword(const SearchContext* ctx, const char* p, const char* end) {
+    if (ctx->options.fuzzy) {
+        if (ctx->options.max_errors >= ctx->keyword_len) {
+            return p; // Every line is within reach
+        }
+        return ctx->fuzzy_words == 1 ? find_fuzzy_word(ctx, p, end)
+                                     : find_fuzzy_multiword(ctx, p, end);
+    }
+
+    size_t klen = ctx->keyword_len;
+    if (klen == 0) {
+        return p;
+    }
 
-            result->line_number = line_number;
-            result->line = line;
-            result->next = NULL;
+    const char first = ctx->keyword[0];
 
-            if (!head) {
-                head = result;
-                current = result;
-            } else {
-                current->next = result;
-                current = result;
+    // Blocks of 64 candidates are filtered on the first and last keyword
+    // byte at once, so a common first byte alone does not stop the scan
+    if (klen > 1) {
+        uint64_t (*pair_mask)(const char*, char, char, size_t) = cpu_kernels()->pair_mask;
+        const char last = ctx->keyword[klen - 1];
+        while ((size_t)(end - p) >= 64 + klen - 1) {
+            uint64_t mask = pair_mask(p, first, last, klen - 1);
+            while (mask) {
+                const char* candidate = p + __builtin_ctzll(mask);
+                if (memcmp(candidate + 1, ctx->keyword + 1, klen - 2) == 0) {
+                    return candidate;
+                }
+                mask &= mask - 1;
             }
-        } else {
-            free(line);
+            p += 64;
+        }
+    }
+
+    while ((size_t)(end - p) >= klen) {
+        const char* candidate = memchr(p, first, (end - p) - klen + 1);
+        if (!candidate) {
+            return NULL;
+        }
+        if (memcmp(candidate + 1, ctx->keyword + 1, klen - 1) == 0) {
+            return candidate;
         }
+        p = candidate + 1;
+    }
+    return NULL;
+}
+
+static int emit_match(SearchContext* ctx, const char* line, size_t line_len) {
+    ctx->match_count++;
+
+    if (ctx->options.quiet) {
+        ctx->done = 1;
+        return 1;
+    }
 
-        line_start = line_end + 1;
-        line_number++;
+    if (ctx->options.files_with_matches) {
+        ctx->done = 1;
+        return output_buffer_write(ctx->out, ctx->label, strlen(ctx->label)) &&
+               output_buffer_write(ctx->out, "\n", 1);
     }
 
-    // Check last line
-    if (*line_start != '\0') {
-        char* line = my_strdup(line_start);
-        if (!line) {
+    if (!ctx->options.count_only) {
+        char prefix[32];
+        if (ctx->match_count == 1 &&
+            !output_buffer_write(ctx->out, "Search results:\n", 16)) {
+            return 0;
+        }
+        int prefix_len = snprintf(prefix, sizeof(prefix), "%zu: ", ctx->line_number);
+        if (!output_buffer_write(ctx->out, prefix, prefix_len) ||
+            !output_buffer_write(ctx->out, line, line_len) ||
+            !output_buffer_write(ctx->out, "\n", 1)) {
+            return 0;
+        }
+    }
+
+    if (ctx->options.max_count && ctx->match_count >= ctx->options.max_count) {
+        ctx->done = 1;
+    }
+    return 1;
+}
+
+// Searches a block of complete lines with its line index. Matches are found
+// over the whole block and mapped back to their line with a binary search
+// over the newline offsets. Lines are printed without the CR of a CRLF
+// ending.
+static int scan_block(SearchContext* ctx, const char* p, const char* end) {
+    LineIndex* index = ctx->index;
+    if (!rebuild_line_index(index, p, end - p)) {
+        return 0;
+    }
+
+    size_t first_line = ctx->line_number;
+    const char* cursor = p;
+    while (cursor < end && !ctx->done) {
+        const char* match = find_keyword(ctx, cursor, end);
+        if (!match) {
+            break;
+        }
+
+        size_t line = line_index_find(index, match - p);
+        size_t start = line_index_start(index, line);
+        size_t length = line_index_newline(index, line) - start;
+        if (length > 0 && p[start + length - 1] == '\r') {
+            length--; // CR of a CRLF ending
+        }
+        if (!ctx->options.fuzzy && (size_t)(match - p) + ctx->keyword_len > start + length) {
+            // Keyword runs into the line terminator
+            cursor = match + 1;
+            continue;
+        }
+
+        ctx->line_number = first_line + line;
+        if (!emit_match(ctx, p + start, length)) {
+            return 0;
+        }
+        cursor = p + line_index_start(index, line + 1);
+    }
+
+    ctx->line_number = first_line + index->count;
+    return 1;
+}
+
+// Scans a block made of complete lines (it ends right after a newline). It
+// is indexed a piece at a time, so memory stays bounded and an early exit
+// skips the rest of the block.
+static int scan_lines(SearchContext* ctx, const char* p, const char* end) {
+    while (p < end && !ctx->done) {
+        const char* block_end = end;
+        if ((size_t)(end - p) > SEARCH_BLOCK_SIZE) {
+            const char* from = p + SEARCH_BLOCK_SIZE - 1;
+            block_end = (const char*)memchr(from, '\n', end - from) + 1;
+        }
+        if (!scan_block(ctx, p, block_end)) {
+            return 0;
+        }
+        p = block_end;
+    }
+    return 1;
+}
+
+// Searches a single line; terminated lines drop the CR of a CRLF ending
+static int search_line(SearchContext* ctx, const char* line, size_t line_len, int terminated) {
+    if (terminated && line_len > 0 && line[line_len - 1] == '\r') {
+        line_len--;
+    }
+    if (find_keyword(ctx, line, line + line_len) && !emit_match(ctx, line, line_len)) {
+        return 0;
+    }
+    ctx->line_number++;
+    return 1;
+}
+
+// Clears memory that may hold decrypted text. The call goes through a
+// volatile pointer so it is not dropped as a dead store before free.
+static void* (*const volatile wipe_memory)(void*, int, size_t) = memset;
+
+static int append_carry(SearchContext* ctx, const char* data, size_t len) {
+    if (len == 0) {
+        return 1;
+    }
+    if (ctx->options.max_line_length && ctx->carry_len + len > ctx->options.max_line_length) {
+        handle_error("Line too long to search");
+        wipe_memory(ctx->carry, 0, ctx->carry_len);
+        ctx->carry_len = 0;
+        return 0;
+    }
+    if (ctx->carry_len + len > ctx->carry_capacity) {
+        size_t new_capacity = ctx->carry_capacity ? ctx->carry_capacity : 256;
+        while (new_capacity < ctx->carry_len + len) {
+            new_capacity *= 2;
+        }
+        // Not realloc, which would leave the old copy behind unwiped
+        char* new_carry = malloc(new_capacity);
+        if (!new_carry) {
             handle_memory_error();
-            free_search_results(head);
+            return 0;
+        }
+        if (ctx->carry) {
+            memcpy(new_carry, ctx->carry, ctx->carry_len);
+            wipe_memory(ctx->carry, 0, ctx->carry_capacity);
+            free(ctx->carry);
+        }
+        ctx->carry = new_carry;
+        ctx->carry_capacity = new_capacity;
+    }
+    memcpy(ctx->carry + ctx->carry_len, data, len);
+    ctx->carry_len += len;
+    return 1;
+}
+
+SearchContext* create_search_context(const char* keyword, const SearchOptions* options,
+                                      const char* label, OutputBuffer* out) {
+    if (!keyword || !options || !out) {
+        handle_error("Invalid input for search");
+        return NULL;
+    }
+
+    SearchContext* ctx = malloc(sizeof(SearchContext));
+    if (!ctx) {
+        handle_memory_error();
+        return NULL;
+    }
+
+    ctx->keyword = keyword;
+    ctx->keyword_len = strlen(keyword);
+    ctx->options = *options;
+    ctx->label = label ? label : "(input)";
+    ctx->out = out;
+    ctx->line_number = 1;
+    ctx->match_count = 0;
+    ctx->done = 0;
+    ctx->carry = NULL;
+    ctx->carry_len = 0;
+    ctx->carry_capacity = 0;
+    ctx->fuzzy_masks = NULL;
+    ctx->fuzzy_state = NULL;
+    ctx->fuzzy_words = 0;
+    ctx->index = build_line_index("", 0, 1);
+    if (!ctx->index) {
+        free_search_context(ctx);
+        return NULL;
+    }
+
+    if (ctx->options.fuzzy && ctx->options.max_errors < ctx->keyword_len) {
+        size_t words = (ctx->keyword_len + 63) / 64;
+        ctx->fuzzy_words = words;
+        ctx->fuzzy_masks = calloc(256 * words, sizeof(uint64_t));
+        // One row per error count, plus a scratch row for the multi-word update
+        ctx->fuzzy_state = malloc((ctx->options.max_errors + 2) * words * sizeof(uint64_t));
+        if (!ctx->fuzzy_masks || !ctx->fuzzy_state) {
+            handle_memory_error();
+            free_search_context(ctx);
             return NULL;
         }
+        for (size_t i = 0; i < ctx->keyword_len; i++) {
+            unsigned char c = (unsigned char)ctx->keyword[i];
+            ctx->fuzzy_masks[c * words + i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+    return ctx;
+}
 
-        if (strstr(line, keyword) != NULL) {
-            SearchResult* result = malloc(sizeof(SearchResult));
-            if (!result) {
-                handle_memory_error();
-                free(line);
-                free_search_results(head);
-                return NULL;
-            }
+static int feed_lines(SearchContext* ctx, const char* data, size_t len) {
+    if (ctx->done) {
+        return 0;
+    }
 
-            result->line_number = line_number;
-            result->line = line;
-            result->next = NULL;
+    const char* p = data;
+    const char* end = data + len;
 
-            if (!head) {
-                head = result;
-            } else {
-                current->next = result;
-            }
-        } else {
-            free(line);
+    // Complete the line left over from the previous chunk
+    if (ctx->carry_len > 0) {
+        const char* nl = memchr(p, '\n', len);
+        if (!nl) {
+            return append_carry(ctx, p, len);
+        }
+        if (!append_carry(ctx, p, nl - p) || !search_line(ctx, ctx->carry, ctx->carry_len, 1)) {
+            return 0;
+        }
+        ctx->carry_len = 0;
+        p = nl + 1;
+        if (ctx->done) {
+            return 0;
         }
     }
 
-    return head;
-}
+    const char* complete_end = end;
+    while (complete_end > p && complete_end[-1] != '\n') {
+        complete_end--;
+    }
 
-void free_search_results(SearchResult* results) {
-    while (results) {
-        SearchResult* next = results->next;
-        free(results->line);
-        free(results);
-        results = next;
+    if (!scan_lines(ctx, p, complete_end) || ctx->done) {
+        return 0;
     }
+    return append_carry(ctx, complete_end, end - complete_end);
+}
+
+int search_feed(SearchContext* ctx, const char* data, size_t len) {
+    STATS_BEGIN(mark);
+    int more = feed_lines(ctx, data, len);
+    STATS_END(mark, STATS_SEARCH, len);
+    return more;
 }
 
-void print_search_results(SearchResult* results) {
-    if (!results) {
-        printf("No matches found.\n");
-        return;
+size_t search_finish(SearchContext* ctx) {
+    if (!ctx->done && ctx->carry_len > 0) {
+        search_line(ctx, ctx->carry, ctx->carry_len, 0);
+        ctx->carry_len = 0;
     }
 
-    printf("Search results:\n");
-    while (results) {
-        printf("%d: %s\n", results->line_number, results->line);
-        results = results->next;
+    if (ctx->options.count_only && !ctx->options.quiet && !ctx->options.files_with_matches) {
+        char count[32];
+        int count_len = snprintf(count, sizeof(count), "%zu\n", ctx->match_count);
+        output_buffer_write(ctx->out, count, count_len);
+    } else if (ctx->match_count == 0 && !ctx->options.quiet && !ctx->options.files_with_matches) {
+        output_buffer_write(ctx->out, "No matches found.\n", 18);
     }
-} 
\ No newline at end of file
+
+    flush_output_buffer(ctx->out);
+    return ctx->match_count;
+}
+
+void free_search_context(SearchContext* ctx) {
+    if (ctx) {
+        if (ctx->carry) {
+            wipe_memory(ctx->carry, 0, ctx->carry_capacity);
+            free(ctx->carry);
+        }
+        free(ctx->fuzzy_masks);
+        free(ctx->fuzzy_state);
+        free_line_index(ctx->index);
+        free(ctx);
+    }
+}
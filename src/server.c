@@ -0,0 +1,596 @@
+#define _GNU_SOURCE // fopencookie
+
+#include "../include/server.h"
+#include "../include/io.h"
+#include "../include/process.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_QUEUE_PER_WORKER 4 // Accepted connections per worker before accept waits
+#define MAX_SERVER_WORKERS 256
+
+// Accepted connections waiting for a worker
+typedef struct {
+    int* fds;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    int closed;
+    size_t max_payload;      // Largest request input accepted
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} ConnectionQueue;
+
+// Standard output or standard error of a request, sent to the client in
+// frames as it is written. Both streams share the socket, so each frame is
+// sent whole under the connection's lock.
+typedef struct {
+    int fd;
+    char type;
+    pthread_mutex_t* lock;
+} FrameStream;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+// --- Wire format ---
+
+static void put_u32(unsigned char* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const unsigned char* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+static int send_all(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t sent = write(fd, p, len);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return 0;
+        }
+        p += sent;
+        len -= (size_t)sent;
+    }
+    return 1;
+}
+
+static int recv_all(int fd, void* data, size_t len) {
+    char* p = data;
+    while (len > 0) {
+        ssize_t received = read(fd, p, len);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return 0;
+        }
+        p += received;
+        len -= (size_t)received;
+    }
+    return 1;
+}
+
+static int send_u32(int fd, uint32_t value) {
+    unsigned char bytes[4];
+    put_u32(bytes, value);
+    return send_all(fd, bytes, 4);
+}
+
+static int recv_u32(int fd, uint32_t* value) {
+    unsigned char bytes[4];
+    if (!recv_all(fd, bytes, 4)) {
+        return 0;
+    }
+    *value = get_u32(bytes);
+    return 1;
+}
+
+static int send_frame(int fd, char type, const char* data, size_t len) {
+    // Large outputs go out in several frames of the same type
+    do {
+        size_t part = len < SERVER_MAX_CHUNK ? len : SERVER_MAX_CHUNK;
+        unsigned char header[5];
+        header[0] = (unsigned char)type;
+        put_u32(header + 1, (uint32_t)part);
+        if (!send_all(fd, header, 5) || !send_all(fd, data, part)) {
+            return 0;
+        }
+        data += part;
+        len -= part;
+    } while (len > 0);
+    return 1;
+}
+
+static ssize_t write_frames(void* cookie, const char* data, size_t len) {
+    FrameStream* stream = cookie;
+    if (len == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(stream->lock);
+    int ok = send_frame(stream->fd, stream->type, data, len);
+    pthread_mutex_unlock(stream->lock);
+    return ok ? (ssize_t)len : 0; // A short write marks the stream as failed
+}
+
+static FILE* open_frame_stream(FrameStream* stream) {
+    cookie_io_functions_t functions = { NULL, write_frames, NULL, NULL };
+    FILE* file = fopencookie(stream, "w", functions);
+    if (file) {
+        setvbuf(file, NULL, _IOFBF, STREAM_CHUNK_SIZE);
+    }
+    return file;
+}
+
+// Reads chunks up to the zero length that ends a payload. Stops reading
+// and sets too_large once the payload would pass max_payload bytes.
+static char* recv_payload(int fd, size_t* size, size_t max_payload, int* too_large) {
+    size_t capacity = STREAM_CHUNK_SIZE;
+    size_t used = 0;
+    char* buffer = malloc(capacity);
+    if (!buffer) {
+        handle_memory_error();
+        return NULL;
+    }
+
+    uint32_t chunk_len = 1; // Stays nonzero if the client hangs up
+    while (recv_u32(fd, &chunk_len) && chunk_len > 0) {
+        if (chunk_len > SERVER_MAX_CHUNK) {
+            free(buffer);
+            return NULL;
+        }
+        if (chunk_len > max_payload - used) {
+            *too_large = 1;
+            free(buffer);
+            return NULL;
+        }
+        if (used + chunk_len > capacity) {
+            while (used + chunk_len > capacity) {
+                capacity *= 2;
+            }
+            char* grown = realloc(buffer, capacity);
+            if (!grown) {
+                handle_memory_error();
+                free(buffer);
+                return NULL;
+            }
+            buffer = grown;
+        }
+        if (!recv_all(fd, buffer + used, chunk_len)) {
+            free(buffer);
+            return NULL;
+        }
+        used += chunk_len;
+    }
+    if (chunk_len != 0) {
+        free(buffer);
+        return NULL;
+    }
+
+    *size = used;
+    return buffer;
+}
+
+// --- Server ---
+
+static void free_args(char** args, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(args[i]);
+    }
+    free(args);
+}
+
+// Reads the command line of a request; args[0] is the program name
+static char** recv_args(int fd, size_t* count) {
+    char magic[4];
+    uint32_t argc;
+    if (!recv_all(fd, magic, 4) || memcmp(magic, SERVER_REQUEST_MAGIC, 4) != 0 ||
+        !recv_u32(fd, &argc) || argc == 0 || argc > SERVER_MAX_ARGS) {
+        return NULL;
+    }
+
+    char** args = calloc(argc + 2, sizeof(char*));
+    if (!args) {
+        handle_memory_error();
+        return NULL;
+    }
+    args[0] = my_strdup("file_processor");
+    *count = 1;
+    for (uint32_t i = 0; i < argc; i++) {
+        uint32_t len;
+        char* arg = NULL;
+        if (recv_u32(fd, &len) && len <= SERVER_MAX_ARG_LEN && (arg = malloc(len + 1)) &&
+            recv_all(fd, arg, len)) {
+            arg[len] = '\0';
+            args[(*count)++] = arg;
+        } else {
+            free(arg);
+            free_args(args, *count);
+            return NULL;
+        }
+    }
+    return args;
+}
+
+// Runs one request with the thread's standard streams sent back to the
+// client as they are written
+static void handle_connection(int fd, size_t max_payload, Workspace* workspace) {
+    size_t arg_count;
+    char** args = recv_args(fd, &arg_count);
+    if (!args) {
+        return;
+    }
+
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    FrameStream out_frames = { fd, 'O', &lock };
+    FrameStream err_frames = { fd, 'E', &lock };
+    FILE* out = open_frame_stream(&out_frames);
+    FILE* err = open_frame_stream(&err_frames);
+    if (!out || !err) {
+        if (out) fclose(out);
+        if (err) fclose(err);
+        pthread_mutex_destroy(&lock);
+        free_args(args, arg_count);
+        return;
+    }
+    redirect_thread_stdio(NULL, out, err);
+
+    int status = 1;
+    int connected = 1;
+    char* payload = NULL;
+    FILE* in = NULL;
+    Options* opts = parse_cli((int)arg_count, args);
+    if (opts && (opts->mode == MODE_HELP || opts->serve_socket || opts->client_socket ||
+                 opts->batch_source)) {
+        handle_error("Request not supported by the server");
+    } else if (opts) {
+        if (is_stdio_name(opts->input_file)) {
+            size_t payload_len = 0;
+            int too_large = 0;
+            payload = recv_payload(fd, &payload_len, max_payload, &too_large);
+            // A refused payload still gets an answer; the rest of it is never read
+            connected = payload != NULL || too_large;
+            if (too_large) {
+                handle_error("Input is larger than the server accepts (see --max-payload)");
+            } else if (connected) {
+                in = payload_len > 0 ? fmemopen(payload, payload_len, "rb") : fopen("/dev/null", "rb");
+            }
+        }
+        if (connected && (in || !is_stdio_name(opts->input_file))) {
+            redirect_thread_stdio(in, out, err);
+            status = process_file(opts, opts->input_file, opts->output_file, out, workspace);
+        }
+    }
+    redirect_thread_stdio(NULL, NULL, NULL);
+
+    // Closing sends whatever output and errors are still buffered
+    fclose(out);
+    fclose(err);
+    if (connected) {
+        unsigned char exit_status[4];
+        put_u32(exit_status, (uint32_t)status);
+        send_frame(fd, 'X', (const char*)exit_status, 4);
+    }
+
+    if (in) {
+        fclose(in);
+    }
+    pthread_mutex_destroy(&lock);
+    free(payload);
+    free_options(opts);
+    free_args(args, arg_count);
+}
+
+static void* server_worker(void* arg) {
+    ConnectionQueue* queue = arg;
+    Workspace* workspace = create_workspace();
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0 && !queue->closed) {
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        }
+        if (queue->count == 0) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        int fd = queue->fds[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
+
+        if (workspace) {
+            handle_connection(fd, queue->max_payload, workspace);
+        }
+        close(fd);
+    }
+
+    free_workspace(workspace);
+    return NULL;
+}
+
+static int open_server_socket(const char* path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        handle_error("Socket path is too long");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by a server that did not shut down cleanly
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        handle_error("Failed to create socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        handle_error("Failed to listen on socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int run_server(const Options* opts) {
+    int listen_fd = open_server_socket(opts->serve_socket);
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    size_t workers = opts->threads;
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (workers > MAX_SERVER_WORKERS) {
+        workers = MAX_SERVER_WORKERS;
+    }
+
+    ConnectionQueue queue;
+    queue.capacity = workers * SERVER_QUEUE_PER_WORKER;
+    queue.fds = malloc(queue.capacity * sizeof(int));
+    if (!queue.fds) {
+        handle_memory_error();
+        close(listen_fd);
+        unlink(opts->serve_socket);
+        return 1;
+    }
+    queue.head = 0;
+    queue.count = 0;
+    queue.closed = 0;
+    queue.max_payload = opts->max_payload ? opts->max_payload : SERVER_DEFAULT_MAX_PAYLOAD;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+
+    // Clients that hang up early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Workers block the stop signals so they interrupt accept() in this thread
+    sigset_t stop_signals, previous;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &previous);
+
+    pthread_t threads[MAX_SERVER_WORKERS];
+    size_t started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, server_worker, &queue) == 0) {
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int result = 0;
+    if (started == 0) {
+        handle_error("Failed to start server workers");
+        result = 1;
+    } else {
+        fprintf(stderr, "Listening on %s with %zu workers\n", opts->serve_socket, started);
+    }
+
+    while (started > 0 && !stop_requested) {
+        int client = accept(listen_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR) {
+                handle_error("Failed to accept connection");
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == queue.capacity) {
+            pthread_cond_wait(&queue.not_full, &queue.lock);
+        }
+        queue.fds[(queue.head + queue.count) % queue.capacity] = client;
+        queue.count++;
+        pthread_cond_signal(&queue.not_empty);
+        pthread_mutex_unlock(&queue.lock);
+    }
+
+    // Finish the requests already accepted, then shut down
+    pthread_mutex_lock(&queue.lock);
+    queue.closed = 1;
+    pthread_cond_broadcast(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    close(listen_fd);
+    unlink(opts->serve_socket);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.not_empty);
+    pthread_cond_destroy(&queue.not_full);
+    free(queue.fds);
+    return result;
+}
+
+// --- Client ---
+
+// Makes a relative path absolute, so the server finds the same file
+static char* absolute_path(const char* path, const char* cwd) {
+    if (is_stdio_name(path) || path[0] == '/') {
+        return my_strdup(path);
+    }
+    size_t len = strlen(cwd) + strlen(path) + 2;
+    char* absolute = malloc(len);
+    if (!absolute) {
+        handle_memory_error();
+        return NULL;
+    }
+    snprintf(absolute, len, "%s/%s", cwd, path);
+    return absolute;
+}
+
+static int send_request(int fd, int argc, char** argv) {
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        handle_error("Failed to get the working directory");
+        return 0;
+    }
+
+    // Everything but the program name and --client <socket> is forwarded
+    uint32_t forwarded = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            i++;
+        } else {
+            forwarded++;
+        }
+    }
+
+    int ok = send_all(fd, SERVER_REQUEST_MAGIC, 4) && send_u32(fd, forwarded);
+    int path_next = 0;
+    for (int i = 1; ok && i < argc; i++) {
+        if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            i++;
+            continue;
+        }
+
+        char* arg = path_next ? absolute_path(argv[i], cwd) : my_strdup(argv[i]);
+        ok = arg && send_u32(fd, (uint32_t)strlen(arg)) && send_all(fd, arg, strlen(arg));
+        free(arg);
+        path_next = strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "-o") == 0 ||
+                    strcmp(argv[i], "--temp-dir") == 0 || strcmp(argv[i], "--store") == 0;
+    }
+    return ok;
+}
+
+static int send_stdin(int fd) {
+    char* chunk = malloc(STREAM_CHUNK_SIZE);
+    if (!chunk) {
+        handle_memory_error();
+        return 0;
+    }
+
+    int ok = 1;
+    size_t bytes_read;
+    while (ok && (bytes_read = fread(chunk, 1, STREAM_CHUNK_SIZE, stdin)) > 0) {
+        ok = send_u32(fd, (uint32_t)bytes_read) && send_all(fd, chunk, bytes_read);
+    }
+    if (ferror(stdin)) {
+        handle_error("Failed to read file");
+        ok = 0;
+    }
+    free(chunk);
+    return ok && send_u32(fd, 0);
+}
+
+// Replays the response frames; returns the exit status, or -1 if the server hung up
+static int receive_response(int fd) {
+    char* buffer = NULL;
+    size_t capacity = 0;
+    for (;;) {
+        unsigned char header[5];
+        if (!recv_all(fd, header, 5)) {
+            break;
+        }
+        size_t len = get_u32(header + 1);
+        if (len > SERVER_MAX_CHUNK || !reserve_scratch(&buffer, &capacity, len ? len : 1) ||
+            !recv_all(fd, buffer, len)) {
+            break;
+        }
+
+        if (header[0] == 'X' && len == 4) {
+            int status = (int)get_u32((const unsigned char*)buffer);
+            free(buffer);
+            return status;
+        }
+        fwrite(buffer, 1, len, header[0] == 'E' ? stderr : stdout);
+    }
+    free(buffer);
+    return -1;
+}
+
+int run_client(const Options* opts, int argc, char** argv) {
+    struct sockaddr_un address;
+    if (strlen(opts->client_socket) >= sizeof(address.sun_path)) {
+        handle_error("Socket path is too long");
+        return 1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, opts->client_socket);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        handle_error("Failed to connect to server");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // A server that refuses the input stops reading it but still answers,
+    // so the response is read even when sending fails
+    if (!send_request(fd, argc, argv) ||
+        (is_stdio_name(opts->input_file) && !send_stdin(fd))) {
+        shutdown(fd, SHUT_WR);
+    }
+    int status = receive_response(fd);
+    close(fd);
+
+    if (status < 0) {
+        handle_error("Lost connection to server");
+        return 1;
+    }
+    fflush(stdout);
+    return status;
+}
@@ -0,0 +1,211 @@
+#include "../include/sha256.h"
+#include "../include/cpu.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotate_right(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static uint32_t load_be32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(unsigned char* p, uint32_t x) {
+    p[0] = (unsigned char)(x >> 24);
+    p[1] = (unsigned char)(x >> 16);
+    p[2] = (unsigned char)(x >> 8);
+    p[3] = (unsigned char)x;
+}
+
+// Runs the compression function over count whole blocks
+static void sha256_blocks_generic(uint32_t* state, const unsigned char* data, size_t count) {
+    for (; count > 0; count--, data += SHA256_BLOCK_SIZE) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+            uint32_t choice = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + choice + round_constants[i] + w[i];
+            uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+            uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + majority;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef SHA256_X86
+
+// The SHA extensions keep the state as ABEF and CDGH and run two rounds per
+// instruction; sha256msg1 and sha256msg2 extend the message schedule
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_sha_ni(uint32_t* state, const unsigned char* data, size_t count) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+    __m128i dcba = _mm_loadu_si128((const __m128i*)&state[0]);
+    __m128i hgfe = _mm_loadu_si128((const __m128i*)&state[4]);
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+    for (; count > 0; count--, data += SHA256_BLOCK_SIZE) {
+        __m128i saved_abef = abef;
+        __m128i saved_cdgh = cdgh;
+        __m128i w[4]; // Schedule words 4g .. 4g + 3 of the last four groups
+
+        #pragma GCC unroll 16
+        for (int g = 0; g < 16; g++) {
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * g)), byte_swap);
+            } else {
+                __m128i next = _mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+                w[g & 3] = _mm_sha256msg2_epu32(next, w[(g + 3) & 3]);
+            }
+            __m128i k = _mm_loadu_si128((const __m128i*)&round_constants[4 * g]);
+            __m128i words = _mm_add_epi32(w[g & 3], k);
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, words);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(words, 0x0e));
+        }
+
+        abef = _mm_add_epi32(abef, saved_abef);
+        cdgh = _mm_add_epi32(cdgh, saved_cdgh);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+static int has_sha_extensions(void) {
+    unsigned eax, ebx, ecx, edx;
+    __builtin_cpu_init();
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA) &&
+           __builtin_cpu_supports("sse4.1");
+}
+
+#endif // SHA256_X86
+
+static void (*sha256_blocks)(uint32_t* state, const unsigned char* data, size_t count) = sha256_blocks_generic;
+static pthread_once_t sha256_dispatch_once = PTHREAD_ONCE_INIT;
+
+// Chosen on first use, after the CPU level and its FP_CPU cap are known;
+// FP_CPU=generic also keeps the SHA extensions off
+static void select_sha256_blocks(void) {
+#ifdef SHA256_X86
+    if (cpu_level() > CPU_GENERIC && has_sha_extensions()) {
+        sha256_blocks = sha256_blocks_sha_ni;
+    }
+#endif
+}
+
+void sha256_init(Sha256* ctx) {
+    pthread_once(&sha256_dispatch_once, select_sha256_blocks);
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial_state, sizeof(initial_state));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void sha256_update(Sha256* ctx, const void* data, size_t len) {
+    const unsigned char* p = data;
+    ctx->length += len;
+
+    // Complete a partial block first
+    if (ctx->block_len > 0) {
+        size_t take = SHA256_BLOCK_SIZE - ctx->block_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(ctx->block + ctx->block_len, p, take);
+        ctx->block_len += take;
+        p += take;
+        len -= take;
+        if (ctx->block_len < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+
+    // Whole blocks are hashed where they are
+    size_t whole = len / SHA256_BLOCK_SIZE;
+    sha256_blocks(ctx->state, p, whole);
+    p += whole * SHA256_BLOCK_SIZE;
+    len -= whole * SHA256_BLOCK_SIZE;
+
+    memcpy(ctx->block, p, len);
+    ctx->block_len = len;
+}
+
+void sha256_final(Sha256* ctx, unsigned char* digest) {
+    uint64_t bit_length = ctx->length * 8;
+
+    // A one bit, zeros, then the length in bits in the last 8 bytes
+    ctx->block[ctx->block_len++] = 0x80;
+    if (ctx->block_len > SHA256_BLOCK_SIZE - 8) {
+        memset(ctx->block + ctx->block_len, 0, SHA256_BLOCK_SIZE - ctx->block_len);
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+    memset(ctx->block + ctx->block_len, 0, SHA256_BLOCK_SIZE - 8 - ctx->block_len);
+    store_be32(ctx->block + SHA256_BLOCK_SIZE - 8, (uint32_t)(bit_length >> 32));
+    store_be32(ctx->block + SHA256_BLOCK_SIZE - 4, (uint32_t)bit_length);
+    sha256_blocks(ctx->state, ctx->block, 1);
+
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + 4 * i, ctx->state[i]);
+    }
+}
+
+void sha256(const void* data, size_t len, unsigned char* digest) {
+    Sha256 ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
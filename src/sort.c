@@ -1,72 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "../include/sort.h"
 #include "../include/io.h"
+#include "../include/stats.h"
+#include "../include/lineindex.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+LineSlice make_line_slice(const char* text, size_t offset, size_t length) {
+    LineSlice slice;
+    const unsigned char* bytes = (const unsigned char*)text + offset;
+    size_t prefix_len = length < 8 ? length : 8;
+
+    slice.prefix = 0;
+    for (size_t i = 0; i < prefix_len; i++) {
+        slice.prefix |= (uint64_t)bytes[i] << (56 - 8 * i);
+    }
+    slice.offset = offset;
+    slice.length = length;
+    return slice;
+}
+
+// Orders lines by unsigned bytes, a proper prefix first. Distinct cached
+// prefixes decide the order on their own; zero padding only ties with real
+// zero bytes, which the full comparison then resolves by length.
+static int compare_slices_between(const char* text_a, const LineSlice* a,
+                                  const char* text_b, const LineSlice* b) {
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix ? -1 : 1;
+    }
+
+    size_t min_len = a->length < b->length ? a->length : b->length;
+    if (min_len > 8) {
+        int cmp = memcmp(text_a + a->offset + 8, text_b + b->offset + 8, min_len - 8);
+        if (cmp != 0) {
+            return cmp;
+        }
+    }
+    return (a->length > b->length) - (a->length < b->length);
+}
+
+int compare_line_slices(const char* text, const LineSlice* a, const LineSlice* b) {
+    return compare_slices_between(text, a, text, b);
+}
 
-LineArray* split_into_lines(const char* text) {
+LineArray* split_into_lines(const char* text, size_t text_len, size_t threads) {
     if (!text) {
         handle_error("Invalid input for line splitting");
         return NULL;
     }
 
-    // Count lines
-    size_t line_count = 1;
-    const char* p = text;
-    while (*p) {
-        if (*p == '\n') {
-            line_count++;
-        }
-        p++;
+    // Find every line in one pass
+    STATS_BEGIN(mark);
+    LineIndex* index = build_line_index(text, text_len, threads);
+    if (!index) {
+        return NULL;
     }
 
     // Allocate line array
     LineArray* lines = malloc(sizeof(LineArray));
     if (!lines) {
         handle_memory_error();
+        free_line_index(index);
         return NULL;
     }
 
-    lines->lines = malloc(line_count * sizeof(char*));
+    lines->lines = malloc((index->count ? index->count : 1) * sizeof(LineSlice));
     if (!lines->lines) {
         handle_memory_error();
         free(lines);
+        free_line_index(index);
         return NULL;
     }
 
-    lines->count = 0;
+    lines->text = text;
+    lines->count = index->count;
+    lines->crlf = index->crlf;
 
-    // Split into lines
-    const char* line_start = text;
-    const char* line_end;
-    while ((line_end = strchr(line_start, '\n')) != NULL) {
-        size_t line_length = line_end - line_start;
-        lines->lines[lines->count] = malloc(line_length + 1);
-        if (!lines->lines[lines->count]) {
-            handle_memory_error();
-            free_line_array(lines);
-            return NULL;
+    // Record slices of the text
+    for (size_t i = 0; i < index->count; i++) {
+        lines->lines[i] = make_line_slice(text, line_index_start(index, i),
+                                          line_index_length(index, i));
+    }
+
+    free_line_index(index);
+    STATS_END(mark, STATS_SPLIT, text_len);
+    return lines;
+}
+
+// --- Multikey quicksort ---
+// Bentley-Sedgewick three-way radix quicksort. Lines are partitioned on the
+// byte at the current depth, so a shared prefix is examined once per
+// partitioning step instead of once per comparison. Small partitions finish
+// with an insertion sort that starts comparing at the known-equal depth.
+
+#define INSERTION_SORT_CUTOFF 16
+
+// Byte at depth plus one, or 0 past the end of the line. The first 8 bytes
+// come from the cached prefix, so shallow partitioning never touches the text.
+static inline int char_at(const char* text, const LineSlice* line, size_t depth) {
+    if (depth >= line->length) {
+        return 0;
+    }
+    if (depth < 8) {
+        return (int)((line->prefix >> (56 - 8 * depth)) & 0xff) + 1;
+    }
+    return (unsigned char)text[line->offset + depth] + 1;
+}
+
+static void swap_lines(LineSlice* lines, ptrdiff_t i, ptrdiff_t j) {
+    LineSlice temp = lines[i];
+    lines[i] = lines[j];
+    lines[j] = temp;
+}
+
+static void swap_line_ranges(LineSlice* lines, ptrdiff_t i, ptrdiff_t j, ptrdiff_t n) {
+    while (n-- > 0) {
+        swap_lines(lines, i++, j++);
+    }
+}
+
+// Compares two lines whose first depth bytes are known to be equal
+static int compare_from(const char* text, const LineSlice* a, const LineSlice* b, size_t depth) {
+    if (depth < 8) {
+        return compare_line_slices(text, a, b);
+    }
+
+    size_t min_len = a->length < b->length ? a->length : b->length;
+    if (min_len > depth) {
+        int cmp = memcmp(text + a->offset + depth, text + b->offset + depth, min_len - depth);
+        if (cmp != 0) {
+            return cmp;
         }
+    }
+    return (a->length > b->length) - (a->length < b->length);
+}
 
-        strncpy(lines->lines[lines->count], line_start, line_length);
-        lines->lines[lines->count][line_length] = '\0';
-        lines->count++;
+static void insertion_sort_lines(const char* text, LineSlice* lines, size_t n, size_t depth) {
+    for (size_t i = 1; i < n; i++) {
+        LineSlice line = lines[i];
+        size_t j = i;
+        while (j > 0 && compare_from(text, &lines[j - 1], &line, depth) > 0) {
+            lines[j] = lines[j - 1];
+            j--;
+        }
+        lines[j] = line;
+    }
+}
 
-        line_start = line_end + 1;
+static ptrdiff_t median_of_three(const char* text, LineSlice* lines,
+                                 ptrdiff_t a, ptrdiff_t b, ptrdiff_t c, size_t depth) {
+    int va = char_at(text, &lines[a], depth);
+    int vb = char_at(text, &lines[b], depth);
+    int vc = char_at(text, &lines[c], depth);
+    if (va < vb) {
+        return vb < vc ? b : (va < vc ? c : a);
     }
+    return vb > vc ? b : (va > vc ? c : a);
+}
+
+static void multikey_quicksort(const char* text, LineSlice* lines, size_t count, size_t depth) {
+    while (count > INSERTION_SORT_CUTOFF) {
+        ptrdiff_t n = (ptrdiff_t)count;
+        swap_lines(lines, 0, median_of_three(text, lines, 0, n / 2, n - 1, depth));
+        int pivot = char_at(text, &lines[0], depth);
+
+        // Partition into [= | < | unsorted | > | =], then move the equal runs
+        // to the middle
+        ptrdiff_t lt_end = 1, lo = 1, hi = n - 1, gt_start = n - 1;
+        for (;;) {
+            int diff;
+            while (lo <= hi && (diff = char_at(text, &lines[lo], depth) - pivot) <= 0) {
+                if (diff == 0) {
+                    swap_lines(lines, lt_end++, lo);
+                }
+                lo++;
+            }
+            while (lo <= hi && (diff = char_at(text, &lines[hi], depth) - pivot) >= 0) {
+                if (diff == 0) {
+                    swap_lines(lines, hi, gt_start--);
+                }
+                hi--;
+            }
+            if (lo > hi) {
+                break;
+            }
+            swap_lines(lines, lo++, hi--);
+        }
+
+        ptrdiff_t r = lt_end < lo - lt_end ? lt_end : lo - lt_end;
+        swap_line_ranges(lines, 0, lo - r, r);
+        r = gt_start - hi < n - gt_start - 1 ? gt_start - hi : n - gt_start - 1;
+        swap_line_ranges(lines, lo, n - r, r);
+
+        size_t less = (size_t)(lo - lt_end);
+        size_t greater = (size_t)(gt_start - hi);
+        size_t equal = count - less - greater;
+        LineSlice* equal_lines = lines + less;
+        LineSlice* greater_lines = lines + count - greater;
 
-    // Add last line if not empty
-    if (*line_start != '\0') {
-        lines->lines[lines->count] = my_strdup(line_start);
-        if (!lines->lines[lines->count]) {
-            handle_memory_error();
-            free_line_array(lines);
-            return NULL;
+        // Equal lines ending here are fully sorted
+        if (pivot == 0) {
+            equal = 0;
+        }
+
+        // Recurse into the two smaller parts and loop on the largest to
+        // bound the stack depth
+        if (equal >= less && equal >= greater) {
+            multikey_quicksort(text, lines, less, depth);
+            multikey_quicksort(text, greater_lines, greater, depth);
+            lines = equal_lines;
+            count = equal;
+            depth++;
+        } else if (less >= greater) {
+            if (equal > 0) {
+                multikey_quicksort(text, equal_lines, equal, depth + 1);
+            }
+            multikey_quicksort(text, greater_lines, greater, depth);
+            count = less;
+        } else {
+            multikey_quicksort(text, lines, less, depth);
+            if (equal > 0) {
+                multikey_quicksort(text, equal_lines, equal, depth + 1);
+            }
+            lines = greater_lines;
+            count = greater;
         }
-        lines->count++;
     }
 
-    return lines;
+    insertion_sort_lines(text, lines, count, depth);
 }
 
 void sort_lines(LineArray* lines) {
@@ -74,57 +239,511 @@ void sort_lines(LineArray* lines) {
         return;
     }
 
-    // Simple bubble sort
-    for (size_t i = 0; i < lines->count - 1; i++) {
-        for (size_t j = 0; j < lines->count - i - 1; j++) {
-            if (strcmp(lines->lines[j], lines->lines[j + 1]) > 0) {
-                char* temp = lines->lines[j];
-                lines->lines[j] = lines->lines[j + 1];
-                lines->lines[j + 1] = temp;
+    multikey_quicksort(lines->text, lines->lines, lines->count, 0);
+}
+
+// --- Parallel sort ---
+// The array is cut into one chunk per thread and every chunk is sorted
+// concurrently. Regular samples of the sorted chunks give thread - 1
+// splitters, which cut every chunk into segments; each thread then merges
+// one segment of every chunk straight into its final place in the output.
+// Equal lines always fall on the same side of a splitter, so the result is
+// byte-identical to the sequential sort.
+
+#define PARALLEL_SORT_MIN_LINES 65536
+#define MAX_SORT_THREADS 256
+
+typedef struct {
+    const char* text;
+    LineSlice* lines;
+    size_t count;
+} LineRange;
+
+typedef struct {
+    LineRange* ranges;   // The part of every sorted chunk in this segment
+    size_t range_count;
+    LineSlice* output;
+} MergeTask;
+
+static void* sort_chunk_worker(void* arg) {
+    LineRange* chunk = arg;
+    multikey_quicksort(chunk->text, chunk->lines, chunk->count, 0);
+    return NULL;
+}
+
+// Restores the heap order below position i; heap holds range indexes
+static void sift_down_ranges(size_t* heap, size_t size, size_t i, const LineRange* ranges) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < size && compare_line_slices(ranges[0].text, ranges[heap[left]].lines,
+                                               ranges[heap[smallest]].lines) < 0)
+            smallest = left;
+        if (right < size && compare_line_slices(ranges[0].text, ranges[heap[right]].lines,
+                                                ranges[heap[smallest]].lines) < 0)
+            smallest = right;
+        if (smallest == i) {
+            return;
+        }
+        size_t temp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = temp;
+        i = smallest;
+    }
+}
+
+static void* merge_segment_worker(void* arg) {
+    MergeTask* task = arg;
+    size_t heap[task->range_count];
+    size_t size = 0;
+
+    for (size_t r = 0; r < task->range_count; r++) {
+        if (task->ranges[r].count > 0) {
+            heap[size++] = r;
+        }
+    }
+    for (size_t i = size / 2; i-- > 0;) {
+        sift_down_ranges(heap, size, i, task->ranges);
+    }
+
+    LineSlice* out = task->output;
+    while (size > 0) {
+        LineRange* range = &task->ranges[heap[0]];
+        *out++ = range->lines[0];
+        range->lines++;
+        if (--range->count == 0) {
+            heap[0] = heap[--size];
+        }
+        sift_down_ranges(heap, size, 0, task->ranges);
+    }
+    return NULL;
+}
+
+// Index of the first line not less than key
+static size_t lower_bound_line(const char* text, const LineSlice* lines, size_t count,
+                               const LineSlice* key) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_line_slices(text, &lines[mid], key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+typedef struct {
+    void* (*fn)(void*);
+    void* task;
+    uint64_t cpu_ns;     // CPU time of the worker thread, for --stats
+} WorkerCall;
+
+static void* run_worker_call(void* arg) {
+    WorkerCall* call = arg;
+    call->fn(call->task);
+    call->cpu_ns = STATS_THREAD_CPU();
+    return NULL;
+}
+
+// Runs fn over every task, one thread each; tasks whose thread cannot be
+// started run on the calling thread
+static void run_workers(void* (*fn)(void*), void* tasks, size_t task_size, size_t count) {
+    pthread_t threads[count];
+    WorkerCall calls[count];
+    int started[count];
+
+    for (size_t i = 0; i < count; i++) {
+        calls[i].fn = fn;
+        calls[i].task = (char*)tasks + i * task_size;
+        calls[i].cpu_ns = 0;
+        started[i] = pthread_create(&threads[i], NULL, run_worker_call, &calls[i]) == 0;
+        if (!started[i]) {
+            fn(calls[i].task);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+            STATS_ADD_HELPER_CPU(calls[i].cpu_ns);
+        }
+    }
+}
+
+int sort_lines_parallel(LineArray* lines, size_t threads) {
+    if (!lines || !lines->lines) {
+        return 1;
+    }
+    if (threads <= 1 || lines->count < PARALLEL_SORT_MIN_LINES) {
+        sort_lines(lines);
+        return 1;
+    }
+    if (threads > MAX_SORT_THREADS) {
+        threads = MAX_SORT_THREADS;
+    }
+
+    size_t count = lines->count;
+    LineRange* chunks = malloc(threads * sizeof(LineRange));
+    LineRange* ranges = malloc(threads * threads * sizeof(LineRange));
+    MergeTask* tasks = malloc(threads * sizeof(MergeTask));
+    LineSlice* samples = malloc(threads * threads * sizeof(LineSlice));
+    LineSlice* output = malloc(count * sizeof(LineSlice));
+    if (!chunks || !ranges || !tasks || !samples || !output) {
+        handle_memory_error();
+        free(chunks);
+        free(ranges);
+        free(tasks);
+        free(samples);
+        free(output);
+        return 0;
+    }
+
+    // Sort one chunk per thread
+    for (size_t c = 0; c < threads; c++) {
+        size_t start = count * c / threads;
+        size_t end = count * (c + 1) / threads;
+        chunks[c].text = lines->text;
+        chunks[c].lines = lines->lines + start;
+        chunks[c].count = end - start;
+    }
+    run_workers(sort_chunk_worker, chunks, sizeof(LineRange), threads);
+
+    // Pick splitters from regular samples of the sorted chunks
+    for (size_t c = 0; c < threads; c++) {
+        for (size_t j = 0; j < threads; j++) {
+            samples[c * threads + j] = chunks[c].lines[chunks[c].count * j / threads];
+        }
+    }
+    multikey_quicksort(lines->text, samples, threads * threads, 0);
+
+    // Segment j of chunk c holds the lines between splitters j - 1 and j
+    for (size_t c = 0; c < threads; c++) {
+        size_t start = 0;
+        for (size_t j = 0; j < threads; j++) {
+            size_t end = j + 1 < threads
+                ? lower_bound_line(lines->text, chunks[c].lines, chunks[c].count,
+                                   &samples[(j + 1) * threads])
+                : chunks[c].count;
+            if (end < start) {
+                end = start;
             }
+            ranges[j * threads + c].text = lines->text;
+            ranges[j * threads + c].lines = chunks[c].lines + start;
+            ranges[j * threads + c].count = end - start;
+            start = end;
         }
     }
+
+    size_t offset = 0;
+    for (size_t j = 0; j < threads; j++) {
+        tasks[j].ranges = ranges + j * threads;
+        tasks[j].range_count = threads;
+        tasks[j].output = output + offset;
+        for (size_t c = 0; c < threads; c++) {
+            offset += ranges[j * threads + c].count;
+        }
+    }
+    run_workers(merge_segment_worker, tasks, sizeof(MergeTask), threads);
+
+    free(lines->lines);
+    lines->lines = output;
+
+    free(chunks);
+    free(ranges);
+    free(tasks);
+    free(samples);
+    return 1;
 }
 
-char* join_lines(LineArray* lines) {
-    if (!lines || !lines->lines || lines->count == 0) {
-        return NULL;
+// --- Key-based ordering ---
+// Field, numeric and human-size orders decorate every line with its key
+// once, sort the decorated array with a merge sort and then write the lines
+// back in the new order. Lines with equal keys fall back to whole-line byte
+// order unless the sort is stable or unique; the input position settles the
+// rest.
+
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t')
+
+int sort_options_use_keys(const SortOptions* options) {
+    return options->key_field > 0 || options->numeric || options->human;
+}
+
+static LineSlice extract_key(const char* text, const LineSlice* line, const SortOptions* options) {
+    if (options->key_field == 0) {
+        return *line;
     }
 
-    // Calculate total size
-    size_t total_size = 0;
-    for (size_t i = 0; i < lines->count; i++) {
-        total_size += strlen(lines->lines[i]) + 1; // +1 for newline
+    const char* p = text + line->offset;
+    const char* end = p + line->length;
+    const char* key_end;
+    size_t field = 1;
+
+    if (options->separator) {
+        while (field < options->key_field) {
+            const char* sep = memchr(p, options->separator, end - p);
+            if (!sep) {
+                p = end;
+                break;
+            }
+            p = sep + 1;
+            field++;
+        }
+        key_end = memchr(p, options->separator, end - p);
+        if (!key_end) {
+            key_end = end;
+        }
+    } else {
+        // Fields are separated by runs of blanks; leading blanks are skipped
+        while (p < end && IS_BLANK(*p)) p++;
+        while (field < options->key_field && p < end) {
+            while (p < end && !IS_BLANK(*p)) p++;
+            while (p < end && IS_BLANK(*p)) p++;
+            field++;
+        }
+        key_end = p;
+        while (key_end < end && !IS_BLANK(*key_end)) key_end++;
     }
 
-    // Allocate output buffer
-    char* output = malloc(total_size + 1);
-    if (!output) {
+    return make_line_slice(text, p - text, key_end - p);
+}
+
+// Parses a leading decimal number; anything else counts as zero. Human sizes
+// may carry a K, M, G, T, P or E suffix in powers of 1024.
+static double parse_key_number(const char* p, size_t len, int human) {
+    const char* end = p + len;
+    double value = 0.0;
+    int negative = 0;
+
+    while (p < end && IS_BLANK(*p)) p++;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10.0 + (*p++ - '0');
+    }
+    if (p < end && *p == '.') {
+        double scale = 0.1;
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            value += (*p - '0') * scale;
+            scale *= 0.1;
+        }
+    }
+    if (human && p < end) {
+        const char* suffixes = "KMGTPE";
+        const char* suffix = memchr(suffixes, *p == 'k' ? 'K' : *p, 6);
+        if (suffix) {
+            for (long i = 0; i <= suffix - suffixes; i++) {
+                value *= 1024.0;
+            }
+        }
+    }
+    return negative ? -value : value;
+}
+
+KeyedLine make_keyed_line(const char* text, const LineSlice* line,
+                          const SortOptions* options, size_t index) {
+    KeyedLine keyed;
+    keyed.line = *line;
+    keyed.key = extract_key(text, line, options);
+    keyed.number = 0.0;
+    if (options->numeric || options->human) {
+        keyed.number = parse_key_number(text + keyed.key.offset, keyed.key.length, options->human);
+    }
+    keyed.index = index;
+    return keyed;
+}
+
+// Compares the keys alone; this is the equality used by unique
+int compare_sort_keys(const SortOptions* options, const char* text_a, const KeyedLine* a,
+                      const char* text_b, const KeyedLine* b) {
+    if (options->numeric || options->human) {
+        return (a->number > b->number) - (a->number < b->number);
+    }
+    return compare_slices_between(text_a, &a->key, text_b, &b->key);
+}
+
+// Full order: keys, then whole lines unless stable or unique, reversed if
+// requested. Unique keeps the first line of equal keys in input order.
+int compare_keyed_lines(const SortOptions* options, const char* text_a, const KeyedLine* a,
+                        const char* text_b, const KeyedLine* b) {
+    int cmp = compare_sort_keys(options, text_a, a, text_b, b);
+    if (cmp == 0 && !options->stable && !options->unique && sort_options_use_keys(options)) {
+        cmp = compare_slices_between(text_a, &a->line, text_b, &b->line);
+    }
+    return options->reverse ? -cmp : cmp;
+}
+
+static int keyed_line_before(const SortOptions* options, const char* text,
+                             const KeyedLine* a, const KeyedLine* b) {
+    int cmp = compare_keyed_lines(options, text, a, text, b);
+    return cmp < 0 || (cmp == 0 && a->index < b->index);
+}
+
+static void merge_sort_keyed(const SortOptions* options, const char* text,
+                             KeyedLine* lines, KeyedLine* scratch, size_t count) {
+    if (count <= INSERTION_SORT_CUTOFF) {
+        for (size_t i = 1; i < count; i++) {
+            KeyedLine line = lines[i];
+            size_t j = i;
+            while (j > 0 && keyed_line_before(options, text, &line, &lines[j - 1])) {
+                lines[j] = lines[j - 1];
+                j--;
+            }
+            lines[j] = line;
+        }
+        return;
+    }
+
+    size_t half = count / 2;
+    merge_sort_keyed(options, text, lines, scratch, half);
+    merge_sort_keyed(options, text, lines + half, scratch, count - half);
+    if (!keyed_line_before(options, text, &lines[half], &lines[half - 1])) {
+        return; // Already in order
+    }
+
+    memcpy(scratch, lines, half * sizeof(KeyedLine));
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < count) {
+        if (keyed_line_before(options, text, &lines[j], &scratch[i])) {
+            lines[k++] = lines[j++];
+        } else {
+            lines[k++] = scratch[i++];
+        }
+    }
+    while (i < half) {
+        lines[k++] = scratch[i++];
+    }
+}
+
+static int sort_lines_by_keys(LineArray* lines, const SortOptions* options) {
+    size_t count = lines->count;
+    KeyedLine* keyed = malloc(count * sizeof(KeyedLine));
+    KeyedLine* scratch = malloc((count / 2 + 1) * sizeof(KeyedLine));
+    if (!keyed || !scratch) {
         handle_memory_error();
-        return NULL;
+        free(keyed);
+        free(scratch);
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        keyed[i] = make_keyed_line(lines->text, &lines->lines[i], options, i);
+    }
+    merge_sort_keyed(options, lines->text, keyed, scratch, count);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (options->unique && kept > 0 &&
+            compare_sort_keys(options, lines->text, &keyed[i], lines->text, &keyed[i - 1]) == 0) {
+            continue;
+        }
+        lines->lines[kept++] = keyed[i].line;
+    }
+    lines->count = kept;
+
+    free(keyed);
+    free(scratch);
+    return 1;
+}
+
+size_t sort_memory_estimate(size_t line_count, const SortOptions* options, size_t threads) {
+    // Slices, plus the newline index they are built from
+    size_t per_line = sizeof(LineSlice) + sizeof(uint64_t);
+    if (sort_options_use_keys(options)) {
+        per_line += sizeof(KeyedLine) + sizeof(KeyedLine) / 2; // Keyed lines and merge scratch
+    } else if (threads > 1) {
+        per_line += sizeof(LineSlice); // Merge output
+    }
+    return line_count * per_line;
+}
+
+int sort_lines_with_options(LineArray* lines, const SortOptions* options, size_t threads) {
+    if (!lines || !lines->lines) {
+        return 1;
+    }
+
+    STATS_BEGIN(mark);
+    if (sort_options_use_keys(options)) {
+        int ok = sort_lines_by_keys(lines, options);
+        STATS_END(mark, STATS_SORT, 0);
+        return ok;
+    }
+
+    // Whole-line byte order; equal lines are identical, so reversing the
+    // result and dropping neighbours is enough
+    if (!sort_lines_parallel(lines, threads)) {
+        STATS_END(mark, STATS_SORT, 0);
+        return 0;
+    }
+    if (options->reverse) {
+        for (size_t i = 0, j = lines->count; i + 1 < j; i++, j--) {
+            swap_lines(lines->lines, i, j - 1);
+        }
+    }
+    if (options->unique && lines->count > 0) {
+        size_t kept = 1;
+        for (size_t i = 1; i < lines->count; i++) {
+            if (compare_line_slices(lines->text, &lines->lines[i], &lines->lines[kept - 1]) != 0) {
+                lines->lines[kept++] = lines->lines[i];
+            }
+        }
+        lines->count = kept;
     }
+    STATS_END(mark, STATS_SORT, 0);
+    return 1;
+}
 
-    // Join lines
+size_t joined_lines_size(const LineArray* lines) {
+    size_t terminator_len = lines->crlf ? 2 : 1;
+    size_t total_size = 0;
+    for (size_t i = 0; i < lines->count; i++) {
+        total_size += lines->lines[i].length + terminator_len;
+    }
+    return total_size;
+}
+
+size_t join_lines_into(const LineArray* lines, char* output) {
+    STATS_BEGIN(mark);
     size_t pos = 0;
     for (size_t i = 0; i < lines->count; i++) {
-        size_t line_len = strlen(lines->lines[i]);
-        strcpy(output + pos, lines->lines[i]);
-        pos += line_len;
+        const LineSlice* line = &lines->lines[i];
+        memcpy(output + pos, lines->text + line->offset, line->length);
+        pos += line->length;
+        if (lines->crlf) {
+            output[pos++] = '\r';
+        }
         output[pos++] = '\n';
     }
+    STATS_END(mark, STATS_JOIN, pos);
+    return pos;
+}
 
+char* join_lines(LineArray* lines, size_t* output_len) {
+    if (!lines || !lines->lines || lines->count == 0) {
+        *output_len = 0;
+        return NULL;
+    }
+
+    // Allocate output buffer
+    char* output = malloc(joined_lines_size(lines) + 1);
+    if (!output) {
+        handle_memory_error();
+        *output_len = 0;
+        return NULL;
+    }
+
+    size_t pos = join_lines_into(lines, output);
     output[pos] = '\0';
+    *output_len = pos;
     return output;
 }
 
 void free_line_array(LineArray* lines) {
     if (lines) {
-        if (lines->lines) {
-            for (size_t i = 0; i < lines->count; i++) {
-                free(lines->lines[i]);
-            }
-            free(lines->lines);
-        }
+        free(lines->lines);
         free(lines);
     }
-} 
\ No newline at end of file
+}
@@ -0,0 +1,142 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../include/stats.h"
+#include "../include/cpu.h"
+#include <time.h>
+#include <sys/resource.h>
+
+int stats_enabled = 0;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint64_t bytes;
+} PhaseTotals;
+
+static const char* const phase_names[STATS_PHASE_COUNT] = {
+    "read", "histogram", "tree", "codes", "encode", "decode", "cipher",
+    "search", "split", "sort", "dedup", "join", "chunk", "fingerprint", "write"
+};
+
+static PhaseTotals phase_totals[STATS_PHASE_COUNT];
+static uint64_t allocation_count = 0;
+static uint64_t started_ns = 0;
+
+// CPU time of joined worker threads, counted as this thread's
+static __thread uint64_t helper_cpu_ns = 0;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0) {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void add_total(uint64_t* total, uint64_t value) {
+    __atomic_add_fetch(total, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t load_total(const uint64_t* total) {
+    return __atomic_load_n(total, __ATOMIC_RELAXED);
+}
+
+void stats_enable(void) {
+    started_ns = clock_ns(CLOCK_MONOTONIC);
+    stats_enabled = 1;
+}
+
+void stats_read_clocks(StatsMark* mark) {
+    mark->wall_ns = clock_ns(CLOCK_MONOTONIC);
+    mark->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) + helper_cpu_ns;
+}
+
+uint64_t stats_thread_cpu_ns(void) {
+    return stats_enabled ? clock_ns(CLOCK_THREAD_CPUTIME_ID) : 0;
+}
+
+void stats_add_helper_cpu(uint64_t cpu_ns) {
+    helper_cpu_ns += cpu_ns;
+}
+
+void stats_record(const StatsMark* start, StatsPhase phase, uint64_t bytes) {
+    StatsMark now;
+    stats_read_clocks(&now);
+    PhaseTotals* totals = &phase_totals[phase];
+    add_total(&totals->calls, 1);
+    add_total(&totals->wall_ns, now.wall_ns - start->wall_ns);
+    add_total(&totals->cpu_ns, now.cpu_ns - start->cpu_ns);
+    add_total(&totals->bytes, bytes);
+}
+
+void stats_note_allocation(void) {
+    if (stats_enabled) {
+        add_total(&allocation_count, 1);
+    }
+}
+
+static uint64_t timeval_ns(struct timeval tv) {
+    return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000ULL;
+}
+
+static double ms(uint64_t ns) {
+    return (double)ns / 1e6;
+}
+
+void stats_report(FILE* out, int json) {
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t wall_ns = clock_ns(CLOCK_MONOTONIC) - started_ns;
+    uint64_t bytes_in = load_total(&phase_totals[STATS_READ].bytes);
+    uint64_t bytes_out = load_total(&phase_totals[STATS_WRITE].bytes);
+    double ratio = bytes_in ? (double)bytes_out / (double)bytes_in : 0.0;
+    // ru_maxrss is in kilobytes on Linux
+    unsigned long long peak_rss = (unsigned long long)usage.ru_maxrss * 1024ULL;
+
+    if (json) {
+        fprintf(out, "{\"phases\":{");
+        int first = 1;
+        for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+            const PhaseTotals* totals = &phase_totals[i];
+            if (load_total(&totals->calls) == 0) {
+                continue;
+            }
+            fprintf(out, "%s\"%s\":{\"calls\":%llu,\"wall_ns\":%llu,\"cpu_ns\":%llu,\"bytes\":%llu}",
+                    first ? "" : ",", phase_names[i],
+                    (unsigned long long)load_total(&totals->calls),
+                    (unsigned long long)load_total(&totals->wall_ns),
+                    (unsigned long long)load_total(&totals->cpu_ns),
+                    (unsigned long long)load_total(&totals->bytes));
+            first = 0;
+        }
+        fprintf(out, "},\"wall_ns\":%llu,\"user_cpu_ns\":%llu,\"system_cpu_ns\":%llu,"
+                     "\"bytes_in\":%llu,\"bytes_out\":%llu,\"ratio\":%.4f,"
+                     "\"allocations\":%llu,\"peak_rss_bytes\":%llu,\"cpu\":\"%s\"}\n",
+                (unsigned long long)wall_ns,
+                (unsigned long long)timeval_ns(usage.ru_utime),
+                (unsigned long long)timeval_ns(usage.ru_stime),
+                (unsigned long long)bytes_in, (unsigned long long)bytes_out, ratio,
+                (unsigned long long)load_total(&allocation_count), peak_rss,
+                cpu_level_name(cpu_level()));
+        return;
+    }
+
+    fprintf(out, "%-11s %8s %12s %12s %14s\n", "phase", "calls", "wall ms", "cpu ms", "bytes");
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        const PhaseTotals* totals = &phase_totals[i];
+        if (load_total(&totals->calls) == 0) {
+            continue;
+        }
+        fprintf(out, "%-11s %8llu %12.3f %12.3f %14llu\n", phase_names[i],
+                (unsigned long long)load_total(&totals->calls),
+                ms(load_total(&totals->wall_ns)), ms(load_total(&totals->cpu_ns)),
+                (unsigned long long)load_total(&totals->bytes));
+    }
+    fprintf(out, "total wall %.3f ms, user cpu %.3f ms, system cpu %.3f ms\n",
+            ms(wall_ns), ms(timeval_ns(usage.ru_utime)), ms(timeval_ns(usage.ru_stime)));
+    fprintf(out, "bytes in %llu, bytes out %llu, ratio %.4f\n",
+            (unsigned long long)bytes_in, (unsigned long long)bytes_out, ratio);
+    fprintf(out, "allocations %llu, peak rss %llu bytes, cpu kernels %s\n",
+            (unsigned long long)load_total(&allocation_count), peak_rss, cpu_level_name(cpu_level()));
+}
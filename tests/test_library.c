@@ -0,0 +1,314 @@
+#include "../include/fileprocessor.h"
+#include "../include/io.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Library tests, run by make test. Everything goes through the public API
+ * of libfileprocessor: both compression models and the cipher round-trip
+ * in uneven chunks, fp_sort and fp_search produce the command line's
+ * output, and damaged or legacy input is decoded without the process
+ * exiting. Prints one line per failed check and exits 1 if any failed.
+ */
+
+#define TEST_KEY "test-key-0123"
+#define TEST_CHUNK 4093      // Uneven, so frames and lines straddle feeds
+#define TEST_TEXT_SIZE (5 * 1024 * 1024 / 2) // Spans several 1 MiB blocks
+
+static int failures;
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+static void check(int ok, const char* what, int line) {
+    if (!ok) {
+        fprintf(stderr, "test_library.c:%d: check failed: %s\n", line, what);
+        failures++;
+    }
+}
+
+// Log-like lines from a fixed seed, so every run compresses the same input
+static char* make_text(size_t size) {
+    static const char* const words[] = {
+        "GET", "POST", "status=200", "status=404", "status=500", "user", "session",
+        "/index.html", "/api/v1/items", "latency_ms=12", "latency_ms=340", "ERROR", "INFO"
+    };
+    char* text = malloc(size);
+    if (!text) {
+        return NULL;
+    }
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t used = 0;
+    while (used < size) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        const char* word = words[(state >> 33) % (sizeof(words) / sizeof(words[0]))];
+        int line_end = (state >> 20) % 8 == 0;
+        size_t word_len = strlen(word);
+        for (size_t i = 0; i < word_len && used < size; i++) {
+            text[used++] = word[i];
+        }
+        if (used < size) {
+            text[used++] = line_end ? '\n' : ' ';
+        }
+    }
+    return text;
+}
+
+// Appends waiting output to a growing buffer; returns 0 if it cannot grow
+static int drain_into(FpStream* stream, char** output, size_t* output_len, size_t* capacity) {
+    for (;;) {
+        if (*capacity - *output_len < TEST_CHUNK) {
+            size_t grown_capacity = *capacity ? *capacity * 2 : 1 << 16;
+            char* grown = realloc(*output, grown_capacity);
+            if (!grown) {
+                return 0;
+            }
+            *output = grown;
+            *capacity = grown_capacity;
+        }
+        size_t produced;
+        fp_stream_drain(stream, *output + *output_len, TEST_CHUNK, &produced);
+        if (produced == 0) {
+            return 1;
+        }
+        *output_len += produced;
+    }
+}
+
+/*
+ * Runs input through a stream in TEST_CHUNK pieces, draining as it goes.
+ * Returns the whole output, possibly empty, in a new buffer with its
+ * length in *output_len and the final status in *status.
+ */
+static char* run_stream(FpOperation operation, const char* key, const char* input, size_t len,
+                        size_t* output_len, FpStatus* status) {
+    char* output = NULL;
+    size_t capacity = 0;
+    *output_len = 0;
+    FpStream* stream = fp_create_stream(operation, key, status);
+    if (!stream) {
+        return NULL;
+    }
+
+    size_t offset = 0;
+    while (*status == FP_OK && offset < len) {
+        size_t piece = len - offset < TEST_CHUNK ? len - offset : TEST_CHUNK;
+        size_t consumed;
+        *status = fp_stream_feed(stream, input + offset, piece, &consumed);
+        offset += consumed;
+        if (!drain_into(stream, &output, output_len, &capacity)) {
+            *status = FP_ERROR_MEMORY;
+        }
+    }
+    if (*status == FP_OK) {
+        *status = fp_stream_finish(stream);
+    }
+    if (!drain_into(stream, &output, output_len, &capacity) && *status == FP_OK) {
+        *status = FP_ERROR_MEMORY;
+    }
+    fp_free_stream(stream);
+    return output;
+}
+
+static void test_round_trip(FpOperation operation, const char* magic, const char* text, size_t len) {
+    size_t compressed_len, restored_len;
+    FpStatus status;
+    char* compressed = run_stream(operation, NULL, text, len, &compressed_len, &status);
+    CHECK(status == FP_OK);
+    CHECK(compressed && compressed_len > 4 && memcmp(compressed, magic, 4) == 0);
+    CHECK(compressed_len < len / 4 * 3 || len == 0);
+
+    char* restored = run_stream(FP_DECOMPRESS, NULL, compressed ? compressed : "", compressed_len,
+                                &restored_len, &status);
+    CHECK(status == FP_OK);
+    CHECK(restored_len == len && (len == 0 || memcmp(restored, text, len) == 0));
+    free(compressed);
+    free(restored);
+}
+
+static void test_cipher(const char* text, size_t len) {
+    size_t encrypted_len, decrypted_len;
+    FpStatus status;
+    char* encrypted = run_stream(FP_ENCRYPT, TEST_KEY, text, len, &encrypted_len, &status);
+    CHECK(status == FP_OK && encrypted_len == len && memcmp(encrypted, text, len) != 0);
+
+    char* decrypted = run_stream(FP_DECRYPT, TEST_KEY, encrypted, encrypted_len, &decrypted_len, &status);
+    CHECK(status == FP_OK && decrypted_len == len && memcmp(decrypted, text, len) == 0);
+    free(encrypted);
+    free(decrypted);
+}
+
+// Damaged input must come back as an error, never exit the process or
+// pass as a successful decode
+static void test_corrupt(const char* text, size_t len) {
+    size_t output_len;
+    FpStatus status;
+
+    // Random bytes read as the original single-block format, whose length
+    // field then asks for an absurd allocation
+    char noise[8192];
+    uint64_t state = 12345;
+    for (size_t i = 0; i < sizeof(noise); i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        noise[i] = (char)(state >> 56);
+    }
+    char* output = run_stream(FP_DECOMPRESS, NULL, noise, sizeof(noise), &output_len, &status);
+    CHECK(status == FP_ERROR_CORRUPT);
+    free(output);
+
+    // A stream cut off in its first frame
+    size_t compressed_len;
+    char* compressed = run_stream(FP_COMPRESS, NULL, text, len, &compressed_len, &status);
+    CHECK(status == FP_OK);
+    if (compressed) {
+        output = run_stream(FP_DECOMPRESS, NULL, compressed, compressed_len / 3, &output_len, &status);
+        CHECK(status == FP_ERROR_CORRUPT);
+        free(output);
+    }
+    free(compressed);
+
+    // A context-coded stream whose first frame claims more bytes than a block holds
+    compressed = run_stream(FP_COMPRESS_CONTEXT, NULL, text, len, &compressed_len, &status);
+    CHECK(status == FP_OK);
+    if (compressed) {
+        size_t frame_varint = 4;
+        while ((unsigned char)compressed[frame_varint] & 0x80) {
+            frame_varint++;
+        }
+        memcpy(compressed + frame_varint + 1, "\xff\xff\x7f", 3); // Block length 2^21 - 1
+        output = run_stream(FP_DECOMPRESS, NULL, compressed, compressed_len, &output_len, &status);
+        CHECK(status == FP_ERROR_CORRUPT);
+        free(output);
+    }
+    free(compressed);
+}
+
+// The original format: 256 host-order unsigned frequencies, the length as
+// a host size_t, then the bitstream. A single distinct byte has no bits.
+static void test_legacy(void) {
+    unsigned frequencies[256] = { 0 };
+    size_t length = 5;
+    char block[sizeof(frequencies) + sizeof(length)];
+    frequencies['a'] = 5;
+    memcpy(block, frequencies, sizeof(frequencies));
+    memcpy(block + sizeof(frequencies), &length, sizeof(length));
+
+    size_t output_len;
+    FpStatus status;
+    char* output = run_stream(FP_DECOMPRESS, NULL, block, sizeof(block), &output_len, &status);
+    CHECK(status == FP_OK && output_len == 5 && memcmp(output, "aaaaa", 5) == 0);
+    free(output);
+
+    // Frequencies that do not add up to the length
+    length = (size_t)1 << 40;
+    memcpy(block + sizeof(frequencies), &length, sizeof(length));
+    output = run_stream(FP_DECOMPRESS, NULL, block, sizeof(block), &output_len, &status);
+    CHECK(status == FP_ERROR_CORRUPT);
+    free(output);
+}
+
+static void test_sort(void) {
+    char output[64];
+    size_t produced;
+    const char* fruit = "pear\napple\nfig";
+    CHECK(fp_sort(fruit, strlen(fruit), NULL, 1, output, sizeof(output), &produced) == FP_OK);
+    CHECK(produced == 15 && memcmp(output, "apple\nfig\npear\n", 15) == 0);
+
+    // Second field, numerically, largest first
+    SortOptions options = { 2, ' ', 1, 0, 1, 0, 0 };
+    const char* sizes = "a 10\nb 9\nc 100\n";
+    CHECK(fp_sort(sizes, strlen(sizes), &options, 1, output, sizeof(output), &produced) == FP_OK);
+    CHECK(produced == 15 && memcmp(output, "c 100\na 10\nb 9\n", 15) == 0);
+
+    CHECK(fp_sort(sizes, strlen(sizes), &options, 1, output, 4, &produced) ==
+          FP_ERROR_BUFFER_TOO_SMALL);
+    CHECK(produced == 15);
+}
+
+// Feeds text a byte at a time, so every line is carried across feeds, and
+// returns the output
+static FpStatus run_search(const char* keyword, const SearchOptions* options, const char* text,
+                           char* output, size_t capacity, size_t* output_len, size_t* matches) {
+    FpStatus status;
+    FpSearch* search = fp_create_search(keyword, options, "input", &status);
+    if (!search) {
+        return status;
+    }
+    *output_len = 0;
+    size_t len = strlen(text);
+    for (size_t i = 0; status == FP_OK && i < len && !fp_search_done(search); i++) {
+        size_t consumed;
+        status = fp_search_feed(search, text + i, 1, &consumed);
+    }
+    if (status == FP_OK) {
+        status = fp_search_finish(search, matches);
+    }
+    size_t produced = 0;
+    if (status == FP_OK) {
+        status = fp_search_drain(search, output, capacity, &produced);
+    }
+    *output_len = produced;
+    fp_free_search(search);
+    return status;
+}
+
+static void test_search(void) {
+    const char* text = "one error\ntwo\nthree erorr\nfour error";
+    char output[128];
+    size_t output_len, matches;
+
+    SearchOptions options = { 0 };
+    CHECK(run_search("error", &options, text, output, sizeof(output), &output_len, &matches) == FP_OK);
+    const char* expected = "Search results:\n1: one error\n4: four error\n";
+    CHECK(matches == 2 && output_len == strlen(expected) && memcmp(output, expected, output_len) == 0);
+
+    options.count_only = 1;
+    CHECK(run_search("error", &options, text, output, sizeof(output), &output_len, &matches) == FP_OK);
+    CHECK(output_len == 2 && memcmp(output, "2\n", 2) == 0);
+
+    // One transposition is two edits
+    options.fuzzy = 1;
+    options.max_errors = 2;
+    CHECK(run_search("error", &options, text, output, sizeof(output), &output_len, &matches) == FP_OK);
+    CHECK(matches == 3);
+
+    SearchOptions first = { 0 };
+    first.files_with_matches = 1;
+    CHECK(run_search("two", &first, text, output, sizeof(output), &output_len, &matches) == FP_OK);
+    CHECK(output_len == 6 && memcmp(output, "input\n", 6) == 0);
+}
+
+int main(void) {
+    // The corrupt inputs are expected to fail; keep their messages out of the report
+    FILE* quiet = fopen("/dev/null", "w");
+    if (quiet) {
+        redirect_thread_stdio(NULL, NULL, quiet);
+    }
+
+    char* text = make_text(TEST_TEXT_SIZE);
+    if (!text) {
+        fprintf(stderr, "test_library.c: out of memory\n");
+        return 1;
+    }
+    test_round_trip(FP_COMPRESS, "FPH2", text, TEST_TEXT_SIZE);
+    test_round_trip(FP_COMPRESS_CONTEXT, "FPC1", text, TEST_TEXT_SIZE);
+    test_round_trip(FP_COMPRESS, "FPH2", "", 0);
+    test_cipher(text, TEST_TEXT_SIZE);
+    test_corrupt(text, TEST_TEXT_SIZE);
+    test_legacy();
+    test_sort();
+    test_search();
+    free(text);
+
+    redirect_thread_stdio(NULL, NULL, NULL);
+    if (quiet) {
+        fclose(quiet);
+    }
+    if (failures) {
+        fprintf(stderr, "%d library checks failed\n", failures);
+        return 1;
+    }
+    printf("All library checks passed\n");
+    return 0;
+}